@@ -23,6 +23,7 @@
 #define GGL_MAXVERTEXTEXTUREIMAGEUNITS 8  
 #define GGL_MAXCOMBINEDTEXTUREIMAGEUNITS 16 /* samplers used in vertex + fragment */
 #define GGL_MAXTEXTUREIMAGEUNITS 8 /* samplers used in fragment only */      
+#define GGL_MAXTEXTURELEVELS 13 /* mipmap levels, up to 4096 texels wide */
 #define GGL_MAXFRAGMENTUNIFORMVECTORS 16
 #define GGL_MAXDRAWBUFFERS 2
 
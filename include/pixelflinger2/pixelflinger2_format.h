@@ -60,7 +60,9 @@ enum GGLPixelFormat {
     // reserved range. don't use.
     GGL_PIXEL_FORMAT_RESERVED_20 = 0x20,
     GGL_PIXEL_FORMAT_RESERVED_21 = 0x21,
-    
+
+    // pixelflinger2 texture only formats
+    GGL_PIXEL_FORMAT_ETC1        = 0x22, // ETC1 RGB, 64-bit big endian blocks of 4x4 texels
     
     // must be last
     GGL_PIXEL_FORMAT_COUNT      = 0xFF
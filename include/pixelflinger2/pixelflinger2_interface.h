@@ -19,6 +19,10 @@
 #define _PIXELFLINGER2_INTERFACE_H_
 
 #include "GLES2/gl2.h"
+
+#ifndef GL_PERSPECTIVE_CORRECTION_HINT
+#define GL_PERSPECTIVE_CORRECTION_HINT 0x0C50 // from GL ES 1.x, see Hint
+#endif
 #include "pixelflinger2/pixelflinger2_format.h"
 #include "pixelflinger2/pixelflinger2_constants.h"
 #include "pixelflinger2/pixelflinger2_vector4.h"
@@ -57,12 +61,12 @@ typedef struct GGLSurface {
 typedef struct GGLTexture {
    unsigned type; // GL_TEXTURE_2D, or GL_TEXTURE_CUBE_MAP
 
-   // currently only support RGBA_8888, RGBX_8888 and RGB_565
-   // storage uses either int or short
+   // currently only support RGBA_8888, RGBX_8888, RGB_565, A_8, L_8, LA_88 and ETC1
+   // storage uses int, short or byte; ETC1 blocks always use block order, whatever the layout
    enum GGLPixelFormat format; // affects vs/fs jit
 
    unsigned width, height; // base level dimension
-   unsigned levelCount; // mipmapped texture requires power-of-2 width and height
+   unsigned levelCount; // mipmapped texture requires power-of-2 width and height; <= GGL_MAXTEXTURELEVELS
 
    // data layout is level 0 of first surface (cubemap +x), level 0 of second surface (for cube map, -x),
    // level 0 of 3rd surface (cubemap +y), cubemap level 0 -y, cubemap level 0 +z,
@@ -77,12 +81,21 @@ typedef struct GGLTexture {
 2, wrapT :
    2;
 
+   // mipmap filters select levels of 2D textures by the fragment shader's texcoord derivatives;
+   // vertex shaders and cube maps sample level 0 with magFilter
    enum GGLTextureMinFilter {
-      GGL_NEAREST = 0, GGL_LINEAR, /*GGL_NEAREST_MIPMAP_NEAREST = 2,
-      GGL_LINEAR_MIPMAP_NEAREST, GGL_NEAREST_MIPMAP_LINEAR, GGL_LINEAR_MIPMAP_LINEAR = 5*/
+      GGL_NEAREST = 0, GGL_LINEAR, GGL_NEAREST_MIPMAP_NEAREST = 2,
+      GGL_LINEAR_MIPMAP_NEAREST, GGL_NEAREST_MIPMAP_LINEAR, GGL_LINEAR_MIPMAP_LINEAR = 5
 } minFilter :
-1, magFilter :
-   1; // only GGL_NEAREST and GGL_LINEAR
+   3;
+   unsigned magFilter : 1; // only GGL_NEAREST or GGL_LINEAR, too narrow for the enum
+
+   // texel order within each level; affects vs/fs jit, see GGLTextureSetLayout
+   enum GGLTextureLayout {
+      GGL_TEXTURE_LINEAR = 0, // rows of texels
+      GGL_TEXTURE_TILED = 1 // rows of 4x4 texel tiles, each row major; levels padded to whole tiles
+} layout :
+   1;
 } GGLTexture_t;
 
 typedef struct GGLStencilState {
@@ -112,6 +125,8 @@ unsigned depthTest :
    // GL_GEQUAL, GL_ALWAYS = 7; value = GLenum  & 0x7 (GLenum is 0x200-0x207)
 unsigned depthFunc :
    3;
+unsigned perspective :
+   1; // varyings interpolated perspective correctly, see Hint
 } GGLBufferState_t;
 
 typedef struct GGLBlendState { // all values affect scanline jit
@@ -148,6 +163,9 @@ typedef struct GGLTextureState {
    void * textureData[GGL_MAXCOMBINEDTEXTUREIMAGEUNITS];
    // array of texture dimensions synced to textures; by LLVM generated texture sampler
    unsigned textureDimensions[GGL_MAXCOMBINEDTEXTUREIMAGEUNITS * 2];
+   // per sampler, the last level followed by the texel offset of each level from textureData;
+   // synced to textures, used by LLVM generated texture sampler for mipmaps
+   unsigned textureLevels[GGL_MAXCOMBINEDTEXTUREIMAGEUNITS * (GGL_MAXTEXTURELEVELS + 1)];
 } GGLTextureState_t;
 
 typedef struct GGLState {
@@ -161,6 +179,57 @@ typedef struct GGLState {
 
 } GGLState_t;
 
+// JIT instance lookups by ShaderUse since the last reset, see ShaderCacheStats
+typedef struct GGLShaderCacheStats {
+   unsigned hits, misses; // ShaderKey found, or JIT needed
+   unsigned evictions; // instances freed to stay within budget
+   unsigned instances, bytes; // currently kept, and their estimated size
+} GGLShaderCacheStats_t;
+
+// phases of shader compile, link and JIT, see GGLShaderStats
+enum GGLShaderPhase {
+   GGL_SHADER_PREPROCESS = 0, // glcpp
+   GGL_SHADER_PARSE, // lexer and parser to AST
+   GGL_SHADER_AST_TO_HIR,
+   GGL_SHADER_OPTIMIZE, // do_common_optimization loop
+   GGL_SHADER_LINK, // link_shaders
+   GGL_SHADER_IR_TO_LLVM, // glsl_ir_to_llvm_module
+   GGL_SHADER_GENERATE, // GenerateScanLine or GenerateVertexBatch
+   GGL_SHADER_LLVM_OPTIMIZE, // LLVM passes before codegen
+   GGL_SHADER_CODEGEN, // libbcc
+   GGL_SHADER_PHASES
+};
+
+// time and memory of shader phases, and the size of what they produced
+typedef struct GGLShaderStats {
+   unsigned runs[GGL_SHADER_PHASES];
+   unsigned long long nanoseconds[GGL_SHADER_PHASES];
+   int bytes[GGL_SHADER_PHASES]; // net hieralloc growth of shader or program; compile and link only
+   unsigned irBefore, irAfter; // GLSL IR instructions before and after optimization
+   unsigned optimizeLoops; // do_common_optimization iterations
+   unsigned llvmInstructions; // after LLVM passes
+   unsigned codeBytes; // estimated machine code and kept bitcode
+} GGLShaderStats_t;
+
+// primitives counted by triangle setup, and optionally pipeline work, since the last reset,
+// see GetCounters
+typedef struct GGLCounters {
+   unsigned triangles; // submitted by DrawTriangle and DrawElements
+   unsigned culled; // facing selected by CullFace while GL_CULL_FACE is enabled
+   unsigned rejected; // zero area, or outside the view frustum
+   unsigned clipped; // crossing near, far or guard band planes
+
+   // the rest stay 0 unless built with USE_RASTER_COUNTERS
+   unsigned vertices; // vertex shader invocations
+   unsigned scanlines, pixels; // spans handed to fragment processing, and their pixels
+   unsigned stencilRejects, depthRejects;
+   unsigned shaded; // fragment shader runs that passed stencil and depth tests
+   unsigned blended;
+   // nanoseconds in vertex shading; clip, cull and setup (or binning); rastering, summed over
+   // raster threads; and waiting on raster threads
+   unsigned long long vertexTime, setupTime, rasterTime, waitTime;
+} GGLCounters_t;
+
 // most functions are according to GL ES 2.0 spec and uses GLenum values
 // there is some error checking for invalid GLenum
 typedef struct GGLInterface GGLInterface_t;
@@ -179,6 +248,9 @@ struct GGLInterface {
    void (* BlendFuncSeparate)(GGLInterface_t * iface, GLenum srcRGB, GLenum dstRGB,
                               GLenum srcAlpha, GLenum dstAlpha);
    void (* EnableDisable)(GGLInterface_t * iface, GLenum cap, GLboolean enable);
+   // GL_PERSPECTIVE_CORRECTION_HINT with GL_NICEST for perspective correct varyings,
+   // costing a reciprocal per fragment; GL_FASTEST or GL_DONT_CARE (default) for linear
+   void (* Hint)(GGLInterface_t * iface, GLenum target, GLenum mode);
 
    void (* DepthFunc)(GGLInterface_t * iface, GLenum func);
    void (* StencilFuncSeparate)(GGLInterface_t * iface, GLenum face, GLenum func,
@@ -197,16 +269,24 @@ struct GGLInterface {
    void (* SetSampler)(GGLInterface_t * iface, const unsigned sampler, GGLTexture_t * texture);
 
    // shallow copy, surface data must remain valid; use GL_COLOR_BUFFER_BIT,
-   // GL_DEPTH_BUFFER_BIT, GL_STENCIL_BUFFER_BIT; format must be RGBA_8888, Z_32 or S_8
+   // GL_DEPTH_BUFFER_BIT, GL_STENCIL_BUFFER_BIT; color format must be RGBA_8888, RGBX_8888,
+   // BGRA_8888, RGB_565, RGBA_4444 or RGBA_5551, depth Z_32 and stencil S_8
    void (* SetBuffer)(GGLInterface_t * iface, const GLenum type, GGLSurface_t * surface);
 
 
    // runs active vertex shader using currently set program; no error checking
    void (* ProcessVertex)(const GGLInterface_t * iface, const VertexInput_t * input,
                           VertexOutput_t * output);
+   // runs active vertex shader on count consecutive vertices
+   void (* ProcessVertices)(const GGLInterface_t * iface, const VertexInput_t * inputs,
+                            VertexOutput_t * outputs, unsigned count);
    // draws a triangle given 3 unprocessed vertices; should be moved into libAgl2
    void (* DrawTriangle)(const GGLInterface_t * iface, const VertexInput_t * v0,
                          const VertexInput_t * v1, const VertexInput_t * v2);
+   // GL_TRIANGLES, GL_TRIANGLE_STRIP or GL_TRIANGLE_FAN; vertices shared by nearby
+   // triangles are processed once through a post-transform cache keyed by index
+   void (* DrawElements)(const GGLInterface_t * iface, GLenum mode, GLsizei count,
+                         const unsigned * indices, const VertexInput_t * vertices);
    // rasters a vertex processed triangle using active program; scizors to frame surface
    void (* RasterTriangle)(const GGLInterface_t * iface, const VertexOutput_t * v1,
                            const VertexOutput_t * v2, const VertexOutput_t * v3);
@@ -219,6 +299,20 @@ struct GGLInterface {
    void (* ScanLine)(const GGLInterface_t * iface, const VertexOutput_t * v1,
                      const VertexOutput_t * v2);
 
+   // triangles are binned into screen tiles and rastered by a pool of threads;
+   // waits until all of them are written, call before reading or reusing surface data
+   void (* Finish)(const GGLInterface_t * iface);
+   // number of raster threads, 0 for number of online cpus; default is 0
+   void (* SetThreadCount)(GGLInterface_t * iface, unsigned count);
+   // while deferred, state setters, SetSampler, SetBuffer, ShaderUse, Clear and Draw*
+   // are recorded with their arguments and uniforms, and executed by Flush or Finish;
+   // surface and texture data must stay valid until then, vertices are copied
+   void (* SetDeferred)(GGLInterface_t * iface, GLboolean enable);
+   // executes recorded calls and starts rastering binned triangles without waiting
+   void (* Flush)(GGLInterface_t * iface);
+   // copies counters since last reset, then resets them if reset is GL_TRUE
+   void (* GetCounters)(GGLInterface_t * iface, GGLCounters_t * counters, GLboolean reset);
+
    // creates empty shader
    gl_shader_t * (* ShaderCreate)(const GGLInterface_t * iface, GLenum type);
 
@@ -241,13 +335,38 @@ struct GGLInterface {
    void (* ShaderDetach)(const GGLInterface_t * iface, gl_shader_program_t * program,
                          gl_shader_t * shader);
 
-   // duplicates shaders to program, and links varyings / attributes
-   GLboolean (* ShaderProgramLink)(gl_shader_program_t * program, const char ** infoLog);
-   // frees program
+   // duplicates shaders to program, and links varyings / attributes; waits for triangles
+   // being drawn with program
+   GLboolean (* ShaderProgramLink)(GGLInterface_t * iface, gl_shader_program_t * program,
+                                   const char ** infoLog);
+   // frees program, after triangles being drawn with it
    void (* ShaderProgramDelete)(GGLInterface_t * iface, gl_shader_program_t * program);
 
    // LLVM JIT and set as active program
    void (* ShaderUse)(GGLInterface_t * iface, gl_shader_program_t * program);
+   // directory keeping generated code across runs, NULL (default) to disable; see GGLShaderCacheDir
+   void (* ShaderCacheDir)(const GGLInterface_t * iface, const char * dir);
+   // estimated bytes of JIT instances kept in memory, least recently used are freed first;
+   // 0 for unlimited, default is GGL_SHADER_CACHE_BUDGET; process wide
+   void (* ShaderCacheBudget)(const GGLInterface_t * iface, unsigned bytes);
+   // copies JIT instance statistics since last reset, then resets them if reset is GL_TRUE
+   void (* ShaderCacheStats)(const GGLInterface_t * iface, GGLShaderCacheStats_t * stats,
+                             GLboolean reset);
+   // LLVM optimization levels 0-3 like -O: new JIT instances are compiled at firstLevel, then
+   // fragment shaders drawn hotDraws raster batches are recompiled at hotLevel in the background;
+   // hotDraws 0 disables recompiling; defaults are GGL_JIT_FIRST/HOT_LEVEL and GGL_JIT_HOT_DRAWS
+   void (* ShaderOptimization)(const GGLInterface_t * iface, unsigned firstLevel,
+                               unsigned hotLevel, unsigned hotDraws);
+   // fragment shaders drawn uniformDraws raster batches without uniform changes are recompiled
+   // in the background with the values as constants, until a value changes; 0 (default) is off
+   void (* ShaderSpecializeUniforms)(const GGLInterface_t * iface, unsigned uniformDraws);
+   // copies phase statistics of shader since its compile, or process wide since last reset if
+   // shader is NULL, then resets them if reset is GL_TRUE; JIT phases are of linked shaders
+   void (* ShaderGetStats)(const GGLInterface_t * iface, gl_shader_t * shader,
+                           GGLShaderStats_t * stats, GLboolean reset);
+   // sums phase statistics of program link, compile of attached and JIT of linked shaders
+   void (* ShaderProgramGetStats)(const GGLInterface_t * iface,
+                                  const gl_shader_program_t * program, GGLShaderStats_t * stats);
 
    void (* ShaderGetiv)(const gl_shader_t * shader, const GLenum pname, GLint * params);
 
@@ -278,11 +397,11 @@ struct GGLInterface {
                                      int sampler2tmu[GGL_MAXCOMBINEDTEXTUREIMAGEUNITS]);
 
    // updates linked program uniform value by location; return >= 0 indicates sampler assigned
-   GLint (* ShaderUniform)(gl_shader_program_t * program,
+   GLint (* ShaderUniform)(GGLInterface_t * iface, gl_shader_program_t * program,
                            GLint location, GLsizei count, const GLvoid *values, GLenum type);
 
    // updates linked program uniform matrix value by location
-   void (* ShaderUniformMatrix)(gl_shader_program_t * program, GLint cols,
+   void (* ShaderUniformMatrix)(GGLInterface_t * iface, gl_shader_program_t * program, GLint cols,
                                 GLint rows, GLint location, GLsizei count,
                                 GLboolean transpose, const GLfloat *values);
 };
@@ -322,6 +441,31 @@ extern "C"
    // LLVM JIT and set as active program, also call after gglState change to re-JIT
    void GGLShaderUse(void * llvmCtx, const GGLState_t * gglState, gl_shader_program_t * program);
 
+   // directory where GGLShaderUse keeps generated code keyed by program sources and state,
+   // so that later runs skip code generation; NULL (default) to disable; process wide
+   void GGLShaderCacheDir(const char * dir);
+
+   // estimated bytes of JIT instances kept in memory, 0 for unlimited; process wide
+   void GGLShaderCacheBudget(unsigned bytes);
+
+   // copies JIT instance statistics since last reset, then resets them if reset is GL_TRUE
+   void GGLShaderCacheStats(GGLShaderCacheStats_t * stats, GLboolean reset);
+
+   // LLVM optimization levels 0-3 of new JIT instances, and of fragment shaders recompiled
+   // after hotDraws raster batches, 0 to not recompile; only ShaderUse recompiles; process wide
+   void GGLShaderOptimization(unsigned firstLevel, unsigned hotLevel, unsigned hotDraws);
+
+   // raster batches without uniform changes before fragment shaders are recompiled with the
+   // values as constants, 0 to disable; only ShaderUse specializes; process wide
+   void GGLShaderSpecializeUniforms(unsigned uniformDraws);
+
+   // copies phase statistics of shader since its compile, or process wide since last reset if
+   // shader is NULL, then resets them if reset is GL_TRUE
+   void GGLShaderGetStats(gl_shader_t * shader, GGLShaderStats_t * stats, GLboolean reset);
+
+   // sums phase statistics of program link, compile of attached and JIT of linked shaders
+   void GGLShaderProgramGetStats(const gl_shader_program_t * program, GGLShaderStats_t * stats);
+
    void GGLShaderGetiv(const gl_shader_t * shader, const GLenum pname, GLint * params);
 
    void GGLShaderGetInfoLog(const gl_shader_t * shader, GLsizei bufsize, GLsizei* length, GLchar* infolog);
@@ -352,6 +496,10 @@ extern "C"
    void GGLProcessVertex(const gl_shader_program_t * program, const VertexInput_t * input,
                          VertexOutput_t * output, const float (*constants)[4]);
 
+   // uses the generated batch function if available
+   void GGLProcessVertices(const gl_shader_program_t * program, const VertexInput_t * inputs,
+                           VertexOutput_t * outputs, const float (*constants)[4], unsigned count);
+
    // scan line given left and right processed and scizored vertices
    // depth value bitcast float->int, if negative then ^= 0x7fffffff
    void GGLScanLine(const gl_shader_program_t * program, const enum GGLPixelFormat colorFormat,
@@ -359,6 +507,13 @@ extern "C"
                     unsigned bufferWidth, unsigned bufferHeight, GGLActiveStencil_t * activeStencil,
                     const VertexOutput_t * start, const VertexOutput_t * end, const float (*constants)[4]);
 
+   // bytes of all levels and faces of texture when stored in layout, a GGLTextureLayout
+   unsigned GGLTextureLayoutSize(const GGLTexture_t * texture, unsigned layout);
+
+   // copies texture levels to levels, GGLTextureLayoutSize bytes, in layout, then points texture
+   // at them; done once at upload, so sampling locality does not depend on texcoord direction
+   void GGLTextureSetLayout(GGLTexture_t * texture, unsigned layout, void * levels);
+
 //   void GGLProcessFragment(const VertexOutput_t * inputs, VertexOutput_t * outputs,
 //                           const float (*constants[4]));
 
@@ -46,6 +46,7 @@
 #include <vector>
 #include <stdio.h>
 #include <map>
+#include <set>
 /*
 #ifdef _MSC_VER
 #include <unordered_map>
@@ -61,8 +62,10 @@ using namespace tr1;
 
 #include "ir.h"
 #include "ir_visitor.h"
+#include "ir_hierarchical_visitor.h"
 #include "glsl_types.h"
 #include "src/mesa/main/mtypes.h"
+#include <pixelflinger2/pixelflinger2_interface.h>
 
 // Helper function to convert array to llvm::ArrayRef
 template <typename T, size_t N>
@@ -78,11 +81,94 @@ static inline llvm::ArrayRef<T> pack(T const *ptr, size_t n) {
 
 struct GGLState;
 
+bool tex2DLod(const GGLState * gglCtx, const unsigned sampler);
 llvm::Value * tex2D(llvm::IRBuilder<> & builder, llvm::Value * in1, const unsigned sampler,
-                     const GGLState * gglCtx);
+                     const GGLState * gglCtx, llvm::Value * dx, llvm::Value * dy);
 llvm::Value * texCube(llvm::IRBuilder<> & builder, llvm::Value * in1, const unsigned sampler,
                      const GGLState * gglCtx);
 
+// collects the variables ir reads
+class read_variables_visitor : public ir_hierarchical_visitor {
+public:
+   read_variables_visitor(std::set<ir_variable*> & reads) : reads(reads) {}
+
+   virtual ir_visitor_status visit(ir_dereference_variable *ir)
+   {
+      reads.insert(ir->var);
+      return visit_continue;
+   }
+
+   std::set<ir_variable*> & reads;
+};
+
+// finds the variables whose value at the next pixel is read by dFdx, dFdy, or by the texture
+// coordinate derivatives of tex2DLod samplers, directly or through the assignments of others
+class find_neighbor_variables_visitor : public ir_hierarchical_visitor {
+public:
+   find_neighbor_variables_visitor(const GGLState * gglCtx, const bool fragment)
+      : gglCtx(gglCtx), fragment(fragment) {}
+
+   virtual ir_visitor_status visit_enter(ir_expression *ir)
+   {
+      if (ir_unop_dFdx == ir->operation || ir_unop_dFdy == ir->operation)
+      {
+         read_variables_visitor reads(neighbors);
+         ir->operands[0]->accept(&reads);
+      }
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_texture *ir)
+   {
+      ir_dereference_variable * sampler = ir->sampler->as_dereference_variable();
+      if (fragment && sampler && GLSL_SAMPLER_DIM_2D == sampler->var->type->sampler_dimensionality &&
+          tex2DLod(gglCtx, sampler->var->location))
+      {
+         read_variables_visitor reads(neighbors);
+         ir->coordinate->accept(&reads);
+         if (ir->projector)
+            ir->projector->accept(&reads);
+      }
+      return visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_assignment *ir)
+   {
+      // lhs reads array indices, and is only partly written by write masks
+      if (ir_variable * var = ir->lhs->variable_referenced())
+      {
+         read_variables_visitor reads(dependencies[var]);
+         ir->lhs->accept(&reads);
+         ir->rhs->accept(&reads);
+      }
+      return visit_continue;
+   }
+
+   // the neighbors of variables assigned from neighbors are needed too
+   std::set<ir_variable*> & run(exec_list * instructions)
+   {
+      ir_hierarchical_visitor::run(instructions);
+      std::vector<ir_variable*> pending(neighbors.begin(), neighbors.end());
+      while (!pending.empty())
+      {
+         std::map<ir_variable*, std::set<ir_variable*> >::iterator it = dependencies.find(pending.back());
+         pending.pop_back();
+         if (it == dependencies.end())
+            continue;
+         for (std::set<ir_variable*>::iterator read = it->second.begin(); read != it->second.end(); read++)
+            if (neighbors.insert(*read).second)
+               pending.push_back(*read);
+      }
+      return neighbors;
+   }
+
+private:
+   const GGLState * gglCtx;
+   const bool fragment;
+   std::set<ir_variable*> neighbors;
+   std::map<ir_variable*, std::set<ir_variable*> > dependencies; // variables assignments read
+};
+
 class ir_to_llvm_visitor : public ir_visitor {
    ir_to_llvm_visitor();
 public:
@@ -102,11 +188,19 @@ public:
    llvm::Value * inputsPtr, * outputsPtr, * constantsPtr; // internal globals to store inputs/outputs/constants pointers
    llvm::Value * inputs, * outputs, * constants;
 
+   // while evaluating dFdx/dFdy operand at next pixel; 1 for x, 2 for y, 0 otherwise
+   unsigned derivativeBlock;
+   // auto and temporary variables whose assignments also store their value at the next pixel
+   // along x and y, see find_neighbor_variables_visitor; others are constant across pixels
+   std::set<ir_variable*> neighborVariables;
+   // per derivativeBlock - 1, the allocas of neighborVariables at next pixel in fun
+   std::map<ir_variable*, llvm::Value*> neighborValues[2];
+
    ir_to_llvm_visitor(llvm::Module* p_mod, const GGLState * GGLCtx, const char * suffix)
    : ctx(p_mod->getContext()), mod(p_mod), fun(0), loop(std::make_pair((llvm::BasicBlock*)0,
       (llvm::BasicBlock*)0)), bb(0), bld(ctx), gglCtx(GGLCtx), shaderSuffix(suffix),
       inputsPtr(NULL), outputsPtr(NULL), constantsPtr(NULL),
-      inputs(NULL), outputs(NULL), constants(NULL)
+      inputs(NULL), outputs(NULL), constants(NULL), derivativeBlock(0)
    {
       llvm::PointerType * const floatVecPtrType = llvm::PointerType::get(llvm::VectorType::get(bld.getFloatTy(),4), 0);
       llvm::Constant * const nullFloatVecPtr = llvm::Constant::getNullValue(floatVecPtrType);
@@ -328,7 +422,11 @@ public:
    llvm::Value* llvm_pointer(class ir_rvalue* ir)
    {
       if(ir_dereference_variable* deref = ir->as_dereference_variable())
+      {
+         if (derivativeBlock)
+            return llvm_neighbor_variable(deref->variable_referenced());
          return llvm_variable(deref->variable_referenced());
+      }
       else if(ir_dereference_array* deref = ir->as_dereference_array())
       {
          llvm::Value* gep[2] = {llvm_int(0), llvm_value(deref->array_index)};
@@ -348,6 +446,70 @@ public:
       }
    }
 
+   llvm::Value* llvm_entry_alloca(llvm::Type* type, const char * name)
+   {
+      if(bb == &fun->getEntryBlock())
+         return bld.CreateAlloca(type, 0, name);
+      else
+         return new llvm::AllocaInst(type, 0, name, fun->getEntryBlock().getTerminator());
+   }
+
+   // pointer to value of var at the next pixel selected by derivativeBlock
+   llvm::Value* llvm_neighbor_variable(ir_variable* var)
+   {
+      if (ir_var_in == var->mode && GLSL_TYPE_FLOAT == var->type->base_type && var->location >= 0)
+      {
+         // fragment inputs are followed by their step to next pixel along x, then along y
+         const unsigned slots = var->type->is_array() ?
+            var->type->length * var->type->fields.array->matrix_columns : var->type->matrix_columns;
+         const unsigned stride = sizeof(VertexOutput) / sizeof(Vector4);
+         llvm::Type * vecType = llvm::VectorType::get(bld.getFloatTy(), 4);
+         llvm::Value * v = llvm_entry_alloca(llvm::ArrayType::get(vecType, slots), var->name);
+         for (unsigned i = 0; i < slots; i++)
+         {
+            llvm::Value * value = bld.CreateLoad(bld.CreateConstGEP1_32(inputs, var->location + i));
+            llvm::Value * step = bld.CreateLoad(bld.CreateConstGEP1_32(inputs,
+                                                var->location + i + derivativeBlock * stride));
+            bld.CreateStore(bld.CreateFAdd(value, step, "neighbor"), bld.CreateConstGEP2_32(v, 0, i));
+         }
+         return bld.CreateBitCast(v, llvm::PointerType::get(llvm_type(var->type), 0), var->name);
+      }
+
+      if (!neighborVariables.count(var) || (ir_var_auto != var->mode && ir_var_temporary != var->mode))
+         return llvm_variable(var);
+      llvm::Value *& v = neighborValues[derivativeBlock - 1][var];
+      if (!v)
+      {
+         // starts with the value at this pixel, for reads before the first assignment
+         llvm::Value * center = llvm_variable(var);
+         v = llvm_entry_alloca(llvm_type(var->type), var->name);
+         if (bb == &fun->getEntryBlock())
+            bld.CreateStore(bld.CreateLoad(center), v);
+         else
+         {
+            llvm::Instruction * entry = fun->getEntryBlock().getTerminator();
+            new llvm::StoreInst(new llvm::LoadInst(center, "", entry), v, entry);
+         }
+      }
+      return v;
+   }
+
+   // difference between ir evaluated at next pixel along x (block 1) or y (block 2) and at this
+   // pixel; exact for values linear in interpolated inputs, as with helper pixels of a 2x2 quad
+   llvm::Value* llvm_derivative(ir_rvalue* ir, llvm::Value* center, const unsigned block)
+   {
+      const unsigned saved = derivativeBlock;
+      if (saved) // nested, so center was evaluated at next pixel
+      {
+         derivativeBlock = 0;
+         center = llvm_value(ir);
+      }
+      derivativeBlock = block;
+      llvm::Value * neighbor = llvm_value(ir);
+      derivativeBlock = saved;
+      return bld.CreateFSub(neighbor, center, "derivative");
+   }
+
 //   llvm::Value* llvm_intrinsic(llvm::Intrinsic::ID id, llvm::Value* a)
 //   {
 //      llvm::Type* types[1] = {a->getType()};
@@ -588,13 +750,12 @@ public:
       case ir_unop_cos:
          assert(ir->operands[0]->type->base_type == GLSL_TYPE_FLOAT);
          return llvm_intrinsic_unop(ir->operation, ops[0]);
-         // TODO: implement these somehow
       case ir_unop_dFdx:
-         assert(0);
-         //return llvm_intrinsic(llvm::Intrinsic::ddx, ops[0]);
+         assert(ir->operands[0]->type->base_type == GLSL_TYPE_FLOAT);
+         return llvm_derivative(ir->operands[0], ops[0], 1);
       case ir_unop_dFdy:
-         assert(0);
-         //return llvm_intrinsic(llvm::Intrinsic::ddy, ops[0]);
+         assert(ir->operands[0]->type->base_type == GLSL_TYPE_FLOAT);
+         return llvm_derivative(ir->operands[0], ops[0], 2);
       case ir_binop_add:
          switch(ir->operands[0]->type->base_type)
          {
@@ -916,7 +1077,7 @@ public:
       result = bld.CreateLoad(llvm_pointer(ir), ir->variable_referenced()->name);
    }
 
-   virtual void visit(class ir_texture * ir)
+   llvm::Value* llvm_texture_coordinate(ir_texture* ir)
    {
       llvm::Value * coordinate = llvm_value(ir->coordinate);
       if (ir->projector)
@@ -928,6 +1089,27 @@ public:
             div = bld.CreateInsertElement(div, proj, bld.getInt32(i), "texProjDup");
          coordinate = bld.CreateFDiv(coordinate, div, "texProj");
       }
+      return coordinate;
+   }
+
+   // as llvm_derivative, of the projected texture coordinate
+   llvm::Value* llvm_texture_derivative(ir_texture* ir, llvm::Value* center, const unsigned block)
+   {
+      const unsigned saved = derivativeBlock;
+      if (saved)
+      {
+         derivativeBlock = 0;
+         center = llvm_texture_coordinate(ir);
+      }
+      derivativeBlock = block;
+      llvm::Value * neighbor = llvm_texture_coordinate(ir);
+      derivativeBlock = saved;
+      return bld.CreateFSub(neighbor, center, "texDerivative");
+   }
+
+   virtual void visit(class ir_texture * ir)
+   {
+      llvm::Value * coordinate = llvm_texture_coordinate(ir);
 
       ir_variable * sampler = NULL;
       if(ir_dereference_variable* deref = ir->sampler->as_dereference_variable())
@@ -962,7 +1144,16 @@ public:
       if (GLSL_SAMPLER_DIM_CUBE == sampler->type->sampler_dimensionality)
          result = texCube(bld, coordinate, sampler->location, gglCtx);
       else if (GLSL_SAMPLER_DIM_2D == sampler->type->sampler_dimensionality)
-         result = tex2D(bld, coordinate, sampler->location, gglCtx);
+      {
+         // only fragment shaders (suffix from GetShaderKeyString) have inputs at next pixels
+         llvm::Value * dx = NULL, * dy = NULL;
+         if ('f' == shaderSuffix[0] && tex2DLod(gglCtx, sampler->location))
+         {
+            dx = llvm_texture_derivative(ir, coordinate, 1);
+            dy = llvm_texture_derivative(ir, coordinate, 2);
+         }
+         result = tex2D(bld, coordinate, sampler->location, gglCtx, dx, dy);
+      }
       else
          assert(0);
    }
@@ -1276,9 +1467,29 @@ public:
    {
       llvm::Value* lhs = llvm_pointer(ir->lhs);
       llvm::Value* rhs = llvm_value(ir->rhs);
+      assert(rhs);
+      llvm::Value* condition = ir->condition ? llvm_value(ir->condition) : NULL;
+      llvm_assign(ir, lhs, rhs, condition);
+
+      // the next pixels follow the control flow and condition of this pixel, like helper pixels
+      ir_variable * var = ir->lhs->variable_referenced();
+      if (var && !derivativeBlock && neighborVariables.count(var) &&
+          (ir_var_auto == var->mode || ir_var_temporary == var->mode))
+      {
+         for (derivativeBlock = 1; derivativeBlock <= 2; derivativeBlock++)
+         {
+            lhs = llvm_pointer(ir->lhs);
+            rhs = llvm_value(ir->rhs);
+            llvm_assign(ir, lhs, rhs, condition);
+         }
+         derivativeBlock = 0;
+      }
+   }
+
+   void llvm_assign(ir_assignment * ir, llvm::Value* lhs, llvm::Value* rhs, llvm::Value* condition)
+   {
       unsigned width = ir->lhs->type->vector_elements;
       unsigned mask = (1 << width) - 1;
-      assert(rhs);
 
       // TODO: masking for matrix assignment
       if (ir->rhs->type->is_matrix()) {
@@ -1312,8 +1523,8 @@ public:
          rhs = bld.CreateShuffleVector(bld.CreateLoad(lhs), rhs, llvm::ConstantVector::get(pack(blend_mask, width)), "assign.writemask");
       }
 
-      if(ir->condition)
-         rhs = bld.CreateSelect(llvm_value(ir->condition), rhs, bld.CreateLoad(lhs), "assign.conditional");
+      if(condition)
+         rhs = bld.CreateSelect(condition, rhs, bld.CreateLoad(lhs), "assign.conditional");
 
       bld.CreateStore(rhs, lhs);
    }
@@ -1330,6 +1541,8 @@ public:
 
       assert(!fun);
       fun = llvm_function(sig);
+      neighborValues[0].clear();
+      neighborValues[1].clear();
 
       bb = llvm::BasicBlock::Create(ctx, "entry", fun);
       bld.SetInsertPoint(bb);
@@ -1396,6 +1609,9 @@ glsl_ir_to_llvm_module(struct exec_list *ir, llvm::Module * mod,
                         const struct GGLState * gglCtx, const char * shaderSuffix)
 {
    ir_to_llvm_visitor v(mod, gglCtx, shaderSuffix);
+   // only fragment shaders (suffix from GetShaderKeyString) have inputs at next pixels
+   find_neighbor_variables_visitor neighbors(gglCtx, 'f' == shaderSuffix[0]);
+   v.neighborVariables = neighbors.run(ir);
 
    visit_exec_list(ir, &v);
 
@@ -140,6 +140,49 @@ private:
 };
 
 
+/**
+ * Visitor that determines whether or not dFdx or dFdy is used.
+ */
+class find_derivatives_visitor : public ir_hierarchical_visitor {
+public:
+   find_derivatives_visitor()
+      : found(false), textures(false)
+   {
+      /* empty */
+   }
+
+   virtual ir_visitor_status visit_enter(ir_expression *ir)
+   {
+      if (ir->operation == ir_unop_dFdx || ir->operation == ir_unop_dFdy)
+	 found = true;
+
+      return (found && textures) ? visit_stop : visit_continue;
+   }
+
+   virtual ir_visitor_status visit_enter(ir_texture *ir)
+   {
+      /* implicit derivatives of the coordinate select filter and mipmap level */
+      textures = true;
+
+      return (found && textures) ? visit_stop : visit_continue;
+   }
+
+   bool derivatives_found()
+   {
+      return found;
+   }
+
+   bool textures_found()
+   {
+      return textures;
+   }
+
+private:
+   bool found;
+   bool textures;
+};
+
+
 /**
  * Visitor that determines whether or not a variable is ever read.
  */
@@ -1391,6 +1434,12 @@ assign_varying_locations(struct gl_shader_program *prog,
    prog->VaryingSlots = 0;
    prog->UsesFragCoord = false;
    prog->UsesPointCoord = false;
+
+   find_derivatives_visitor derivatives;
+   derivatives.run(consumer->ir);
+   prog->UsesDerivatives = derivatives.derivatives_found();
+   prog->UsesTextureLod = derivatives.textures_found();
+
    /* FINISHME: Set dynamically when geometry shader support is added. */
    unsigned output_index = offsetof(VertexOutput,varyings) / sizeof(Vector4); /*VERT_RESULT_VAR0*/;
    unsigned input_index = offsetof(VertexOutput,varyings) / sizeof(Vector4);
@@ -36,6 +36,7 @@
 #include "ir_print_visitor.h"
 #include "program.h"
 #include "loop_analysis.h"
+#include "ir_hierarchical_visitor.h"
 
 #include "ir_to_llvm.h"
 
@@ -45,20 +46,56 @@ static int dump_ast = 0;
 static int dump_hir = 0;
 static int dump_lir = 0;
 
+static void
+count_instruction(ir_instruction *ir, void *data)
+{
+   (*(unsigned *) data)++;
+}
+
+/* Number of IR instructions in the list and all their children. */
+static unsigned
+instruction_count(exec_list *instructions)
+{
+   unsigned count = 0;
+   foreach_list(node, instructions)
+      visit_tree((ir_instruction *) node, count_instruction, &count);
+   return count;
+}
+
+/* Net hieralloc bytes under shader since *size, which is updated. */
+static int
+phase_bytes(const struct gl_shader *shader, unsigned *size)
+{
+   const unsigned previous = *size;
+   *size = hieralloc_total_size(shader);
+   return (int) (*size - previous);
+}
+
 extern "C" void
 compile_shader(const struct gl_context *ctx, struct gl_shader *shader)
 {
+   if (shader->Stats)
+      memset(shader->Stats, 0, sizeof(*shader->Stats));
+   else
+      shader->Stats = hieralloc_zero(shader, GGLShaderStats_t);
+   GGLShaderStats_t *stats = shader->Stats;
+   unsigned size = hieralloc_total_size(shader);
+   unsigned long long start = ShaderStatsTime();
+
    struct _mesa_glsl_parse_state *state =
       new(shader) _mesa_glsl_parse_state(ctx, shader->Type, shader);
 
    const char *source = shader->Source;
    state->error = preprocess(state, &source, &state->info_log,
 			     state->extensions, ctx->API);
+   ShaderStatsPhase(stats, GGL_SHADER_PREPROCESS, start, phase_bytes(shader, &size));
 
    if (!state->error) {
+      start = ShaderStatsTime();
       _mesa_glsl_lexer_ctor(state, source);
       _mesa_glsl_parse(state);
       _mesa_glsl_lexer_dtor(state);
+      ShaderStatsPhase(stats, GGL_SHADER_PARSE, start, phase_bytes(shader, &size));
    }
 
    if (dump_ast) {
@@ -70,8 +107,12 @@ compile_shader(const struct gl_context *ctx, struct gl_shader *shader)
    }
 
    shader->ir = new(shader) exec_list;
-   if (!state->error && !state->translation_unit.is_empty())
+   if (!state->error && !state->translation_unit.is_empty()) {
+      phase_bytes(shader, &size);
+      start = ShaderStatsTime();
       _mesa_ast_to_hir(shader->ir, state);
+      ShaderStatsPhase(stats, GGL_SHADER_AST_TO_HIR, start, phase_bytes(shader, &size));
+   }
 
    /* Print out the unoptimized IR. */
    if (!state->error && dump_hir) {
@@ -81,10 +122,18 @@ compile_shader(const struct gl_context *ctx, struct gl_shader *shader)
 
    /* Optimization passes */
    if (!state->error && !shader->ir->is_empty()) {
+      GGLShaderStats_t counts = {0};
+      counts.irBefore = instruction_count(shader->ir);
+      phase_bytes(shader, &size);
+      start = ShaderStatsTime();
       bool progress;
       do {
 	 progress = do_common_optimization(shader->ir, false, 32);
+	 counts.optimizeLoops++;
       } while (progress);
+      ShaderStatsPhase(stats, GGL_SHADER_OPTIMIZE, start, phase_bytes(shader, &size));
+      counts.irAfter = instruction_count(shader->ir);
+      ShaderStatsAdd(stats, &counts);
 
       validate_ir_tree(shader->ir);
    }
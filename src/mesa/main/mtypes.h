@@ -2084,7 +2084,18 @@ struct gl_shader
    
    struct Executable * executable;
    void (*function)();     /**< the active function */
+   void (*batchFunction)();     /**< the active vertex batch function, may be NULL */
    unsigned SamplersUsed;  /**< bitfield of samplers used by shader */
+   unsigned long long SourceHash; /**< of Source compiled, see GGLShaderCompile */
+   struct Instance * instance; /**< of function, NULL while pending; see BindInstance */
+   struct Instance * pending; /**< scanline being compiled asynchronously, see GGLShaderUse */
+   struct Instance * special; /**< instance with program uniform values folded, see JitSpecialize */
+   const struct GGLState * GenericState; /**< state for GenericScanLine while function is main */
+   unsigned BlitKind; /**< GGLBlitKind of fragment shader, see ClassifyBlit */
+   unsigned BlitSource; /**< sampler unit or uniform location read by blit */
+   unsigned char BlitCoord[2]; /**< varyings component index of s and t of texture blit */
+   float BlitColor[4]; /**< constant of fill blit */
+   struct GGLShaderStats * Stats; /**< since compile, or JIT since link; see ShaderStatsAdd */
 };
 
 
@@ -2148,6 +2159,12 @@ struct gl_shader_program
    unsigned AttributeSlots;/**< [0,AttributeSlots-1] read by vertex shader */
    unsigned VaryingSlots;  /**< [0,VaryingSlots-1] read by fragment shader */
    unsigned UsesFragCoord : 1, UsesPointCoord : 1;
+   unsigned UsesDerivatives : 1; /**< fragment shader uses dFdx or dFdy */
+   unsigned UsesTextureLod : 1; /**< fragment shader samples textures, see UsesInputSteps */
+   unsigned long long LinkHash; /**< of shader sources and attribute bindings linked, keys shader cache */
+   unsigned UniformSerial; /**< incremented when ValuesUniform changes */
+   unsigned UniformDraws; /**< raster batches since ValuesUniform changed, see ShaderJitPoll */
+   struct GGLShaderStats * Stats; /**< of the last link, see GGLShaderProgramGetStats */
 };   
 
 
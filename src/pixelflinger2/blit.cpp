@@ -0,0 +1,375 @@
+/**
+ **
+ ** Copyright 2011, The Android Open Source Project
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "pixelflinger2.h"
+#include "src/mesa/main/mtypes.h"
+#include "src/glsl/ir.h"
+
+#if USE_BLIT_FAST_PATH
+
+// Compositing mostly draws screen aligned quads whose fragment shader just samples a
+// texture or outputs a colour, with blending, depth and stencil off. ClassifyBlit
+// recognizes such shaders at link, and DrawBlit writes their quads with row copies and
+// fills instead of the vertex interpolation and scanline per pixel; anything else, or
+// any state that changes the result, falls back to the triangle path.
+
+// varyings component index (4 per vector) of a float varying component, or -1
+static int BlitVaryingComponent(const ir_variable * var, const unsigned component)
+{
+   if (ir_var_in != var->mode || GLSL_TYPE_FLOAT != var->type->base_type ||
+         !var->type->is_vector() || component >= var->type->vector_elements)
+      return -1;
+   const int index = var->location - offsetof(VertexOutput, varyings) / sizeof(Vector4);
+   if (index < 0 || index >= GGL_MAXVARYINGVECTORS) // gl_FragCoord or gl_PointCoord
+      return -1;
+   return index * 4 + component;
+}
+
+// true if coordinate is a vec2 varying or a 2 component swizzle of a varying
+static bool BlitCoordinate(ir_rvalue * coordinate, unsigned char coord[2])
+{
+   unsigned components[2] = {0, 1};
+   if (ir_swizzle * swizzle = coordinate->as_swizzle()) {
+      if (2 != swizzle->mask.num_components)
+         return false;
+      components[0] = swizzle->mask.x;
+      components[1] = swizzle->mask.y;
+      coordinate = swizzle->val;
+   } else if (2 != coordinate->type->vector_elements)
+      return false;
+   ir_dereference_variable * deref = coordinate->as_dereference_variable();
+   if (!deref)
+      return false;
+   for (unsigned i = 0; i < 2; i++) {
+      const int component = BlitVaryingComponent(deref->var, components[i]);
+      if (component < 0)
+         return false;
+      coord[i] = component;
+   }
+   return true;
+}
+
+// sets shader->BlitKind from rhs of the only assignment to gl_FragColor
+static void ClassifyBlitValue(gl_shader * shader, ir_rvalue * rhs)
+{
+   if (glsl_type::vec4_type != rhs->type)
+      return;
+   if (ir_constant * constant = rhs->as_constant()) {
+      memcpy(shader->BlitColor, constant->value.f, sizeof(shader->BlitColor));
+      shader->BlitKind = GGL_BLIT_FILL_CONSTANT;
+   } else if (ir_dereference_variable * deref = rhs->as_dereference_variable()) {
+      if (ir_var_uniform != deref->var->mode || deref->var->location < 0)
+         return;
+      shader->BlitSource = deref->var->location;
+      shader->BlitKind = GGL_BLIT_FILL_UNIFORM;
+   } else if (ir_type_texture == rhs->ir_type) {
+      ir_texture * texture = (ir_texture *)rhs;
+      if (ir_tex != texture->op || texture->projector || texture->shadow_comparitor ||
+            texture->offsets[0] || texture->offsets[1] || texture->offsets[2])
+         return;
+      ir_dereference_variable * sampler = texture->sampler->as_dereference_variable();
+      if (!sampler || GLSL_SAMPLER_DIM_2D != sampler->var->type->sampler_dimensionality ||
+            sampler->var->location < 0)
+         return;
+      if (!BlitCoordinate(texture->coordinate, shader->BlitCoord))
+         return;
+      shader->BlitSource = sampler->var->location;
+      shader->BlitKind = GGL_BLIT_TEXTURE;
+   }
+}
+
+void ClassifyBlit(gl_shader * shader)
+{
+   shader->BlitKind = GGL_BLIT_NONE;
+   if (GL_FRAGMENT_SHADER != shader->Type || !shader->ir)
+      return;
+   ir_function_signature * mainSig = NULL;
+   foreach_list(node, shader->ir) {
+      ir_function * function = ((ir_instruction *)node)->as_function();
+      if (!function || strcmp("main", function->name))
+         continue;
+      foreach_list(sigNode, &function->signatures) {
+         ir_function_signature * sig = (ir_function_signature *)sigNode;
+         if (sig->is_defined && sig->parameters.is_empty())
+            mainSig = sig;
+      }
+   }
+   if (!mainSig)
+      return;
+
+   ir_assignment * assignment = NULL;
+   foreach_list(node, &mainSig->body) {
+      ir_instruction * ir = (ir_instruction *)node;
+      if (ir->as_variable()) // declaration
+         continue;
+      if (assignment || !(assignment = ir->as_assignment()))
+         return; // more than one statement
+   }
+   if (!assignment || assignment->condition || 0xf != assignment->write_mask)
+      return;
+   ir_dereference_variable * lhs = assignment->lhs->as_dereference_variable();
+   if (!lhs || ir_var_out != lhs->var->mode || strcmp("gl_FragColor", lhs->var->name))
+      return;
+   ClassifyBlitValue(shader, assignment->rhs);
+}
+
+// same as texcoordWrap in texture.cpp and llvm_texture.cpp, so texels match the scanline
+static inline unsigned BlitTexel(const unsigned wrap, const float r, const unsigned size)
+{
+   const unsigned shift = 16;
+   int tc = r * (1 << shift);
+   const unsigned odd = tc & (1 << shift);
+   if (GGLTexture::GGL_REPEAT == wrap || GGLTexture::GGL_MIRRORED_REPEAT == wrap)
+      tc &= (1 << shift) - 1;
+   tc *= size - 1;
+   tc >>= shift;
+   if (GGLTexture::GGL_CLAMP_TO_EDGE == wrap)
+      tc = MIN2((int)size - 1, MAX2(0, tc));
+   else if (GGLTexture::GGL_MIRRORED_REPEAT == wrap && odd)
+      tc = size - 1 - tc;
+   return tc;
+}
+
+// [0,255] rgba_8888 of fill colour, saturated like RGBAFloatx4ToRGBAIntx4
+static unsigned BlitColor(const float color[4])
+{
+   unsigned rgba = 0;
+   for (unsigned i = 0; i < 4; i++)
+      rgba |= MIN2(MAX2((int)(color[i] * 255), 0), 255) << (i * 8);
+   return rgba;
+}
+
+// first and one past last pixel whose center is inside [a, b) in window coordinates,
+// snapped to subpixels like RasterTriangleHalfSpace
+static void BlitSpan(const float a, const float b, const int size, int * start, int * end)
+{
+   const float subPixel = 1 << GGL_SUBPIXEL_BITS;
+   const long long half = 1 << (GGL_SUBPIXEL_BITS - 1);
+   const long long sa = floor(a * subPixel + 0.5f), sb = floor(b * subPixel + 0.5f);
+   *start = MAX2(0, (int)ceil((sa - half) / subPixel));
+   *end = MIN2(size, (int)ceil((sb - half) / subPixel));
+}
+
+bool BlitEligible(const GGLInterface * iface)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   const gl_shader * shader = ctx->CurrentProgram->_LinkedShaders[MESA_SHADER_FRAGMENT];
+   if (!shader || GGL_BLIT_NONE == shader->BlitKind)
+      return false;
+   const GGLState & state = ctx->state;
+   if (state.blendState.enable || state.bufferState.depthTest || state.bufferState.stencilTest ||
+         ctx->cullState.enable || !ctx->frameSurface.data)
+      return false;
+   const GGLPixelFormat format = ctx->frameSurface.format;
+   if (GGL_PIXEL_FORMAT_RGBA_8888 != format && GGL_PIXEL_FORMAT_RGB_565 != format)
+      return false;
+
+   if (GGL_BLIT_TEXTURE == shader->BlitKind) {
+      const GGLTexture * texture = state.textureState.textures + shader->BlitSource;
+      if (GL_TEXTURE_2D != texture->type || GGLTexture::GGL_NEAREST != texture->minFilter ||
+            GGLTexture::GGL_NEAREST != texture->magFilter ||
+            GGLTexture::GGL_TEXTURE_LINEAR != texture->layout ||
+            !state.textureState.textureData[shader->BlitSource])
+         return false;
+      if (texture->format != format && !(GGL_PIXEL_FORMAT_RGBX_8888 == texture->format &&
+                                         GGL_PIXEL_FORMAT_RGBA_8888 == format))
+         return false;
+   }
+   return true;
+}
+
+bool DrawBlit(const GGLInterface * iface, const unsigned triangles[2][3],
+              const VertexOutput shaded[2][3])
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   const gl_shader * shader = ctx->CurrentProgram->_LinkedShaders[MESA_SHADER_FRAGMENT];
+   const GGLState & state = ctx->state;
+   const GGLPixelFormat format = ctx->frameSurface.format;
+   const GGLTexture * texture = NULL;
+   if (GGL_BLIT_TEXTURE == shader->BlitKind)
+      texture = state.textureState.textures + shader->BlitSource;
+
+   // the quad is the 4 distinct vertices of the triangles, and the vertex missing from
+   // each triangle must be the opposite corner of the other's, else they overlap
+   VertexOutput outputs[4]; // copied, since positions are transformed in place
+   unsigned corners[4], cornerCount = 0;
+   for (unsigned i = 0; i < 6; i++) {
+      const unsigned index = triangles[i / 3][i % 3];
+      unsigned j = 0;
+      while (j < cornerCount && corners[j] != index)
+         j++;
+      if (j == cornerCount) {
+         if (4 == cornerCount)
+            return false;
+         outputs[cornerCount] = shaded[i / 3][i % 3];
+         corners[cornerCount++] = index;
+      }
+   }
+   if (4 != cornerCount)
+      return false;
+   unsigned missing[2];
+   for (unsigned t = 0; t < 2; t++) {
+      const unsigned * tri = triangles[t];
+      if (tri[0] == tri[1] || tri[1] == tri[2] || tri[0] == tri[2])
+         return false;
+      for (missing[t] = 0; missing[t] < 4; missing[t]++)
+         if (corners[missing[t]] != tri[0] && corners[missing[t]] != tri[1] &&
+               corners[missing[t]] != tri[2])
+            break;
+   }
+
+   // same positive w and inside the view volume, so no clipping and varyings are affine
+   const VectorComp_t w = outputs[0].position.w;
+   if (!(w > 0))
+      return false;
+   for (unsigned i = 0; i < 4; i++) {
+      Vector4 & position = outputs[i].position;
+      if (position.w != w || fabs(position.x) > w || fabs(position.y) > w || fabs(position.z) > w)
+         return false;
+      position *= VectorComp_t_One / w;
+      iface->ViewportTransform(iface, &position);
+   }
+
+   // axis aligned: corner 0 and its opposite span the rect, the others share an edge each
+   unsigned opposite = 1;
+   while (opposite < 4 && (outputs[opposite].position.x == outputs[0].position.x ||
+                           outputs[opposite].position.y == outputs[0].position.y))
+      opposite++;
+   if (4 == opposite)
+      return false;
+   const VectorComp_t x0 = outputs[0].position.x, y0 = outputs[0].position.y;
+   const VectorComp_t x1 = outputs[opposite].position.x, y1 = outputs[opposite].position.y;
+   unsigned xCorner = 0, yCorner = 0; // same x and same y as corner 0
+   for (unsigned i = 1; i < 4; i++) {
+      if (i == opposite)
+         continue;
+      const Vector4 & p = outputs[i].position;
+      if (p.x == x0 && p.y == y1)
+         xCorner = i;
+      else if (p.x == x1 && p.y == y0)
+         yCorner = i;
+      else
+         return false;
+   }
+   if (!xCorner || !yCorner)
+      return false;
+   if (!((missing[0] == 0 && missing[1] == opposite) || (missing[1] == 0 && missing[0] == opposite) ||
+         (missing[0] == xCorner && missing[1] == yCorner) ||
+         (missing[1] == xCorner && missing[0] == yCorner)))
+      return false;
+
+   // s must only change along x and t along y, as in unrotated copies and scales
+   VectorComp_t s0 = 0, s1 = 0, t0 = 0, t1 = 0;
+   if (texture) {
+      const float * v[4];
+      for (unsigned i = 0; i < 4; i++)
+         v[i] = (const float *)outputs[i].varyings;
+      const unsigned s = shader->BlitCoord[0], t = shader->BlitCoord[1];
+      s0 = v[0][s], s1 = v[opposite][s], t0 = v[0][t], t1 = v[opposite][t];
+      if (v[xCorner][s] != s0 || v[yCorner][s] != s1 || v[xCorner][t] != t1 || v[yCorner][t] != t0)
+         return false;
+   }
+
+   int left, right, top, bottom;
+   BlitSpan(MIN2(x0, x1), MAX2(x0, x1), ctx->frameSurface.width, &left, &right);
+   BlitSpan(MIN2(y0, y1), MAX2(y0, y1), ctx->frameSurface.height, &top, &bottom);
+   const bool empty = left >= right || top >= bottom;
+   unsigned * columns = NULL; // texel of each column, allocated before anything is drawn
+   if (texture && !empty && !(columns = (unsigned *)malloc((right - left) * sizeof(*columns))))
+      return false; // drawn as triangles
+   ctx->counters.triangles += 2;
+   if (empty)
+      return true;
+
+#if USE_TILE_THREADS
+   TileRasterFinish(iface); // binned triangles must land first
+#endif
+
+   const unsigned width = ctx->frameSurface.width, count = right - left;
+   const unsigned pixelSize = GGL_PIXEL_FORMAT_RGB_565 == format ? 2 : 4;
+   char * const frame = (char *)ctx->frameSurface.data;
+#if USE_RASTER_COUNTERS
+   ctx->counters.scanlines += bottom - top; // no fragment shader runs, so not counted as shaded
+   ctx->counters.pixels += (bottom - top) * count;
+   StageTimer timer(ctx->counters.rasterTime);
+#endif
+
+   if (!texture) {
+      float fill[4];
+      if (GGL_BLIT_FILL_CONSTANT == shader->BlitKind)
+         memcpy(fill, shader->BlitColor, sizeof(fill));
+      else
+         memcpy(fill, ctx->CurrentProgram->ValuesUniform[shader->BlitSource], sizeof(fill));
+      const unsigned color = BlitColor(fill);
+      for (int y = top; y < bottom; y++)
+         if (GGL_PIXEL_FORMAT_RGBA_8888 == format) {
+            unsigned * pixel = (unsigned *)frame + y * width + left;
+            for (unsigned x = 0; x < count; x++)
+               pixel[x] = color;
+         } else {
+            short * pixel = (short *)frame + y * width + left;
+            const short color565 = ((color & 0xf80000) >> 19) | ((color & 0xfc00) >> 5) |
+                                   ((color & 0xf8) >> 3); // same as Clear
+            for (unsigned x = 0; x < count; x++)
+               pixel[x] = color565;
+         }
+      return true;
+   }
+
+   // texels of each column; varyings are sampled at pixel centers
+   const unsigned sampler = shader->BlitSource;
+   const unsigned texWidth = state.textureState.textureDimensions[sampler * 2];
+   const unsigned texHeight = state.textureState.textureDimensions[sampler * 2 + 1];
+   const char * const texels = (const char *)state.textureState.textureData[sampler];
+   const VectorComp_t ds = (s1 - s0) / (x1 - x0), dt = (t1 - t0) / (y1 - y0);
+   bool identity = true; // consecutive texels, so rows are copied
+   for (unsigned x = 0; x < count; x++) {
+      columns[x] = BlitTexel(texture->wrapS, s0 + (left + x + 0.5f - x0) * ds, texWidth);
+      identity &= columns[x] == columns[0] + x;
+   }
+   const bool opaque = GGL_PIXEL_FORMAT_RGBX_8888 == texture->format;
+
+   int lastRow = -1;
+   for (int y = top; y < bottom; y++) {
+      const int row = BlitTexel(texture->wrapT, t0 + (y + 0.5f - y0) * dt, texHeight);
+      char * dst = frame + (y * width + left) * pixelSize;
+      if (row == lastRow) { // magnified, same as the previous row
+         memcpy(dst, dst - width * pixelSize, count * pixelSize);
+         continue;
+      }
+      lastRow = row;
+      const char * src = texels + row * texWidth * pixelSize;
+      if (identity && !opaque) {
+         memcpy(dst, src + columns[0] * pixelSize, count * pixelSize);
+      } else if (4 == pixelSize) {
+         const unsigned alpha = opaque ? 0xff000000 : 0;
+         for (unsigned x = 0; x < count; x++)
+            ((unsigned *)dst)[x] = ((const unsigned *)src)[columns[x]] | alpha;
+      } else
+         for (unsigned x = 0; x < count; x++)
+            ((short *)dst)[x] = ((const short *)src)[columns[x]];
+   }
+   free(columns);
+   return true;
+}
+
+#endif // #if USE_BLIT_FAST_PATH
@@ -27,8 +27,10 @@ static void DepthFunc(GGLInterface * iface, GLenum func)
    GGL_GET_CONTEXT(ctx, iface);
    if (GL_NEVER > func || GL_ALWAYS < func)
       return gglError(GL_INVALID_ENUM);
+   if (ctx->state.bufferState.depthFunc == (func & 0x7))
+      return;
    ctx->state.bufferState.depthFunc = func & 0x7;
-   SetShaderVerifyFunctions(iface);
+   SetShaderDirty(iface, GGL_DIRTY_BUFFER);
 }
 
 static void StencilFuncSeparate(GGLInterface * iface, GLenum face, GLenum func, GLint ref, GLuint mask)
@@ -41,6 +43,8 @@ static void StencilFuncSeparate(GGLInterface * iface, GLenum face, GLenum func,
    mask &= 0xff;
    ref = MAX2(MIN2(ref, 0xff), 0);
    ref &= mask;
+   const GGLStencilState frontStencil = ctx->state.frontStencil;
+   const GGLStencilState backStencil = ctx->state.backStencil;
    if (GL_FRONT == face || GL_FRONT_AND_BACK == face) {
       ctx->state.frontStencil.ref = ref;
       ctx->state.frontStencil.mask = mask;
@@ -51,7 +55,9 @@ static void StencilFuncSeparate(GGLInterface * iface, GLenum face, GLenum func,
       ctx->state.backStencil.mask = mask;
       ctx->state.backStencil.func = func & 0x7;
    }
-   SetShaderVerifyFunctions(iface);
+   if (memcmp(&frontStencil, &ctx->state.frontStencil, sizeof(frontStencil)) ||
+         memcmp(&backStencil, &ctx->state.backStencil, sizeof(backStencil)))
+      SetShaderDirty(iface, GGL_DIRTY_STENCIL);
 }
 
 static unsigned StencilOpEnum(GLenum func, unsigned oldValue)
@@ -82,6 +88,8 @@ static void StencilOpSeparate(GGLInterface * iface, GLenum face, GLenum sfail, G
    GGL_GET_CONTEXT(ctx, iface);
    if (GL_FRONT > face || GL_FRONT_AND_BACK < face)
       return gglError(GL_INVALID_ENUM);
+   const GGLStencilState frontStencil = ctx->state.frontStencil;
+   const GGLStencilState backStencil = ctx->state.backStencil;
    if (GL_FRONT == face || GL_FRONT_AND_BACK == face) {
       ctx->state.frontStencil.sFail = StencilOpEnum(sfail, ctx->state.frontStencil.sFail);
       ctx->state.frontStencil.dFail = StencilOpEnum(dpfail, ctx->state.frontStencil.dFail);
@@ -92,7 +100,9 @@ static void StencilOpSeparate(GGLInterface * iface, GLenum face, GLenum sfail, G
       ctx->state.backStencil.dFail = StencilOpEnum(dpfail, ctx->state.backStencil.dFail);
       ctx->state.backStencil.dPass = StencilOpEnum(dppass, ctx->state.backStencil.dPass);
    }
-   SetShaderVerifyFunctions(iface);
+   if (memcmp(&frontStencil, &ctx->state.frontStencil, sizeof(frontStencil)) ||
+         memcmp(&backStencil, &ctx->state.backStencil, sizeof(backStencil)))
+      SetShaderDirty(iface, GGL_DIRTY_STENCIL);
 }
 
 static void StencilSelect(const GGLInterface * iface, GLenum face)
@@ -136,24 +146,105 @@ static void ClearDepthf(GGLInterface * iface, GLclampf d)
       ctx->clearState.depth ^= 0x7fffffff; // since -FLT_MAX is close to -1 when bitcasted
 }
 
+unsigned ColorFormatSize(const GGLPixelFormat format)
+{
+   switch (format) {
+   case GGL_PIXEL_FORMAT_RGBA_8888:
+   case GGL_PIXEL_FORMAT_RGBX_8888:
+   case GGL_PIXEL_FORMAT_BGRA_8888:
+      return 4;
+   case GGL_PIXEL_FORMAT_RGB_565:
+   case GGL_PIXEL_FORMAT_RGBA_4444:
+   case GGL_PIXEL_FORMAT_RGBA_5551:
+      return 2;
+   default:
+      return 0;
+   }
+}
+
+// as ScreenColorToIntVector in llvm_scanline.cpp
+void ColorFormatToRGBA(const GGLPixelFormat format, const unsigned pixel, int rgba[4])
+{
+   switch (format) {
+   case GGL_PIXEL_FORMAT_RGBA_8888:
+   case GGL_PIXEL_FORMAT_RGBX_8888:
+      for (unsigned c = 0; c < 4; c++)
+         rgba[c] = (pixel >> (c * 8)) & 0xff;
+      if (GGL_PIXEL_FORMAT_RGBX_8888 == format)
+         rgba[3] = 0xff;
+      break;
+   case GGL_PIXEL_FORMAT_BGRA_8888:
+      rgba[0] = (pixel >> 16) & 0xff;
+      rgba[1] = (pixel >> 8) & 0xff;
+      rgba[2] = pixel & 0xff;
+      rgba[3] = pixel >> 24;
+      break;
+   case GGL_PIXEL_FORMAT_RGB_565: // channel order is weird
+      rgba[0] = (pixel & 0xf800) >> 8;
+      rgba[1] = (pixel & 0x7e0) >> 3;
+      rgba[2] = (pixel & 0x1f) << 3;
+      rgba[3] = 0xff;
+      break;
+   case GGL_PIXEL_FORMAT_RGBA_4444:
+      for (unsigned c = 0; c < 4; c++)
+         rgba[c] = ((pixel >> (12 - c * 4)) & 0xf) * 17;
+      break;
+   case GGL_PIXEL_FORMAT_RGBA_5551:
+      for (unsigned c = 0; c < 3; c++) {
+         rgba[c] = (pixel >> (11 - c * 5)) & 0x1f;
+         rgba[c] = (rgba[c] << 3) | (rgba[c] >> 2);
+      }
+      rgba[3] = pixel & 1 ? 0xff : 0;
+      break;
+   default:
+      assert(0);
+      memset(rgba, 0, 4 * sizeof(*rgba));
+      break;
+   }
+}
+
+// as IntVectorToScreenColor in llvm_scanline.cpp; rgba is [0,255]
+unsigned RGBAToColorFormat(const GGLPixelFormat format, const int rgba[4])
+{
+   switch (format) {
+   case GGL_PIXEL_FORMAT_RGBA_8888:
+      return rgba[0] | (rgba[1] << 8) | (rgba[2] << 16) | (rgba[3] << 24);
+   case GGL_PIXEL_FORMAT_RGBX_8888:
+      return rgba[0] | (rgba[1] << 8) | (rgba[2] << 16) | 0xff000000;
+   case GGL_PIXEL_FORMAT_BGRA_8888:
+      return rgba[2] | (rgba[1] << 8) | (rgba[0] << 16) | (rgba[3] << 24);
+   case GGL_PIXEL_FORMAT_RGB_565:
+      return ((rgba[0] & 0xf8) << 8) | ((rgba[1] & 0xfc) << 3) | ((rgba[2] & 0xf8) >> 3);
+   case GGL_PIXEL_FORMAT_RGBA_4444:
+      return ((rgba[0] >> 4) << 12) | ((rgba[1] >> 4) << 8) | ((rgba[2] >> 4) << 4) | (rgba[3] >> 4);
+   case GGL_PIXEL_FORMAT_RGBA_5551:
+      return ((rgba[0] >> 3) << 11) | ((rgba[1] >> 3) << 6) | ((rgba[2] >> 3) << 1) | (rgba[3] >> 7);
+   default:
+      assert(0);
+      return 0;
+   }
+}
+
 static void Clear(const GGLInterface * iface, GLbitfield buf)
 {
    GGL_GET_CONST_CONTEXT(ctx, iface);
+#if USE_TILE_THREADS
+   TileRasterFinish(iface); // binned triangles must land before clear
+#endif
 
    // TODO DXL scissor test
    if (GL_COLOR_BUFFER_BIT & buf && ctx->frameSurface.data) {
-      if (GGL_PIXEL_FORMAT_RGBA_8888 == ctx->frameSurface.format) {
+      int rgba[4];
+      ColorFormatToRGBA(GGL_PIXEL_FORMAT_RGBA_8888, ctx->clearState.color, rgba);
+      const unsigned color = RGBAToColorFormat(ctx->frameSurface.format, rgba);
+      if (4 == ColorFormatSize(ctx->frameSurface.format)) {
          unsigned * const end = (unsigned *)ctx->frameSurface.data +
                                 ctx->frameSurface.width * ctx->frameSurface.height;
-         const unsigned color = ctx->clearState.color;
          for (unsigned * start = (unsigned *)ctx->frameSurface.data; start < end; start++)
             *start = color;
-      } else if (GGL_PIXEL_FORMAT_RGB_565 == ctx->frameSurface.format) {
+      } else if (2 == ColorFormatSize(ctx->frameSurface.format)) {
          short * const end = (short *)ctx->frameSurface.data +
                              ctx->frameSurface.width * ctx->frameSurface.height;
-         unsigned r = ctx->clearState.color & 0xf8, g = ctx->clearState.color & 0xfc00,
-                      b = ctx->clearState.color & 0xf80000;
-         const short color = (b >> 19) | (g >> 5) | (r >> 3);
          for (short * start = (short *)ctx->frameSurface.data; start < end; start++)
             *start = color;
       } else
@@ -184,50 +275,44 @@ static void Clear(const GGLInterface * iface, GLbitfield buf)
 static void SetBuffer(GGLInterface * iface, const GLenum type, GGLSurface * surface)
 {
    GGL_GET_CONTEXT(ctx, iface);
-   bool changed = false;
+#if USE_TILE_THREADS
+   TileRasterFinish(iface); // binned triangles write to the old surfaces
+#endif
+   const GGLBufferState bufferState = ctx->state.bufferState;
    if (GL_COLOR_BUFFER_BIT == type) {
       if (surface) {
          ctx->frameSurface = *surface;
-         changed |= ctx->frameSurface.format ^ surface->format;
-         switch (surface->format) {
-         case GGL_PIXEL_FORMAT_RGBA_8888:
-         case GGL_PIXEL_FORMAT_RGB_565:
-            break;
-         case GGL_PIXEL_FORMAT_RGBX_8888:
-         default:
+         if (!ColorFormatSize(surface->format)) {
             LOGD("pf2: SetBuffer 0x%.04X format=0x%.02X \n", type, surface ? surface->format : 0);
             assert(0);
          }
       } else {
          memset(&ctx->frameSurface, 0, sizeof(ctx->frameSurface));
-         changed = true;
       }
       ctx->state.bufferState.colorFormat = ctx->frameSurface.format;
    } else if (GL_DEPTH_BUFFER_BIT == type) {
       if (surface) {
          ctx->depthSurface = *surface;
-         changed |= ctx->depthSurface.format ^ surface->format;
          assert(GGL_PIXEL_FORMAT_Z_32 == ctx->depthSurface.format);
       } else {
          memset(&ctx->depthSurface, 0, sizeof(ctx->depthSurface));
-         changed = true;
       }
       ctx->state.bufferState.depthFormat = ctx->depthSurface.format;
    } else if (GL_STENCIL_BUFFER_BIT == type) {
       if (surface) {
          ctx->stencilSurface = *surface;
-         changed |= ctx->stencilSurface.format ^ surface->format;
          assert(GGL_PIXEL_FORMAT_S_8 == ctx->stencilSurface.format);
       } else {
          memset(&ctx->stencilSurface, 0, sizeof(ctx->stencilSurface));
-         changed = true;
       }
       ctx->state.bufferState.stencilFormat = ctx->stencilSurface.format;
    } else
       gglError(GL_INVALID_ENUM);
-   if (changed) {
-      SetShaderVerifyFunctions(iface);
-   }
+   // surface data and size are read when drawing, only formats are part of the JIT key
+   if (bufferState.colorFormat != ctx->state.bufferState.colorFormat ||
+         bufferState.depthFormat != ctx->state.bufferState.depthFormat ||
+         bufferState.stencilFormat != ctx->state.bufferState.stencilFormat)
+      SetShaderDirty(iface, GGL_DIRTY_BUFFER);
 }
 
 void InitializeBufferFunctions(GGLInterface * iface)
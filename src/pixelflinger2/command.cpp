@@ -0,0 +1,704 @@
+/**
+ **
+ ** Copyright 2011, The Android Open Source Project
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include <map>
+
+#include "pixelflinger2.h"
+#include "src/mesa/main/mtypes.h"
+#include "src/mesa/program/prog_uniform.h"
+
+// While deferred, the draw and state entry points of GGLContext::interface are replaced
+// by Record* functions that append to a CommandBuffer. Flush swaps the real functions
+// back in and replays the commands; replayed draws bin into tiles and leave shading to
+// the raster threads, so recording the next frame overlaps shading of the previous one.
+// State setters, ShaderUse and Pick* rewrite function pointers, so every immediate call
+// runs between BeginImmediate and EndImmediate.
+
+#define GGL_COMMAND_BUFFER_TRIANGLES 4096 // recorded triangles before an implicit Flush
+
+enum CommandType {
+   CMD_CULL_FACE, CMD_FRONT_FACE, CMD_DEPTH_RANGE, CMD_VIEWPORT, CMD_BLEND_COLOR,
+   CMD_BLEND_EQUATION, CMD_BLEND_FUNC, CMD_ENABLE_DISABLE, CMD_HINT, CMD_DEPTH_FUNC,
+   CMD_STENCIL_FUNC, CMD_STENCIL_OP, CMD_CLEAR_STENCIL, CMD_CLEAR_COLOR,
+   CMD_CLEAR_DEPTH, CMD_CLEAR, CMD_SET_SAMPLER, CMD_SET_BUFFER, CMD_SHADER_USE,
+   CMD_UNIFORMS, CMD_DRAW_TRIANGLE, CMD_DRAW_ELEMENTS
+};
+
+struct Command {
+   CommandType type;
+   union {
+      GLenum enums[4];
+      struct {
+         GLenum face, func;
+         GLint ref;
+         GLuint mask;
+      } stencilFunc;
+      struct {
+         GLint x, y;
+         GLsizei width, height;
+      } viewport;
+      GLclampf color[4];
+      GLint value;
+      struct {
+         GLenum cap;
+         GLboolean enable;
+      } enableDisable;
+      struct {
+         unsigned sampler;
+         bool set; // false for SetSampler(NULL)
+         GGLTexture_t texture; // shallow copy
+      } sampler;
+      struct {
+         GLenum type;
+         bool set; // false for SetBuffer(NULL)
+         GGLSurface_t surface; // shallow copy
+      } buffer;
+      gl_shader_program * program;
+      struct {
+         gl_shader_program * program;
+         unsigned first, count; // in CommandBuffer::uniforms
+      } uniforms;
+      unsigned vertices; // first of 3 in CommandBuffer::vertices
+      struct {
+         GLenum mode;
+         GLsizei count;
+         unsigned indices; // first in CommandBuffer::indices, relative to vertices
+         unsigned vertices; // first in CommandBuffer::vertices
+      } elements;
+   };
+};
+
+struct CommandBuffer {
+   GGLInterface immediate; // the real functions, kept up to date while deferred
+   bool deferred;
+
+   Command * commands;
+   unsigned commandCount, commandCapacity;
+   VertexInput * vertices;
+   unsigned vertexCount, vertexCapacity;
+   float (*uniforms)[4];
+   unsigned uniformCount, uniformCapacity;
+   unsigned * indices;
+   unsigned indexCount, indexCapacity;
+
+   gl_shader_program * program; // as last recorded by ShaderUse
+   int lastUniforms; // index of last CMD_UNIFORMS for program, -1 if none
+};
+
+static void * GrowArray(void * array, const unsigned count, unsigned * capacity,
+                        const unsigned elementSize, const unsigned needed)
+{
+   if (count + needed <= *capacity)
+      return array;
+   unsigned newCapacity = MAX2(*capacity * 2, count + needed);
+   newCapacity = MAX2(newCapacity, 64u);
+   void * newArray = memalign(16, newCapacity * elementSize); // VertexInput needs 16 byte align
+   if (count)
+      memcpy(newArray, array, count * elementSize);
+   free(array);
+   *capacity = newCapacity;
+   return newArray;
+}
+
+static Command * AddCommand(CommandBuffer * cb, const CommandType type)
+{
+   cb->commands = (Command *)GrowArray(cb->commands, cb->commandCount, &cb->commandCapacity,
+                                       sizeof(*cb->commands), 1);
+   Command * cmd = cb->commands + cb->commandCount++;
+   cmd->type = type;
+   return cmd;
+}
+
+static void InstallRecordFunctions(GGLInterface * iface);
+
+// restores the real functions for the duration of immediate calls
+static CommandBuffer * BeginImmediate(const GGLInterface * iface)
+{
+   GGL_GET_CONTEXT(ctx, const_cast<GGLInterface *>(iface));
+   CommandBuffer * cb = ctx->commandBuffer;
+   assert(cb->deferred);
+   ctx->interface = cb->immediate;
+   return cb;
+}
+
+// keeps function pointers picked during immediate calls and records again
+static void EndImmediate(const GGLInterface * iface)
+{
+   GGL_GET_CONTEXT(ctx, const_cast<GGLInterface *>(iface));
+   ctx->commandBuffer->immediate = ctx->interface;
+   InstallRecordFunctions(&ctx->interface);
+}
+
+static unsigned UniformSlots(const gl_shader_program * program)
+{
+   return program->Uniforms ? program->Uniforms->Slots + program->Uniforms->SamplerSlots : 0;
+}
+
+// copies count slots of values to the uniforms of program, if they differ
+static void SetUniforms(gl_shader_program * program, const float (*values)[4],
+                        const unsigned count)
+{
+   if (!memcmp(program->ValuesUniform, values, count * sizeof(*values)))
+      return;
+   memcpy(program->ValuesUniform, values, count * sizeof(*values));
+   UniformChanged(program); // folded values of specializations are stale
+}
+
+static void Replay(GGLInterface * iface, CommandBuffer * cb)
+{
+   // uniforms are replayed into the programs, so keep the values the client set last
+   std::map<gl_shader_program *, float (*)[4]> live;
+   for (unsigned i = 0; i < cb->commandCount; i++) {
+      const Command & cmd = cb->commands[i];
+      if (CMD_UNIFORMS != cmd.type || live.count(cmd.uniforms.program))
+         continue;
+      float (*values)[4] = (float (*)[4])malloc(cmd.uniforms.count * sizeof(*values));
+      memcpy(values, cmd.uniforms.program->ValuesUniform, cmd.uniforms.count * sizeof(*values));
+      live[cmd.uniforms.program] = values;
+   }
+
+   for (unsigned i = 0; i < cb->commandCount; i++) {
+      Command & cmd = cb->commands[i];
+      switch (cmd.type) {
+      case CMD_CULL_FACE:
+         iface->CullFace(iface, cmd.enums[0]);
+         break;
+      case CMD_FRONT_FACE:
+         iface->FrontFace(iface, cmd.enums[0]);
+         break;
+      case CMD_DEPTH_RANGE:
+         iface->DepthRangef(iface, cmd.color[0], cmd.color[1]);
+         break;
+      case CMD_VIEWPORT:
+         iface->Viewport(iface, cmd.viewport.x, cmd.viewport.y, cmd.viewport.width,
+                         cmd.viewport.height);
+         break;
+      case CMD_BLEND_COLOR:
+         iface->BlendColor(iface, cmd.color[0], cmd.color[1], cmd.color[2], cmd.color[3]);
+         break;
+      case CMD_BLEND_EQUATION:
+         iface->BlendEquationSeparate(iface, cmd.enums[0], cmd.enums[1]);
+         break;
+      case CMD_BLEND_FUNC:
+         iface->BlendFuncSeparate(iface, cmd.enums[0], cmd.enums[1], cmd.enums[2], cmd.enums[3]);
+         break;
+      case CMD_ENABLE_DISABLE:
+         iface->EnableDisable(iface, cmd.enableDisable.cap, cmd.enableDisable.enable);
+         break;
+      case CMD_HINT:
+         iface->Hint(iface, cmd.enums[0], cmd.enums[1]);
+         break;
+      case CMD_DEPTH_FUNC:
+         iface->DepthFunc(iface, cmd.enums[0]);
+         break;
+      case CMD_STENCIL_FUNC:
+         iface->StencilFuncSeparate(iface, cmd.stencilFunc.face, cmd.stencilFunc.func,
+                                    cmd.stencilFunc.ref, cmd.stencilFunc.mask);
+         break;
+      case CMD_STENCIL_OP:
+         iface->StencilOpSeparate(iface, cmd.enums[0], cmd.enums[1], cmd.enums[2], cmd.enums[3]);
+         break;
+      case CMD_CLEAR_STENCIL:
+         iface->ClearStencil(iface, cmd.value);
+         break;
+      case CMD_CLEAR_COLOR:
+         iface->ClearColor(iface, cmd.color[0], cmd.color[1], cmd.color[2], cmd.color[3]);
+         break;
+      case CMD_CLEAR_DEPTH:
+         iface->ClearDepthf(iface, cmd.color[0]);
+         break;
+      case CMD_CLEAR:
+         iface->Clear(iface, cmd.enums[0]);
+         break;
+      case CMD_SET_SAMPLER:
+         iface->SetSampler(iface, cmd.sampler.sampler, cmd.sampler.set ? &cmd.sampler.texture : NULL);
+         break;
+      case CMD_SET_BUFFER:
+         iface->SetBuffer(iface, cmd.buffer.type, cmd.buffer.set ? &cmd.buffer.surface : NULL);
+         break;
+      case CMD_SHADER_USE:
+         iface->ShaderUse(iface, cmd.program);
+         break;
+      case CMD_UNIFORMS:
+         SetUniforms(cmd.uniforms.program, cb->uniforms + cmd.uniforms.first, cmd.uniforms.count);
+         break;
+      case CMD_DRAW_TRIANGLE: {
+         const VertexInput * v = cb->vertices + cmd.vertices;
+         iface->DrawTriangle(iface, v + 0, v + 1, v + 2);
+         break;
+      }
+      case CMD_DRAW_ELEMENTS:
+         iface->DrawElements(iface, cmd.elements.mode, cmd.elements.count,
+                             cb->indices + cmd.elements.indices,
+                             cb->vertices + cmd.elements.vertices);
+         break;
+      default:
+         assert(0);
+         break;
+      }
+   }
+
+   // binned triangles keep their own copy of uniforms
+   for (std::map<gl_shader_program *, float (*)[4]>::iterator it = live.begin();
+         it != live.end(); it++) {
+      SetUniforms(it->first, it->second, UniformSlots(it->first));
+      free(it->second);
+   }
+
+   cb->commandCount = cb->vertexCount = cb->uniformCount = cb->indexCount = 0;
+   cb->lastUniforms = -1;
+}
+
+// runs recorded commands, raster threads keep going after return
+static void Flush(GGLInterface * iface)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   CommandBuffer * cb = ctx->commandBuffer;
+   if (cb->deferred && cb->commandCount) {
+      BeginImmediate(iface);
+      Replay(iface, cb);
+      EndImmediate(iface);
+   }
+#if USE_TILE_THREADS
+   TileRasterFlush(iface);
+#endif
+}
+
+static void SetDeferred(GGLInterface * iface, GLboolean enable)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   CommandBuffer * cb = ctx->commandBuffer;
+   if (!enable == !cb->deferred)
+      return;
+   if (enable) {
+      cb->immediate = ctx->interface;
+      cb->program = ctx->CurrentProgram;
+      cb->lastUniforms = -1;
+      cb->deferred = true;
+      InstallRecordFunctions(iface);
+   } else {
+      Flush(iface);
+      ctx->interface = cb->immediate;
+      cb->deferred = false;
+   }
+}
+
+#define RECORD_BEGIN(type) \
+   GGL_GET_CONTEXT(ctx, iface); \
+   Command * cmd = AddCommand(ctx->commandBuffer, type);
+
+static void RecordCullFace(GGLInterface * iface, GLenum mode)
+{
+   RECORD_BEGIN(CMD_CULL_FACE);
+   cmd->enums[0] = mode;
+}
+
+static void RecordFrontFace(GGLInterface * iface, GLenum mode)
+{
+   RECORD_BEGIN(CMD_FRONT_FACE);
+   cmd->enums[0] = mode;
+}
+
+static void RecordDepthRangef(GGLInterface * iface, GLclampf zNear, GLclampf zFar)
+{
+   RECORD_BEGIN(CMD_DEPTH_RANGE);
+   cmd->color[0] = zNear;
+   cmd->color[1] = zFar;
+}
+
+static void RecordViewport(GGLInterface * iface, GLint x, GLint y, GLsizei width, GLsizei height)
+{
+   RECORD_BEGIN(CMD_VIEWPORT);
+   cmd->viewport.x = x;
+   cmd->viewport.y = y;
+   cmd->viewport.width = width;
+   cmd->viewport.height = height;
+}
+
+static void RecordBlendColor(GGLInterface * iface, GLclampf red, GLclampf green,
+                             GLclampf blue, GLclampf alpha)
+{
+   RECORD_BEGIN(CMD_BLEND_COLOR);
+   cmd->color[0] = red;
+   cmd->color[1] = green;
+   cmd->color[2] = blue;
+   cmd->color[3] = alpha;
+}
+
+static void RecordBlendEquationSeparate(GGLInterface * iface, GLenum modeRGB, GLenum modeAlpha)
+{
+   RECORD_BEGIN(CMD_BLEND_EQUATION);
+   cmd->enums[0] = modeRGB;
+   cmd->enums[1] = modeAlpha;
+}
+
+static void RecordBlendFuncSeparate(GGLInterface * iface, GLenum srcRGB, GLenum dstRGB,
+                                    GLenum srcAlpha, GLenum dstAlpha)
+{
+   RECORD_BEGIN(CMD_BLEND_FUNC);
+   cmd->enums[0] = srcRGB;
+   cmd->enums[1] = dstRGB;
+   cmd->enums[2] = srcAlpha;
+   cmd->enums[3] = dstAlpha;
+}
+
+static void RecordEnableDisable(GGLInterface * iface, GLenum cap, GLboolean enable)
+{
+   RECORD_BEGIN(CMD_ENABLE_DISABLE);
+   cmd->enableDisable.cap = cap;
+   cmd->enableDisable.enable = enable;
+}
+
+static void RecordHint(GGLInterface * iface, GLenum target, GLenum mode)
+{
+   RECORD_BEGIN(CMD_HINT);
+   cmd->enums[0] = target;
+   cmd->enums[1] = mode;
+}
+
+static void RecordDepthFunc(GGLInterface * iface, GLenum func)
+{
+   RECORD_BEGIN(CMD_DEPTH_FUNC);
+   cmd->enums[0] = func;
+}
+
+static void RecordStencilFuncSeparate(GGLInterface * iface, GLenum face, GLenum func,
+                                      GLint ref, GLuint mask)
+{
+   RECORD_BEGIN(CMD_STENCIL_FUNC);
+   cmd->stencilFunc.face = face;
+   cmd->stencilFunc.func = func;
+   cmd->stencilFunc.ref = ref;
+   cmd->stencilFunc.mask = mask;
+}
+
+static void RecordStencilOpSeparate(GGLInterface * iface, GLenum face, GLenum sfail,
+                                    GLenum dpfail, GLenum dppass)
+{
+   RECORD_BEGIN(CMD_STENCIL_OP);
+   cmd->enums[0] = face;
+   cmd->enums[1] = sfail;
+   cmd->enums[2] = dpfail;
+   cmd->enums[3] = dppass;
+}
+
+static void RecordClearStencil(GGLInterface * iface, GLint s)
+{
+   RECORD_BEGIN(CMD_CLEAR_STENCIL);
+   cmd->value = s;
+}
+
+static void RecordClearColor(GGLInterface * iface, GLclampf r, GLclampf g, GLclampf b, GLclampf a)
+{
+   RECORD_BEGIN(CMD_CLEAR_COLOR);
+   cmd->color[0] = r;
+   cmd->color[1] = g;
+   cmd->color[2] = b;
+   cmd->color[3] = a;
+}
+
+static void RecordClearDepthf(GGLInterface * iface, GLclampf d)
+{
+   RECORD_BEGIN(CMD_CLEAR_DEPTH);
+   cmd->color[0] = d;
+}
+
+static void RecordClear(const GGLInterface * iface, GLbitfield buf)
+{
+   RECORD_BEGIN(CMD_CLEAR);
+   cmd->enums[0] = buf;
+}
+
+static void RecordSetSampler(GGLInterface * iface, const unsigned sampler, GGLTexture * texture)
+{
+   RECORD_BEGIN(CMD_SET_SAMPLER);
+   cmd->sampler.sampler = sampler;
+   cmd->sampler.set = texture;
+   if (texture)
+      cmd->sampler.texture = *texture;
+}
+
+static void RecordSetBuffer(GGLInterface * iface, const GLenum type, GGLSurface * surface)
+{
+   RECORD_BEGIN(CMD_SET_BUFFER);
+   cmd->buffer.type = type;
+   cmd->buffer.set = surface;
+   if (surface)
+      cmd->buffer.surface = *surface;
+}
+
+static void RecordShaderUse(GGLInterface * iface, gl_shader_program * program)
+{
+   RECORD_BEGIN(CMD_SHADER_USE);
+   cmd->program = program;
+   ctx->commandBuffer->program = program;
+   ctx->commandBuffer->lastUniforms = -1;
+}
+
+// snapshots uniforms of the program the next draw uses, if they changed since last snapshot
+static void RecordUniforms(CommandBuffer * cb)
+{
+   gl_shader_program * program = cb->program;
+   const unsigned count = UniformSlots(program);
+   if (!count)
+      return;
+   if (cb->lastUniforms >= 0) {
+      const Command & last = cb->commands[cb->lastUniforms];
+      if (!memcmp(cb->uniforms + last.uniforms.first, program->ValuesUniform,
+                  count * sizeof(*cb->uniforms)))
+         return;
+   }
+   cb->uniforms = (float (*)[4])GrowArray(cb->uniforms, cb->uniformCount, &cb->uniformCapacity,
+                                          sizeof(*cb->uniforms), count);
+   memcpy(cb->uniforms + cb->uniformCount, program->ValuesUniform, count * sizeof(*cb->uniforms));
+   cb->lastUniforms = cb->commandCount;
+   Command * cmd = AddCommand(cb, CMD_UNIFORMS);
+   cmd->uniforms.program = program;
+   cmd->uniforms.first = cb->uniformCount;
+   cmd->uniforms.count = count;
+   cb->uniformCount += count;
+}
+
+static void RecordDrawTriangle(const GGLInterface * iface, const VertexInput * v0,
+                               const VertexInput * v1, const VertexInput * v2)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   CommandBuffer * cb = ctx->commandBuffer;
+   if (!cb->program)
+      return; // would not draw anything
+   RecordUniforms(cb);
+   cb->vertices = (VertexInput *)GrowArray(cb->vertices, cb->vertexCount, &cb->vertexCapacity,
+                                           sizeof(*cb->vertices), 3);
+   Command * cmd = AddCommand(cb, CMD_DRAW_TRIANGLE);
+   cmd->vertices = cb->vertexCount;
+   cb->vertices[cb->vertexCount++] = *v0;
+   cb->vertices[cb->vertexCount++] = *v1;
+   cb->vertices[cb->vertexCount++] = *v2;
+   if (cb->vertexCount >= GGL_COMMAND_BUFFER_TRIANGLES * 3)
+      Flush(const_cast<GGLInterface *>(iface));
+}
+
+// copies the referenced range of vertices and the indices rebased to it
+static void RecordDrawElements(const GGLInterface * iface, GLenum mode, GLsizei count,
+                               const unsigned * indices, const VertexInput * vertices)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   CommandBuffer * cb = ctx->commandBuffer;
+   if (!cb->program || count <= 0)
+      return;
+   unsigned minIndex = indices[0], maxIndex = indices[0];
+   for (GLsizei i = 1; i < count; i++) {
+      minIndex = MIN2(minIndex, indices[i]);
+      maxIndex = MAX2(maxIndex, indices[i]);
+   }
+   const unsigned vertexCount = maxIndex - minIndex + 1;
+   RecordUniforms(cb);
+   cb->vertices = (VertexInput *)GrowArray(cb->vertices, cb->vertexCount, &cb->vertexCapacity,
+                                           sizeof(*cb->vertices), vertexCount);
+   cb->indices = (unsigned *)GrowArray(cb->indices, cb->indexCount, &cb->indexCapacity,
+                                       sizeof(*cb->indices), count);
+   Command * cmd = AddCommand(cb, CMD_DRAW_ELEMENTS);
+   cmd->elements.mode = mode;
+   cmd->elements.count = count;
+   cmd->elements.indices = cb->indexCount;
+   cmd->elements.vertices = cb->vertexCount;
+   memcpy(cb->vertices + cb->vertexCount, vertices + minIndex, vertexCount * sizeof(*vertices));
+   cb->vertexCount += vertexCount;
+   for (GLsizei i = 0; i < count; i++)
+      cb->indices[cb->indexCount++] = indices[i] - minIndex;
+   if (cb->vertexCount >= GGL_COMMAND_BUFFER_TRIANGLES * 3)
+      Flush(const_cast<GGLInterface *>(iface));
+}
+
+// entry points that are not recorded run the queue first, then run immediately
+
+static void DeferredFinish(const GGLInterface * iface)
+{
+   Flush(const_cast<GGLInterface *>(iface));
+   BeginImmediate(iface)->immediate.Finish(iface);
+   EndImmediate(iface);
+}
+
+static void DeferredSetThreadCount(GGLInterface * iface, unsigned count)
+{
+   Flush(iface);
+   BeginImmediate(iface)->immediate.SetThreadCount(iface, count);
+   EndImmediate(iface);
+}
+
+static void DeferredGetCounters(GGLInterface * iface, GGLCounters * counters, GLboolean reset)
+{
+   Flush(iface);
+   BeginImmediate(iface)->immediate.GetCounters(iface, counters, reset);
+   EndImmediate(iface);
+}
+
+static GLboolean DeferredShaderProgramLink(GGLInterface * iface, gl_shader_program * program,
+                                          const char ** infoLog)
+{
+   Flush(iface); // recorded draws use the current link of program
+   const GLboolean status = BeginImmediate(iface)->immediate.ShaderProgramLink(iface, program,
+                            infoLog);
+   EndImmediate(iface);
+   return status;
+}
+
+static void DeferredShaderProgramDelete(GGLInterface * iface, gl_shader_program * program)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   Flush(iface);
+   if (ctx->commandBuffer->program == program)
+      ctx->commandBuffer->program = NULL;
+   BeginImmediate(iface)->immediate.ShaderProgramDelete(iface, program);
+   EndImmediate(iface);
+}
+
+static GLint DeferredShaderUniform(GGLInterface * iface, gl_shader_program * program,
+                                   GLint location, GLsizei count, const GLvoid *values,
+                                   GLenum type)
+{
+   Flush(iface); // recorded draws are replayed before the program changes
+   const GLint sampler = BeginImmediate(iface)->immediate.ShaderUniform(iface, program, location,
+                         count, values, type);
+   EndImmediate(iface);
+   return sampler;
+}
+
+static void DeferredShaderUniformMatrix(GGLInterface * iface, gl_shader_program * program,
+                                        GLint cols, GLint rows, GLint location, GLsizei count,
+                                        GLboolean transpose, const GLfloat *values)
+{
+   Flush(iface);
+   BeginImmediate(iface)->immediate.ShaderUniformMatrix(iface, program, cols, rows, location,
+         count, transpose, values);
+   EndImmediate(iface);
+}
+
+static void DeferredStencilSelect(const GGLInterface * iface, GLenum face)
+{
+   Flush(const_cast<GGLInterface *>(iface));
+   BeginImmediate(iface)->immediate.StencilSelect(iface, face);
+   EndImmediate(iface);
+}
+
+static void DeferredProcessVertex(const GGLInterface * iface, const VertexInput * input,
+                                  VertexOutput * output)
+{
+   Flush(const_cast<GGLInterface *>(iface));
+   BeginImmediate(iface)->immediate.ProcessVertex(iface, input, output);
+   EndImmediate(iface);
+}
+
+static void DeferredProcessVertices(const GGLInterface * iface, const VertexInput * inputs,
+                                    VertexOutput * outputs, unsigned count)
+{
+   Flush(const_cast<GGLInterface *>(iface));
+   BeginImmediate(iface)->immediate.ProcessVertices(iface, inputs, outputs, count);
+   EndImmediate(iface);
+}
+
+static void DeferredRasterTriangle(const GGLInterface * iface, const VertexOutput * v1,
+                                   const VertexOutput * v2, const VertexOutput * v3)
+{
+   Flush(const_cast<GGLInterface *>(iface));
+   BeginImmediate(iface)->immediate.RasterTriangle(iface, v1, v2, v3);
+   EndImmediate(iface);
+}
+
+static void DeferredRasterTrapezoid(const GGLInterface * iface, const VertexOutput * tl,
+                                    const VertexOutput * tr, const VertexOutput * bl,
+                                    const VertexOutput * br)
+{
+   Flush(const_cast<GGLInterface *>(iface));
+   BeginImmediate(iface)->immediate.RasterTrapezoid(iface, tl, tr, bl, br);
+   EndImmediate(iface);
+}
+
+static void DeferredScanLine(const GGLInterface * iface, const VertexOutput * v1,
+                             const VertexOutput * v2)
+{
+   Flush(const_cast<GGLInterface *>(iface));
+   BeginImmediate(iface)->immediate.ScanLine(iface, v1, v2);
+   EndImmediate(iface);
+}
+
+static void InstallRecordFunctions(GGLInterface * iface)
+{
+   iface->CullFace = RecordCullFace;
+   iface->FrontFace = RecordFrontFace;
+   iface->DepthRangef = RecordDepthRangef;
+   iface->Viewport = RecordViewport;
+   iface->BlendColor = RecordBlendColor;
+   iface->BlendEquationSeparate = RecordBlendEquationSeparate;
+   iface->BlendFuncSeparate = RecordBlendFuncSeparate;
+   iface->EnableDisable = RecordEnableDisable;
+   iface->Hint = RecordHint;
+   iface->DepthFunc = RecordDepthFunc;
+   iface->StencilFuncSeparate = RecordStencilFuncSeparate;
+   iface->StencilOpSeparate = RecordStencilOpSeparate;
+   iface->ClearStencil = RecordClearStencil;
+   iface->ClearColor = RecordClearColor;
+   iface->ClearDepthf = RecordClearDepthf;
+   iface->Clear = RecordClear;
+   iface->SetSampler = RecordSetSampler;
+   iface->SetBuffer = RecordSetBuffer;
+   iface->ShaderUse = RecordShaderUse;
+   iface->DrawTriangle = RecordDrawTriangle;
+   iface->DrawElements = RecordDrawElements;
+
+   iface->Finish = DeferredFinish;
+   iface->SetThreadCount = DeferredSetThreadCount;
+   iface->GetCounters = DeferredGetCounters;
+   iface->ShaderProgramLink = DeferredShaderProgramLink;
+   iface->ShaderProgramDelete = DeferredShaderProgramDelete;
+   iface->ShaderUniform = DeferredShaderUniform;
+   iface->ShaderUniformMatrix = DeferredShaderUniformMatrix;
+   iface->StencilSelect = DeferredStencilSelect;
+   iface->ProcessVertex = DeferredProcessVertex;
+   iface->ProcessVertices = DeferredProcessVertices;
+   iface->RasterTriangle = DeferredRasterTriangle;
+   iface->RasterTrapezoid = DeferredRasterTrapezoid;
+   iface->ScanLine = DeferredScanLine;
+}
+
+void InitializeCommandBuffer(GGLInterface * iface)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   ctx->commandBuffer = (CommandBuffer *)calloc(1, sizeof(CommandBuffer));
+   ctx->commandBuffer->lastUniforms = -1;
+   iface->SetDeferred = SetDeferred;
+   iface->Flush = Flush;
+}
+
+void DestroyCommandBuffer(GGLInterface * iface)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   CommandBuffer * cb = ctx->commandBuffer;
+   if (!cb)
+      return;
+   SetDeferred(iface, false);
+   free(cb->commands);
+   free(cb->vertices);
+   free(cb->uniforms);
+   free(cb->indices);
+   free(cb);
+   ctx->commandBuffer = NULL;
+}
@@ -204,8 +204,8 @@ static Value * Saturate(IRBuilder<> & builder, Value * intVector)
    return intVecMin(builder, intVector, constIntVec(builder, 255,255,255,255));
 }
 
-// src is int32x4 [0,255] rgba vector, and combines them into int32
-// RGB_565 channel order is weird
+// src is int32x4 [0,255] rgba vector, and combines them into int32, or int16 for 16 bit formats
+// RGB_565 channel order is weird; as RGBAToColorFormat in buffer.cpp
 static Value * IntVectorToScreenColor(IRBuilder<> & builder, const GGLPixelFormat format, Value * src)
 {
    if (GGL_PIXEL_FORMAT_RGBA_8888 == format) {
@@ -228,6 +228,34 @@ static Value * IntVectorToScreenColor(IRBuilder<> & builder, const GGLPixelForma
       comps[0] = builder.CreateOr(comps[0], comps[1]);
       comps[0] = builder.CreateOr(comps[0], comps[2]);
       return comps[0];
+   } else if (GGL_PIXEL_FORMAT_RGBX_8888 == format || GGL_PIXEL_FORMAT_BGRA_8888 == format) {
+      if (GGL_PIXEL_FORMAT_RGBX_8888 == format)
+         src = builder.CreateShl(src, constIntVec(builder, 0, 8, 16, 0));
+      else
+         src = builder.CreateShl(src, constIntVec(builder, 16, 8, 0, 24));
+      std::vector<Value *> comps = extractVector(builder, src);
+      if (GGL_PIXEL_FORMAT_RGBX_8888 == format)
+         comps[3] = builder.getInt32(0xff000000);
+      comps[0] = builder.CreateOr(comps[0], comps[1]);
+      comps[0] = builder.CreateOr(comps[0], comps[2]);
+      comps[0] = builder.CreateOr(comps[0], comps[3]);
+      return comps[0];
+   } else if (GGL_PIXEL_FORMAT_RGBA_4444 == format || GGL_PIXEL_FORMAT_RGBA_5551 == format) {
+      // drop the low bits of each channel, then place it
+      if (GGL_PIXEL_FORMAT_RGBA_4444 == format) {
+         src = builder.CreateLShr(src, constIntVec(builder, 4, 4, 4, 4));
+         src = builder.CreateShl(src, constIntVec(builder, 12, 8, 4, 0));
+      } else {
+         src = builder.CreateLShr(src, constIntVec(builder, 3, 3, 3, 7));
+         src = builder.CreateShl(src, constIntVec(builder, 11, 6, 1, 0));
+      }
+      std::vector<Value *> comps = extractVector(builder, src);
+      for (unsigned i = 0; i < 4; i++)
+         comps[i] = builder.CreateTrunc(comps[i], builder.getInt16Ty());
+      comps[0] = builder.CreateOr(comps[0], comps[1]);
+      comps[0] = builder.CreateOr(comps[0], comps[2]);
+      comps[0] = builder.CreateOr(comps[0], comps[3]);
+      return comps[0];
    } else if (GGL_PIXEL_FORMAT_UNKNOWN == format)
       return builder.getInt32(0);
    else
@@ -236,7 +264,7 @@ static Value * IntVectorToScreenColor(IRBuilder<> & builder, const GGLPixelForma
 }
 
 // src is int32 or int16, return is int32x4 [0,255] rgba
-// RGB_565 channel order is weird
+// RGB_565 channel order is weird; as ColorFormatToRGBA in buffer.cpp
 static Value * ScreenColorToIntVector(IRBuilder<> & builder, const GGLPixelFormat format, Value * src)
 {
    src = builder.CreateZExt(src, builder.getInt32Ty());
@@ -250,6 +278,23 @@ static Value * ScreenColorToIntVector(IRBuilder<> & builder, const GGLPixelForma
       dst = builder.CreateLShr(dst, constIntVec(builder, 8, 3, 0, 0));
       dst = builder.CreateShl(dst, constIntVec(builder, 0, 0, 3, 0));
       dst = builder.CreateOr(dst, constIntVec(builder, 0, 0, 0, 0xff));
+   } else if (GGL_PIXEL_FORMAT_RGBX_8888 == format) {
+      dst = builder.CreateLShr(dst, constIntVec(builder, 0, 8, 16, 0));
+      dst = builder.CreateAnd(dst, constIntVec(builder, 0xff, 0xff, 0xff, 0));
+      dst = builder.CreateOr(dst, constIntVec(builder, 0, 0, 0, 0xff));
+   } else if (GGL_PIXEL_FORMAT_BGRA_8888 == format) {
+      dst = builder.CreateLShr(dst, constIntVec(builder, 16, 8, 0, 24));
+      dst = builder.CreateAnd(dst, constIntVec(builder, 0xff, 0xff, 0xff, 0xff));
+   } else if (GGL_PIXEL_FORMAT_RGBA_4444 == format) {
+      dst = builder.CreateLShr(dst, constIntVec(builder, 12, 8, 4, 0));
+      dst = builder.CreateAnd(dst, constIntVec(builder, 0xf, 0xf, 0xf, 0xf));
+      dst = builder.CreateMul(dst, constIntVec(builder, 17, 17, 17, 17)); // replicate to 8 bits
+   } else if (GGL_PIXEL_FORMAT_RGBA_5551 == format) {
+      dst = builder.CreateLShr(dst, constIntVec(builder, 11, 6, 1, 0));
+      dst = builder.CreateAnd(dst, constIntVec(builder, 0x1f, 0x1f, 0x1f, 1));
+      // replicate to 8 bits, alpha 1 is 0xff
+      dst = builder.CreateOr(builder.CreateMul(dst, constIntVec(builder, 8, 8, 8, 0xff)),
+                             builder.CreateLShr(dst, constIntVec(builder, 2, 2, 2, 8)));
    } else if (GGL_PIXEL_FORMAT_UNKNOWN == format)
       LOGD("pf2: ScreenColorToIntVector GGL_PIXEL_FORMAT_UNKNOWN"); // not set yet, do nothing
    else
@@ -417,6 +462,281 @@ Value * GenerateFSBlend(const GGLState * gglCtx, const GGLPixelFormat format, /*
    return res;
 }
 
+static Value * DepthCompare(IRBuilder<> & builder, const unsigned char func,
+                            Value * z, Value * depthZ)
+{
+   Type * cmpType = CmpInst::makeCmpResultType(z->getType());
+   switch (0x200 | func) {
+   case GL_NEVER:
+      return Constant::getNullValue(cmpType);
+   case GL_LESS:
+      return builder.CreateICmpSLT(z, depthZ);
+   case GL_EQUAL:
+      return builder.CreateICmpEQ(z, depthZ);
+   case GL_LEQUAL:
+      return builder.CreateICmpSLE(z, depthZ);
+   case GL_GREATER:
+      return builder.CreateICmpSGT(z, depthZ);
+   case GL_NOTEQUAL:
+      return builder.CreateICmpNE(z, depthZ);
+   case GL_GEQUAL:
+      return builder.CreateICmpSGE(z, depthZ);
+   case GL_ALWAYS:
+      return Constant::getAllOnesValue(cmpType);
+   default:
+      assert(0);
+      return NULL;
+   }
+}
+
+// with perspective correction, start has varyings divided by w and 1/w in gl_FragCoord.w,
+// see PerspectiveDivide; fills corrected with the fragment shader inputs, followed by their
+// x and y differences for dFdx and dFdy, and returns it; otherwise returns start
+static Value * CorrectPerspective(const GGLState * gglCtx, const gl_shader_program * program,
+                                  IRBuilder<> & builder, Value * start, Value * corrected)
+{
+   if (!gglCtx->bufferState.perspective)
+      return start;
+   assert(corrected);
+
+   const unsigned stride = sizeof(VertexOutput) / sizeof(Vector4);
+   const unsigned blocks = UsesInputSteps(program, gglCtx) ? 3 : 1;
+   const unsigned fragCoord = GGL_FS_INPUT_OFFSET + GGL_FS_INPUT_FRAGCOORD_INDEX;
+   const unsigned frontFacingPointCoord = GGL_FS_INPUT_OFFSET +
+                                          GGL_FS_INPUT_FRONTFACINGPOINTCOORD_INDEX;
+   Value * wMask = constIntVec(builder, 3, 3, 3, 3);
+   Value * one = constFloatVec(builder, 1, 1, 1, 1);
+
+   // w at this pixel, then at next pixel along x and y; gl_FragCoord and gl_PointCoord
+   // are linear, so they and their differences are copied
+   Value * w[3] = {NULL, NULL, NULL};
+   Value * center = NULL;
+   for (unsigned b = 0; b < blocks; b++) {
+      Value * v = builder.CreateLoad(builder.CreateConstInBoundsGEP1_32(start,
+                                     b * stride + fragCoord));
+      builder.CreateStore(v, builder.CreateConstInBoundsGEP1_32(corrected, b * stride + fragCoord));
+      if (b)
+         v = builder.CreateFAdd(center, v);
+      else
+         center = v;
+      w[b] = builder.CreateFDiv(one, builder.CreateShuffleVector(v, v, wMask), "w");
+
+      v = builder.CreateLoad(builder.CreateConstInBoundsGEP1_32(start,
+                             b * stride + frontFacingPointCoord));
+      builder.CreateStore(v, builder.CreateConstInBoundsGEP1_32(corrected,
+                          b * stride + frontFacingPointCoord));
+   }
+
+   for (unsigned i = 0; i < program->VaryingSlots; i++) {
+      const unsigned index = offsetof(VertexOutput,varyings)/sizeof(Vector4) + i;
+      Value * varying = builder.CreateLoad(builder.CreateConstInBoundsGEP1_32(start, index));
+      Value * value = builder.CreateFMul(varying, w[0]);
+      builder.CreateStore(value, builder.CreateConstInBoundsGEP1_32(corrected, index));
+      for (unsigned b = 1; b < blocks; b++) {
+         Value * v = builder.CreateLoad(builder.CreateConstInBoundsGEP1_32(start, b * stride + index));
+         v = builder.CreateFMul(builder.CreateFAdd(varying, v), w[b]);
+         v = builder.CreateFSub(v, value);
+         builder.CreateStore(v, builder.CreateConstInBoundsGEP1_32(corrected, b * stride + index));
+      }
+   }
+   return corrected;
+}
+
+#if USE_RASTER_COUNTERS
+// increments the int counter in start->pointSize, which fragment shaders do not read
+static void CountFragment(IRBuilder<> & builder, Value * start, const GGLScanLineCount counter)
+{
+   Value * ptr = builder.CreateBitCast(start, PointerType::get(builder.getInt32Ty(), 0));
+   ptr = builder.CreateConstInBoundsGEP1_32(ptr, offsetof(VertexOutput,pointSize)/sizeof(int) +
+                                            counter);
+   builder.CreateStore(builder.CreateAdd(builder.CreateLoad(ptr), builder.getInt32(1)), ptr);
+}
+#endif
+
+// calls fragment shader on start, then blends and stores result to frame
+static void ShadeFragment(const GGLState * gglCtx, const gl_shader_program * program,
+                          Module * mod, IRBuilder<> & builder, const char * shaderName,
+                          Value * start, Value * corrected, Value * constants, Value * frame)
+{
+   Value * inputs = CorrectPerspective(gglCtx, program, builder, start, corrected);
+   Value * outputs = start;
+
+   Value * fsOutputs = builder.CreateConstInBoundsGEP1_32(start,
+                       offsetof(VertexOutput,fragColor)/sizeof(Vector4));
+
+   Function * fsFunction = mod->getFunction(shaderName);
+   assert(fsFunction);
+   CallInst *call = builder.CreateCall3(fsFunction,inputs, outputs, constants);
+   call->setCallingConv(CallingConv::C);
+   call->setTailCall(false);
+
+   Value * dst = Constant::getNullValue(intVecType(builder));
+   if (gglCtx->blendState.enable && (0 != gglCtx->blendState.dcf || 0 != gglCtx->blendState.daf)) {
+      Value * frameColor = builder.CreateLoad(frame, "frameColor");
+      dst = ScreenColorToIntVector(builder, gglCtx->bufferState.colorFormat, frameColor);
+   }
+
+   Value * src = builder.CreateConstInBoundsGEP1_32(fsOutputs, 0);
+   src = builder.CreateLoad(src);
+
+   Value * color = GenerateFSBlend(gglCtx, gglCtx->bufferState.colorFormat,/*&prog->outputRegDesc,*/ builder, src, dst);
+   builder.CreateStore(color, frame);
+#if USE_RASTER_COUNTERS
+   CountFragment(builder, start, GGL_COUNT_SHADED);
+   if (gglCtx->blendState.enable)
+      CountFragment(builder, start, GGL_COUNT_BLENDED);
+#endif
+}
+
+// start += step for inputs used by fragment shader and depth test
+static void StepInputs(const GGLState * gglCtx, const gl_shader_program * program,
+                       IRBuilder<> & builder, Value * start, Value * step)
+{
+   Value * vPtr = NULL, * v = NULL, * dx = NULL;
+   if (program->UsesFragCoord || gglCtx->bufferState.perspective) {
+      vPtr = builder.CreateConstInBoundsGEP1_32(start, GGL_FS_INPUT_OFFSET +
+             GGL_FS_INPUT_FRAGCOORD_INDEX);
+      v = builder.CreateLoad(vPtr);
+      dx = builder.CreateConstInBoundsGEP1_32(step, GGL_FS_INPUT_OFFSET +
+                                              GGL_FS_INPUT_FRAGCOORD_INDEX);
+      dx = builder.CreateLoad(dx);
+      v = builder.CreateFAdd(v, dx);
+      builder.CreateStore(v, vPtr);
+   } else if (gglCtx->bufferState.depthTest) {
+      Type * floatType = builder.getFloatTy();
+      PointerType * floatPointerType = PointerType::get(floatType, 0);
+      vPtr = builder.CreateBitCast(start, floatPointerType);
+      vPtr = builder.CreateConstInBoundsGEP1_32(vPtr,
+             (GGL_FS_INPUT_OFFSET + GGL_FS_INPUT_FRAGCOORD_INDEX) * 4 + 2);
+      v = builder.CreateLoad(vPtr);
+      dx = builder.CreateBitCast(step, floatPointerType);
+      dx = builder.CreateConstInBoundsGEP1_32(dx,
+                                              (GGL_FS_INPUT_OFFSET + GGL_FS_INPUT_FRAGCOORD_INDEX) * 4 + 2);
+      dx = builder.CreateLoad(dx);
+      v = builder.CreateFAdd(v, dx);
+      builder.CreateStore(v, vPtr);
+   }
+
+   if (program->UsesPointCoord) {
+      vPtr = builder.CreateConstInBoundsGEP1_32(start, GGL_FS_INPUT_OFFSET +
+             GGL_FS_INPUT_FRONTFACINGPOINTCOORD_INDEX);
+      v = builder.CreateLoad(vPtr);
+      dx = builder.CreateConstInBoundsGEP1_32(step, GGL_FS_INPUT_OFFSET +
+                                              GGL_FS_INPUT_FRONTFACINGPOINTCOORD_INDEX);
+      dx = builder.CreateLoad(dx);
+      v = builder.CreateFAdd(v, dx);
+      builder.CreateStore(v, vPtr);
+   }
+
+   for (unsigned i = 0; i < program->VaryingSlots; ++i) {
+      vPtr = builder.CreateConstInBoundsGEP1_32(start, offsetof(VertexOutput,varyings)/sizeof(Vector4) + i);
+      v = builder.CreateLoad(vPtr);
+      dx = builder.CreateConstInBoundsGEP1_32(step, GGL_FS_INPUT_OFFSET +
+                                              GGL_FS_INPUT_VARYINGS_INDEX + i);
+      dx = builder.CreateLoad(dx);
+      v = builder.CreateFAdd(v, dx);
+      builder.CreateStore(v, vPtr);
+   }
+}
+
+// depth tested groups of 4 pixels, while count >= 4; without stencil test only
+// z of a group is tested and written as a vector; groups failing entirely skip fragment
+// shading, others shade only passing pixels. Inputs are stepped one pixel at a time as
+// in the scalar loop, so results are identical to it. The scalar loop does the remainder.
+static void GenerateDepthGroups(const GGLState * gglCtx, const gl_shader_program * program,
+                                Module * mod, IRBuilder<> & builder, const char * shaderName,
+                                Value * start, Value * step, Value * corrected,
+                                Value * constants, Value * framePtr, Value * depthPtr,
+                                Value * countPtr)
+{
+   assert(gglCtx->bufferState.depthTest && !gglCtx->bufferState.stencilTest);
+   CondBranch condBranch(builder);
+   PointerType * floatPointerType = PointerType::get(builder.getFloatTy(), 0);
+   PointerType * intVecPointerType = PointerType::get(intVecType(builder), 0);
+
+   condBranch.beginLoop(); // while (count >= 4)
+
+   Value * count = builder.CreateLoad(countPtr);
+   count->setName("count");
+
+   Value * cmp = builder.CreateICmpULT(count, builder.getInt32(4));
+   condBranch.ifCond(cmp, "if_break_group_loop"); // if (count < 4)
+   condBranch.brk(); // break;
+   condBranch.endif();
+
+   Value * frame = builder.CreateLoad(framePtr);
+   if (2 == ColorFormatSize(gglCtx->bufferState.colorFormat))
+      frame = builder.CreateBitCast(frame, PointerType::get(builder.getInt16Ty(), 0));
+   frame->setName("frame");
+   Value * depth = builder.CreateLoad(depthPtr);
+   depth->setName("depth");
+
+   Value * depthVec = builder.CreateBitCast(depth, intVecPointerType);
+   LoadInst * depthZ = builder.CreateLoad(depthVec, "depthZ"); // z stored in buffer
+   depthZ->setAlignment(4); // depth buffer is only int aligned
+
+   Value * zPtr = builder.CreateBitCast(start, floatPointerType);
+   zPtr = builder.CreateConstInBoundsGEP1_32(zPtr, (GGL_FS_INPUT_OFFSET +
+                                             GGL_FS_INPUT_FRAGCOORD_INDEX) * 4 + 2);
+   Value * dz = builder.CreateBitCast(step, floatPointerType);
+   dz = builder.CreateConstInBoundsGEP1_32(dz, (GGL_FS_INPUT_OFFSET +
+                                           GGL_FS_INPUT_FRAGCOORD_INDEX) * 4 + 2);
+   dz = builder.CreateLoad(dz, "dz");
+   Value * zScalar = builder.CreateLoad(zPtr, "z");
+   Value * z = Constant::getNullValue(floatVecType(builder));
+   for (unsigned i = 0; i < 4; i++) { // accumulate like StepInputs does
+      z = builder.CreateInsertElement(z, zScalar, builder.getInt32(i));
+      zScalar = builder.CreateFAdd(zScalar, dz);
+   }
+   z = builder.CreateBitCast(z, intVecType(builder));
+   // if (0x80000000 & z) z ^= 0x7fffffff since smaller -ve float means bigger -ve int
+   Value * zSign = builder.CreateAShr(z, constIntVec(builder, 31, 31, 31, 31));
+   zSign = builder.CreateAnd(zSign, constIntVec(builder, 0x7fffffff, 0x7fffffff,
+                                                0x7fffffff, 0x7fffffff));
+   z = builder.CreateXor(z, zSign, "z");
+
+   Value * zCmp = DepthCompare(builder, gglCtx->bufferState.depthFunc, z, depthZ);
+   zCmp = builder.CreateSExt(zCmp, intVecType(builder), "zCmp");
+   std::vector<Value *> zCmps = extractVector(builder, zCmp);
+   Value * zCmpAny = builder.CreateOr(builder.CreateOr(zCmps[0], zCmps[1]),
+                                      builder.CreateOr(zCmps[2], zCmps[3]));
+
+   condBranch.ifCond(builder.CreateICmpNE(zCmpAny, builder.getInt32(0)),
+                     "if_zCmpAny", "zCmpAny_fail");
+
+   Value * zStore = builder.CreateOr(builder.CreateAnd(zCmp, z),
+                                     builder.CreateAnd(builder.CreateNot(zCmp), depthZ));
+   StoreInst * store = builder.CreateStore(zStore, depthVec); // store z
+   store->setAlignment(4);
+
+   for (unsigned i = 0; i < 4; i++) {
+      condBranch.ifCond(builder.CreateICmpNE(zCmps[i], builder.getInt32(0)), "if_zCmp", "zCmp_fail");
+      ShadeFragment(gglCtx, program, mod, builder, shaderName, start, corrected, constants,
+                    builder.CreateConstInBoundsGEP1_32(frame, i));
+      condBranch.endif();
+      StepInputs(gglCtx, program, builder, start, step);
+   }
+
+   condBranch.elseop(); // whole group failed z test
+
+   for (unsigned i = 0; i < 4; i++)
+      StepInputs(gglCtx, program, builder, start, step);
+
+   condBranch.endif();
+
+   frame = builder.CreateConstInBoundsGEP1_32(frame, 4); // frame += 4
+   // frame may have been casted to short* from int*, so cast back
+   frame = builder.CreateBitCast(frame, PointerType::get(builder.getInt32Ty(), 0));
+   builder.CreateStore(frame, framePtr);
+   depth = builder.CreateConstInBoundsGEP1_32(depth, 4); // depth += 4
+   builder.CreateStore(depth, depthPtr);
+
+   count = builder.CreateSub(count, builder.getInt32(4));
+   builder.CreateStore(count, countPtr); // count -= 4;
+
+   condBranch.endLoop();
+}
+
 static FunctionType * ScanLineFunctionType(IRBuilder<> & builder)
 {
    std::vector<Type*> funcArgs;
@@ -487,6 +807,12 @@ void GenerateScanLine(const GGLState * gglCtx, const gl_shader_program * program
    Value * countPtr = builder.CreateAlloca(intType);
    builder.CreateStore(args++, countPtr);
 
+   Value * corrected = NULL; // perspective corrected copy of start, step and y step
+   if (gglCtx->bufferState.perspective)
+      corrected = builder.CreateAlloca(floatVecType(builder),
+                                       builder.getInt32(3 * sizeof(VertexOutput) / sizeof(Vector4)),
+                                       "corrected");
+
    Value * sFace = NULL, * sRef = NULL, *sMask = NULL, * sFunc = NULL;
    if (gglCtx->bufferState.stencilTest) {
       sFace = builder.CreateLoad(builder.CreateConstInBoundsGEP1_32(stencilState, 0), "sFace");
@@ -504,14 +830,18 @@ void GenerateScanLine(const GGLState * gglCtx, const gl_shader_program * program
          sFunc = builder.CreateLoad(builder.CreateConstInBoundsGEP1_32(stencilState, 3), "sFunc");
    }
 
+   if (gglCtx->bufferState.depthTest && !gglCtx->bufferState.stencilTest)
+      GenerateDepthGroups(gglCtx, program, mod, builder, shaderName, start, step, corrected,
+                          constants, framePtr, depthPtr, countPtr);
+
    condBranch.beginLoop(); // while (count > 0)
 
    assert(framePtr && gglCtx);
    // get values
    Value * frame = NULL;
-   if (GGL_PIXEL_FORMAT_RGBA_8888 == gglCtx->bufferState.colorFormat)
+   if (4 == ColorFormatSize(gglCtx->bufferState.colorFormat))
       frame = builder.CreateLoad(framePtr);
-   else if (GGL_PIXEL_FORMAT_RGB_565 == gglCtx->bufferState.colorFormat) {
+   else if (2 == ColorFormatSize(gglCtx->bufferState.colorFormat)) {
       frame = builder.CreateLoad(framePtr);
       frame = builder.CreateBitCast(frame, PointerType::get(builder.getInt16Ty(), 0));
    } else if (GGL_PIXEL_FORMAT_UNKNOWN == gglCtx->bufferState.colorFormat)
@@ -590,35 +920,7 @@ void GenerateScanLine(const GGLState * gglCtx, const gl_shader_program * program
 
       z = builder.CreateLoad(zPtr, "z");
 
-      switch (0x200 | gglCtx->bufferState.depthFunc) {
-      case GL_NEVER:
-         zCmp = ConstantInt::getFalse(mod->getContext());
-         break;
-      case GL_LESS:
-         zCmp = builder.CreateICmpSLT(z, depthZ);
-         break;
-      case GL_EQUAL:
-         zCmp = builder.CreateICmpEQ(z, depthZ);
-         break;
-      case GL_LEQUAL:
-         zCmp = builder.CreateICmpSLE(z, depthZ);
-         break;
-      case GL_GREATER:
-         zCmp = builder.CreateICmpSGT(z, depthZ);
-         break;
-      case GL_NOTEQUAL:
-         zCmp = builder.CreateICmpNE(z, depthZ);
-         break;
-      case GL_GEQUAL:
-         zCmp = builder.CreateICmpSGE(z, depthZ);
-         break;
-      case GL_ALWAYS:
-         zCmp = ConstantInt::getTrue(mod->getContext());
-         break;
-      default:
-         assert(0);
-         break;
-      }
+      zCmp = DepthCompare(builder, gglCtx->bufferState.depthFunc, z, depthZ);
    } else // no depth test means always pass
       zCmp = ConstantInt::getTrue(mod->getContext());
    zCmp->setName("zCmp");
@@ -626,29 +928,7 @@ void GenerateScanLine(const GGLState * gglCtx, const gl_shader_program * program
    condBranch.ifCond(sCmp, "if_sCmp", "sCmp_fail");
    condBranch.ifCond(zCmp, "if_zCmp", "zCmp_fail");
 
-   Value * inputs = start;
-   Value * outputs = start;
-
-   Value * fsOutputs = builder.CreateConstInBoundsGEP1_32(start,
-                       offsetof(VertexOutput,fragColor)/sizeof(Vector4));
-
-   Function * fsFunction = mod->getFunction(shaderName);
-   assert(fsFunction);
-   CallInst *call = builder.CreateCall3(fsFunction,inputs, outputs, constants);
-   call->setCallingConv(CallingConv::C);
-   call->setTailCall(false);
-
-   Value * dst = Constant::getNullValue(intVecType(builder));
-   if (gglCtx->blendState.enable && (0 != gglCtx->blendState.dcf || 0 != gglCtx->blendState.daf)) {
-      Value * frameColor = builder.CreateLoad(frame, "frameColor");
-      dst = ScreenColorToIntVector(builder, gglCtx->bufferState.colorFormat, frameColor);
-   }
-
-   Value * src = builder.CreateConstInBoundsGEP1_32(fsOutputs, 0);
-   src = builder.CreateLoad(src);
-
-   Value * color = GenerateFSBlend(gglCtx, gglCtx->bufferState.colorFormat,/*&prog->outputRegDesc,*/ builder, src, dst);
-   builder.CreateStore(color, frame);
+   ShadeFragment(gglCtx, program, mod, builder, shaderName, start, corrected, constants, frame);
    // TODO DXL depthmask check
    if (gglCtx->bufferState.depthTest) {
       z = builder.CreateBitCast(z, intType);
@@ -670,6 +950,10 @@ void GenerateScanLine(const GGLState * gglCtx, const gl_shader_program * program
    if (gglCtx->bufferState.stencilTest)
       builder.CreateStore(StencilOp(builder, sFace, gglCtx->frontStencil.sFail,
                                     gglCtx->backStencil.sFail, sPtr, sRef), stencil);
+#if USE_RASTER_COUNTERS
+   if (gglCtx->bufferState.stencilTest)
+      CountFragment(builder, start, GGL_COUNT_STENCIL_REJECTS);
+#endif
 
    condBranch.endif();
    assert(frame);
@@ -685,51 +969,7 @@ void GenerateScanLine(const GGLState * gglCtx, const gl_shader_program * program
       stencil = builder.CreateConstInBoundsGEP1_32(stencil, 1); // stencil++
       builder.CreateStore(stencil, stencilPtr);
    }
-   Value * vPtr = NULL, * v = NULL, * dx = NULL;
-   if (program->UsesFragCoord) {
-      vPtr = builder.CreateConstInBoundsGEP1_32(start, GGL_FS_INPUT_OFFSET +
-             GGL_FS_INPUT_FRAGCOORD_INDEX);
-      v = builder.CreateLoad(vPtr);
-      dx = builder.CreateConstInBoundsGEP1_32(step, GGL_FS_INPUT_OFFSET +
-                                              GGL_FS_INPUT_FRAGCOORD_INDEX);
-      dx = builder.CreateLoad(dx);
-      v = builder.CreateFAdd(v, dx);
-      builder.CreateStore(v, vPtr);
-   } else if (gglCtx->bufferState.depthTest) {
-      Type * floatType = builder.getFloatTy();
-      PointerType * floatPointerType = PointerType::get(floatType, 0);
-      vPtr = builder.CreateBitCast(start, floatPointerType);
-      vPtr = builder.CreateConstInBoundsGEP1_32(vPtr,
-             (GGL_FS_INPUT_OFFSET + GGL_FS_INPUT_FRAGCOORD_INDEX) * 4 + 2);
-      v = builder.CreateLoad(vPtr);
-      dx = builder.CreateBitCast(step, floatPointerType);
-      dx = builder.CreateConstInBoundsGEP1_32(dx,
-                                              (GGL_FS_INPUT_OFFSET + GGL_FS_INPUT_FRAGCOORD_INDEX) * 4 + 2);
-      dx = builder.CreateLoad(dx);
-      v = builder.CreateFAdd(v, dx);
-      builder.CreateStore(v, vPtr);
-   }
-
-   if (program->UsesPointCoord) {
-      vPtr = builder.CreateConstInBoundsGEP1_32(start, GGL_FS_INPUT_OFFSET +
-             GGL_FS_INPUT_FRONTFACINGPOINTCOORD_INDEX);
-      v = builder.CreateLoad(vPtr);
-      dx = builder.CreateConstInBoundsGEP1_32(step, GGL_FS_INPUT_OFFSET +
-                                              GGL_FS_INPUT_FRONTFACINGPOINTCOORD_INDEX);
-      dx = builder.CreateLoad(dx);
-      v = builder.CreateFAdd(v, dx);
-      builder.CreateStore(v, vPtr);
-   }
-
-   for (unsigned i = 0; i < program->VaryingSlots; ++i) {
-      vPtr = builder.CreateConstInBoundsGEP1_32(start, offsetof(VertexOutput,varyings)/sizeof(Vector4) + i);
-      v = builder.CreateLoad(vPtr);
-      dx = builder.CreateConstInBoundsGEP1_32(step, GGL_FS_INPUT_OFFSET +
-                                              GGL_FS_INPUT_VARYINGS_INDEX + i);
-      dx = builder.CreateLoad(dx);
-      v = builder.CreateFAdd(v, dx);
-      builder.CreateStore(v, vPtr);
-   }
+   StepInputs(gglCtx, program, builder, start, step);
 
    count = builder.CreateSub(count, builder.getInt32(1));
    builder.CreateStore(count, countPtr); // count--;
@@ -15,6 +15,7 @@
  ** limitations under the License.
  */
 
+#include <algorithm>
 #include <stack>
 
 #include "src/pixelflinger2/pixelflinger2.h"
@@ -27,8 +28,80 @@
 using namespace llvm;
 
 // texture data is int pointer to surface (will cast to short for 16bpp), index is linear texel index,
-// format is GGLPixelFormat for surface, return type is <4 x i32> rgba
-static Value * pointSample(IRBuilder<> & builder, Value * textureData, Value * index, const GGLPixelFormat format)
+// ETC1 blocks are big endian
+static Value * ByteSwap(IRBuilder<> & builder, Value * word)
+{
+   Value * swapped = builder.CreateShl(word, 24);
+   swapped = builder.CreateOr(swapped, builder.CreateShl(builder.CreateAnd(word, 0xff00), 8));
+   swapped = builder.CreateOr(swapped, builder.CreateAnd(builder.CreateLShr(word, 8), 0xff00));
+   return builder.CreateOr(swapped, builder.CreateLShr(word, 24));
+}
+
+// decodes texel index of ETC1 textureData, see TexelIndex; returns 0xAABBGGRR like pointSample
+static Value * ETC1Texel(IRBuilder<> & builder, Value * textureData, Value * index)
+{
+   Value * block = builder.CreateShl(builder.CreateLShr(index, 4), 1); // 4 bits per texel
+   Value * high = builder.CreateLoad(builder.CreateGEP(textureData, block));
+   high = ByteSwap(builder, high);
+   block = builder.CreateAdd(block, builder.getInt32(1));
+   Value * low = builder.CreateLoad(builder.CreateGEP(textureData, block));
+   low = ByteSwap(builder, low);
+
+   // pixel indices are column major within block
+   Value * texel = builder.CreateAnd(index, 15);
+   Value * x = builder.CreateLShr(texel, 2), * y = builder.CreateAnd(texel, 3);
+   Value * flip = builder.CreateICmpNE(builder.CreateAnd(high, 1), builder.getInt32(0));
+   Value * diff = builder.CreateICmpNE(builder.CreateAnd(high, 2), builder.getInt32(0));
+   // flip splits block into top and bottom 4x2 subblocks, else left and right 2x4
+   Value * second = builder.CreateSelect(flip, builder.CreateLShr(y, 1), builder.CreateLShr(x, 1));
+   second = builder.CreateICmpNE(second, builder.getInt32(0), name("etc1Second"));
+
+   Value * table = builder.CreateSelect(second, builder.CreateLShr(high, 2),
+                                        builder.CreateLShr(high, 5));
+   table = builder.CreateAnd(table, 7);
+   static const int tableA[] = { 2, 5, 9, 13, 18, 24, 33, 47 };
+   static const int tableB[] = { 8, 17, 29, 42, 60, 80, 106, 183 };
+   std::vector<Constant *> a(8), b(8);
+   for (unsigned i = 0; i < 8; i++) {
+      a[i] = builder.getInt32(tableA[i]);
+      b[i] = builder.getInt32(tableB[i]);
+   }
+   Value * lsb = builder.CreateAnd(builder.CreateLShr(low, texel), 1);
+   Value * msb = builder.CreateAnd(builder.CreateLShr(low, builder.CreateAdd(texel, builder.getInt32(16))), 1);
+   Value * modifier = builder.CreateSelect(builder.CreateICmpNE(lsb, builder.getInt32(0)),
+                                           builder.CreateExtractElement(ConstantVector::get(b), table),
+                                           builder.CreateExtractElement(ConstantVector::get(a), table));
+   modifier = builder.CreateSelect(builder.CreateICmpNE(msb, builder.getInt32(0)),
+                                   builder.CreateNeg(modifier), modifier, name("etc1Modifier"));
+
+   Value * color = builder.getInt32(0xff000000);
+   for (unsigned i = 0; i < 3; i++) {
+      const unsigned shift = 24 - i * 8; // R, G then B
+      // individual mode: two 4 bit base colors
+      Value * c1 = builder.CreateAnd(builder.CreateLShr(high, shift + 4), 15);
+      Value * c2 = builder.CreateAnd(builder.CreateLShr(high, shift), 15);
+      Value * individual = builder.CreateMul(builder.CreateSelect(second, c2, c1), builder.getInt32(17));
+
+      // differential mode: 5 bit base color and 3 bit signed delta for the second subblock
+      c1 = builder.CreateAnd(builder.CreateLShr(high, shift + 3), 31);
+      Value * delta = builder.CreateShl(builder.CreateLShr(high, shift), 29);
+      delta = builder.CreateAShr(delta, 29);
+      c2 = builder.CreateAnd(builder.CreateAdd(c1, delta), 31);
+      Value * differential = builder.CreateSelect(second, c2, c1);
+      differential = builder.CreateOr(builder.CreateShl(differential, 3),
+                                      builder.CreateLShr(differential, 2));
+
+      Value * channel = builder.CreateSelect(diff, differential, individual);
+      channel = builder.CreateAdd(channel, modifier);
+      channel = maxIntScalar(builder, channel, builder.getInt32(0));
+      channel = minIntScalar(builder, channel, builder.getInt32(255));
+      color = builder.CreateOr(color, builder.CreateShl(channel, i * 8));
+   }
+   return color;
+}
+
+// format is GGLPixelFormat for surface, return type is i32 0xAABBGGRR
+static Value * loadTexel(IRBuilder<> & builder, Value * textureData, Value * index, const GGLPixelFormat format)
 {
    Value * texel = NULL;
    switch (format) {
@@ -95,6 +168,9 @@ static Value * pointSample(IRBuilder<> & builder, Value * textureData, Value * i
       texel = builder.CreateOr(texel, builder.CreateShl(alpha, 16));
       break;
    }
+   case GGL_PIXEL_FORMAT_ETC1:
+      texel = ETC1Texel(builder, textureData, index);
+      break;
    case GGL_PIXEL_FORMAT_UNKNOWN: // usually means texture not set yet
       LOGD("pf2: pointSample: unknown format, default to 0xffff00ff \n");
       texel = builder.getInt32(0xffff00ff);
@@ -103,6 +179,13 @@ static Value * pointSample(IRBuilder<> & builder, Value * textureData, Value * i
       assert(0);
       break;
    }
+   return texel;
+}
+
+// format is GGLPixelFormat for surface, return type is <4 x i32> rgba
+static Value * pointSample(IRBuilder<> & builder, Value * textureData, Value * index, const GGLPixelFormat format)
+{
+   Value * texel = loadTexel(builder, textureData, index, format);
    Value * channels = Constant::getNullValue(intVecType(builder));
 
 //   if (dstDesc && dstDesc->IsInt32Color()) {
@@ -139,11 +222,48 @@ static Value * pointSample(IRBuilder<> & builder, Value * textureData, Value * i
 
 static const unsigned SHIFT = 16;
 
+// texel index of x, y in a level width texels wide at indexOffset, in GGLTextureLayout layout;
+// ETC1 texels are always in blocks, and column major within a block like its pixel indices
+static Value * TexelIndex(IRBuilder<> & builder, const unsigned layout, const GGLPixelFormat format,
+                          Value * x, Value * y, Value * width, Value * indexOffset)
+{
+   Value * index = NULL;
+   if (GGLTexture::GGL_TEXTURE_TILED == layout || GGL_PIXEL_FORMAT_ETC1 == format) {
+      // texels row major in tiles, tiles row major
+      const unsigned bits = GGL_TEXTURE_TILE_BITS, mask = (1 << bits) - 1;
+      Value * tilesX = builder.CreateLShr(builder.CreateAdd(width, builder.getInt32(mask)), bits);
+      Value * tile = builder.CreateMul(builder.CreateLShr(y, bits), tilesX);
+      tile = builder.CreateAdd(tile, builder.CreateLShr(x, bits));
+      index = builder.CreateShl(tile, bits * 2);
+      Value * major = y, * minor = x;
+      if (GGL_PIXEL_FORMAT_ETC1 == format)
+         std::swap(major, minor);
+      index = builder.CreateOr(index, builder.CreateShl(builder.CreateAnd(major, mask), bits));
+      index = builder.CreateOr(index, builder.CreateAnd(minor, mask));
+   } else {
+      index = builder.CreateMul(y, width);
+      index = builder.CreateAdd(index, x);
+   }
+   return builder.CreateAdd(index, indexOffset);
+}
+
+// texels of a width x height level in layout, as LevelTexels in texture.cpp
+static Value * LevelTexels(IRBuilder<> & builder, const unsigned layout, const GGLPixelFormat format,
+                           Value * width, Value * height)
+{
+   if (GGLTexture::GGL_TEXTURE_TILED == layout || GGL_PIXEL_FORMAT_ETC1 == format) {
+      const unsigned mask = (1 << GGL_TEXTURE_TILE_BITS) - 1;
+      width = builder.CreateAnd(builder.CreateAdd(width, builder.getInt32(mask)), ~mask);
+      height = builder.CreateAnd(builder.CreateAdd(height, builder.getInt32(mask)), ~mask);
+   }
+   return builder.CreateMul(width, height);
+}
+
 // w  = width - 1, h = height - 1; similar to pointSample; returns <4 x i32> rgba
 static Value * linearSample(IRBuilder<> & builder, Value * textureData, Value * indexOffset,
                             Value * x0, Value * y0, Value * xLerp, Value * yLerp,
                             Value * w, Value * h,  Value * width, Value * height,
-                            const GGLPixelFormat format/*, const RegDesc * dstDesc*/)
+                            const unsigned layout, const GGLPixelFormat format/*, const RegDesc * dstDesc*/)
 {
    // TODO: linear filtering needs to be fixed for texcoord outside of [0,1]
    Value * x1 = builder.CreateAdd(x0, builder.getInt32(1));
@@ -154,45 +274,60 @@ static Value * linearSample(IRBuilder<> & builder, Value * textureData, Value *
 //   RegDesc regDesc;
 //   regDesc.SetVectorType(Fixed8);
 
-   Value * index = builder.CreateMul(y0, width);
-   index = builder.CreateAdd(index, x0);
-   index = builder.CreateAdd(index, indexOffset);
-   Value * s0 = pointSample(builder, textureData, index, format/*, &regDesc*/);
-//   s0 = builder.CreateBitCast(s0, intVecType(builder));
-
-   index = builder.CreateMul(y0, width);
-   index = builder.CreateAdd(index, x1);
-   index = builder.CreateAdd(index, indexOffset);
-   Value * s1 = pointSample(builder, textureData, index, format/*, &regDesc*/);
-//   s1 = builder.CreateBitCast(s1, intVecType(builder));
-
-   index = builder.CreateMul(y1, width);
-   index = builder.CreateAdd(index, x1);
-   index = builder.CreateAdd(index, indexOffset);
-   Value * s2 = pointSample(builder, textureData, index, format/*, &regDesc*/);
-//   s2 = builder.CreateBitCast(s2, intVecType(builder));
-
-   index = builder.CreateMul(y1, width);
-   index = builder.CreateAdd(index, x0);
-   index = builder.CreateAdd(index, indexOffset);
-   Value * s3 = pointSample(builder, textureData, index, format/*, &regDesc*/);
-//   s3 = builder.CreateBitCast(s3, intVecType(builder));
-
-   Value * xLerpVec = intVec(builder, xLerp, xLerp, xLerp, xLerp);
-
-   Value * h0 = builder.CreateMul(builder.CreateSub(s1, s0), xLerpVec);
-   // arithmetic shift right, since it's the result of subtraction, which could be negative
-   h0 = builder.CreateAShr(h0, constIntVec(builder, SHIFT, SHIFT, SHIFT, SHIFT));
-   h0 = builder.CreateAdd(h0, s0);
-
-   Value * h1 = builder.CreateMul(builder.CreateSub(s2, s3), xLerpVec);
-   h1 = builder.CreateAShr(h1, constIntVec(builder, SHIFT, SHIFT, SHIFT, SHIFT));
-   h1 = builder.CreateAdd(h1, s3);
-
-   Value * sample = builder.CreateMul(builder.CreateSub(h1, h0),
-                                      intVec(builder, yLerp, yLerp, yLerp, yLerp));
-   sample = builder.CreateAShr(sample, constIntVec(builder, SHIFT, SHIFT, SHIFT, SHIFT));
-   sample = builder.CreateAdd(sample, h0);
+   // the 4 texels packed as 0xAABBGGRR, in the order of their weights below
+   Value * texels = Constant::getNullValue(intVecType(builder));
+   Value * index = TexelIndex(builder, layout, format, x0, y0, width, indexOffset);
+   texels = builder.CreateInsertElement(texels, loadTexel(builder, textureData, index, format),
+                                        builder.getInt32(0));
+   index = TexelIndex(builder, layout, format, x1, y0, width, indexOffset);
+   texels = builder.CreateInsertElement(texels, loadTexel(builder, textureData, index, format),
+                                        builder.getInt32(1));
+   index = TexelIndex(builder, layout, format, x1, y1, width, indexOffset);
+   texels = builder.CreateInsertElement(texels, loadTexel(builder, textureData, index, format),
+                                        builder.getInt32(2));
+   index = TexelIndex(builder, layout, format, x0, y1, width, indexOffset);
+   texels = builder.CreateInsertElement(texels, loadTexel(builder, textureData, index, format),
+                                        builder.getInt32(3));
+
+   // 8 bit fixed point weights that sum to 256, so the weighted sum of 8 bit channels fits
+   // unsigned 16 bit lanes
+   Value * fx = builder.CreateLShr(xLerp, SHIFT - 8), * fy = builder.CreateLShr(yLerp, SHIFT - 8);
+   Value * fx0 = builder.CreateSub(builder.getInt32(256), fx);
+   Value * w2 = builder.CreateLShr(builder.CreateMul(fx, fy), 8);
+   Value * w3 = builder.CreateLShr(builder.CreateMul(fx0, fy), 8);
+   Value * w1 = builder.CreateSub(fx, w2);
+   Value * w0 = builder.CreateSub(fx0, w3);
+   Type * shortType = builder.getInt16Ty();
+   Value * weights = Constant::getNullValue(VectorType::get(shortType, 4));
+   weights = builder.CreateInsertElement(weights, builder.CreateTrunc(w0, shortType), builder.getInt32(0));
+   weights = builder.CreateInsertElement(weights, builder.CreateTrunc(w1, shortType), builder.getInt32(1));
+   weights = builder.CreateInsertElement(weights, builder.CreateTrunc(w2, shortType), builder.getInt32(2));
+   weights = builder.CreateInsertElement(weights, builder.CreateTrunc(w3, shortType), builder.getInt32(3));
+   // each weight repeated for the 4 channels of its texel
+   std::vector<Constant *> mask(16);
+   for (unsigned i = 0; i < 16; i++)
+      mask[i] = builder.getInt32(i / 4);
+   weights = builder.CreateShuffleVector(weights, UndefValue::get(weights->getType()),
+                                         ConstantVector::get(mask));
+
+   // unpack channel bytes to 16 bit lanes, little endian so rgba of each texel in order
+   Value * channels = builder.CreateBitCast(texels, VectorType::get(builder.getInt8Ty(), 16));
+   channels = builder.CreateZExt(channels, VectorType::get(shortType, 16));
+   channels = builder.CreateMul(channels, weights);
+
+   // sum the 4 texels of each channel
+   Value * sample = NULL;
+   for (unsigned i = 0; i < 4; i++) {
+      std::vector<Constant *> texel(4);
+      for (unsigned j = 0; j < 4; j++)
+         texel[j] = builder.getInt32(i * 4 + j);
+      Value * weighted = builder.CreateShuffleVector(channels, UndefValue::get(channels->getType()),
+                                                     ConstantVector::get(texel));
+      sample = sample ? builder.CreateAdd(sample, weighted) : weighted;
+   }
+   std::vector<Constant *> shift(4, ConstantInt::get(shortType, 8));
+   sample = builder.CreateLShr(sample, ConstantVector::get(shift));
+   sample = builder.CreateZExt(sample, intVecType(builder), name("bilinear"));
 
    return sample;
 //   if (!dstDesc || dstDesc->IsVectorType(Float)) {
@@ -271,12 +406,81 @@ static Value * texcoordWrap(IRBuilder<> & builder, const unsigned wrap,
    return tc;
 }
 
+static bool MinFilterLinear(const unsigned minFilter)
+{
+   return GGLTexture::GGL_LINEAR == minFilter || GGLTexture::GGL_LINEAR_MIPMAP_NEAREST == minFilter ||
+          GGLTexture::GGL_LINEAR_MIPMAP_LINEAR == minFilter;
+}
+
+// whether tex2D needs texcoord derivatives, to choose between min and mag filter or mipmap level
+bool tex2DLod(const GGLState * gglCtx, const unsigned sampler)
+{
+   const GGLTexture & texture = gglCtx->textureState.textures[sampler];
+   return texture.minFilter >= GGLTexture::GGL_NEAREST_MIPMAP_NEAREST ||
+          MinFilterLinear(texture.minFilter) != (GGLTexture::GGL_LINEAR == texture.magFilter);
+}
+
+// samples a level of width x height texels at indexOffset in textureData; returns <4 x i32> rgba
+static Value * SampleLevel(IRBuilder<> & builder, const GGLTexture & texture, Value * textureData,
+                           Value * indexOffset, Value * s, Value * t, Value * width,
+                           Value * height, const bool linear)
+{
+   Value * w = builder.CreateSub(width, builder.getInt32(1));
+   Value * h = builder.CreateSub(height, builder.getInt32(1));
+   Value * xLerp = NULL, * yLerp = NULL;
+   Value * x = texcoordWrap(builder, texture.wrapS, s, width, w, &xLerp);
+   Value * y = texcoordWrap(builder, texture.wrapT, t, height, h, &yLerp);
+   if (linear)
+      return linearSample(builder, textureData, indexOffset, x, y, xLerp, yLerp,
+                          w, h, width, height, texture.layout, texture.format);
+   Value * index = TexelIndex(builder, texture.layout, texture.format, x, y, width, indexOffset);
+   return pointSample(builder, textureData, index, texture.format);
+}
+
+// samples mipmap level, which is at most the last level in levels, see SetSampler
+static Value * SampleMipmap(IRBuilder<> & builder, const GGLTexture & texture, Value * textureData,
+                            Value * levels, Value * level, Value * s, Value * t,
+                            Value * width, Value * height, const bool linear)
+{
+   Value * offset = builder.CreateGEP(levels, builder.CreateAdd(level, builder.getInt32(1)));
+   offset = builder.CreateLoad(offset, name("levelOffset"));
+   width = maxIntScalar(builder, builder.CreateLShr(width, level), builder.getInt32(1));
+   height = maxIntScalar(builder, builder.CreateLShr(height, level), builder.getInt32(1));
+   return SampleLevel(builder, texture, textureData, offset, s, t, width, height, linear);
+}
+
+// log2 of texels per pixel along the screen axis texcoords change most along; dx and dy are
+// texcoord derivatives; clamped to 16 so it converts to int even if NaN
+static Value * TextureLod(IRBuilder<> & builder, Value * dx, Value * dy, Value * width,
+                          Value * height)
+{
+   Type * floatType = builder.getFloatTy();
+   std::vector<Value *> dxs = extractVector(builder, dx), dys = extractVector(builder, dy);
+   Value * w = builder.CreateUIToFP(width, floatType), * h = builder.CreateUIToFP(height, floatType);
+   Value * s = builder.CreateFMul(dxs[0], w), * t = builder.CreateFMul(dxs[1], h);
+   Value * rhoX = builder.CreateFAdd(builder.CreateFMul(s, s), builder.CreateFMul(t, t));
+   s = builder.CreateFMul(dys[0], w);
+   t = builder.CreateFMul(dys[1], h);
+   Value * rhoY = builder.CreateFAdd(builder.CreateFMul(s, s), builder.CreateFMul(t, t));
+   Value * rho = builder.CreateSelect(builder.CreateFCmpOGT(rhoX, rhoY), rhoX, rhoY);
+
+   // log2 as exponent plus linear mantissa from the float bits; halved since rho is squared
+   Value * lod = builder.CreateBitCast(rho, builder.getInt32Ty());
+   lod = builder.CreateSIToFP(lod, floatType);
+   lod = builder.CreateFMul(lod, constFloat(builder, 0.5f / (1 << 23)));
+   lod = builder.CreateFSub(lod, constFloat(builder, 127 * 0.5f), name("lod"));
+   return builder.CreateSelect(builder.CreateFCmpOLT(lod, constFloat(builder, 16)), lod,
+                               constFloat(builder, 16));
+}
+
+// dx and dy are the texcoord derivatives if tex2DLod, else NULL and level 0 is magnified
 Value * tex2D(IRBuilder<> & builder, Value * in1, const unsigned sampler,
               /*const RegDesc * in1Desc, const RegDesc * dstDesc,*/
-              const GGLState * gglCtx)
+              const GGLState * gglCtx, Value * dx, Value * dy)
 {
    Type * intType = builder.getInt32Ty();
    PointerType * intPointerType = PointerType::get(intType, 0);
+   const GGLTexture & texture = gglCtx->textureState.textures[sampler];
 
    llvm::Module * module = builder.GetInsertBlock()->getParent()->getParent();
    std::vector<Value * > texcoords = extractVector(builder, in1);
@@ -292,23 +496,12 @@ Value * tex2D(IRBuilder<> & builder, Value * in1, const unsigned sampler,
    Value * textureHeight = builder.CreateConstInBoundsGEP1_32(textureDimensions,
                            sampler * 2 + 1);
    textureHeight = builder.CreateLoad(textureHeight, name("textureHeight"));
-   Value * textureW = builder.CreateSub(textureWidth, builder.getInt32(1));
-   Value * textureH = builder.CreateSub(textureHeight, builder.getInt32(1));
 //   ChannelType sType = Float, tType = Float;
 //   if (in1Desc) {
 //      sType = in1Desc->channels[0];
 //      tType = in1Desc->channels[1];
 //   }
 
-   Value * xLerp = NULL, * yLerp = NULL;
-   Value * x = texcoordWrap(builder, gglCtx->textureState.textures[sampler].wrapS,
-                            /*sType, */texcoords[0], textureWidth, textureW, &xLerp);
-   Value * y = texcoordWrap(builder, gglCtx->textureState.textures[sampler].wrapT,
-                            /*tType, */texcoords[1], textureHeight, textureH, &yLerp);
-
-   Value * index = builder.CreateMul(y, textureWidth);
-   index = builder.CreateAdd(index, x);
-
    Value * textureData = module->getGlobalVariable(_PF2_TEXTURE_DATA_NAME_);
    if (!textureData)
       textureData = new GlobalVariable(*module, intPointerType,
@@ -318,20 +511,65 @@ Value * tex2D(IRBuilder<> & builder, Value * in1, const unsigned sampler,
    textureData = builder.CreateConstInBoundsGEP1_32(textureData, sampler);
    textureData = builder.CreateLoad(textureData);
 
-   if (0 == gglCtx->textureState.textures[sampler].minFilter &&
-         0 == gglCtx->textureState.textures[sampler].magFilter) { // GL_NEAREST
-      Value * ret = pointSample(builder, textureData, index,
-                                gglCtx->textureState.textures[sampler].format/*, dstDesc*/);
-      return intColorVecToFloatColorVec(builder, ret);
-   } else if (1 == gglCtx->textureState.textures[sampler].minFilter &&
-              1 == gglCtx->textureState.textures[sampler].magFilter) { // GL_LINEAR
-      Value * ret = linearSample(builder, textureData, builder.getInt32(0), x, y, xLerp, yLerp,
-                                 textureW, textureH,  textureWidth, textureHeight,
-                                 gglCtx->textureState.textures[sampler].format/*, dstDesc*/);
+   const bool magLinear = GGLTexture::GGL_LINEAR == texture.magFilter;
+   const bool minLinear = MinFilterLinear(texture.minFilter);
+   if (!dx) { // same min and mag filter without mipmaps, or lod 0 in vertex shader
+      Value * ret = SampleLevel(builder, texture, textureData, builder.getInt32(0),
+                                texcoords[0], texcoords[1], textureWidth, textureHeight,
+                                magLinear/*, dstDesc*/);
       return intColorVecToFloatColorVec(builder, ret);
-   } else
-      assert(!"unsupported texture filter");
-   return NULL;
+   }
+
+   Value * lod = TextureLod(builder, dx, dy, textureWidth, textureHeight);
+   Value * colorPtr = builder.CreateAlloca(intVecType(builder));
+   CondBranch condBranch(builder);
+   condBranch.ifCond(builder.CreateFCmpOGT(lod, constFloat(builder, 0)), "if_minified", "magnified");
+
+   if (texture.minFilter < GGLTexture::GGL_NEAREST_MIPMAP_NEAREST)
+      builder.CreateStore(SampleLevel(builder, texture, textureData, builder.getInt32(0),
+                                      texcoords[0], texcoords[1], textureWidth, textureHeight,
+                                      minLinear), colorPtr);
+   else {
+      Value * levels = module->getGlobalVariable(_PF2_TEXTURE_LEVELS_NAME_);
+      if (!levels)
+         levels = new GlobalVariable(*module, intType, true, GlobalValue::ExternalLinkage,
+                                     NULL, _PF2_TEXTURE_LEVELS_NAME_);
+      levels = builder.CreateConstInBoundsGEP1_32(levels, sampler * (GGL_MAXTEXTURELEVELS + 1));
+      Value * lastLevel = builder.CreateLoad(levels, name("lastLevel"));
+
+      if (GGLTexture::GGL_NEAREST_MIPMAP_NEAREST == texture.minFilter ||
+            GGLTexture::GGL_LINEAR_MIPMAP_NEAREST == texture.minFilter) {
+         Value * level = builder.CreateFAdd(lod, constFloat(builder, 0.5f));
+         level = minIntScalar(builder, builder.CreateFPToSI(level, intType), lastLevel);
+         builder.CreateStore(SampleMipmap(builder, texture, textureData, levels, level,
+                                          texcoords[0], texcoords[1], textureWidth,
+                                          textureHeight, minLinear), colorPtr);
+      } else { // lerp the nearest 2 levels
+         Value * level = builder.CreateFPToSI(lod, intType);
+         Value * lerp = builder.CreateFSub(lod, builder.CreateSIToFP(level, builder.getFloatTy()));
+         lerp = builder.CreateFMul(lerp, constFloat(builder, float(1 << SHIFT)));
+         lerp = builder.CreateFPToSI(lerp, intType);
+         Value * next = minIntScalar(builder, builder.CreateAdd(level, builder.getInt32(1)),
+                                     lastLevel);
+         level = minIntScalar(builder, level, lastLevel);
+         Value * s0 = SampleMipmap(builder, texture, textureData, levels, level, texcoords[0],
+                                   texcoords[1], textureWidth, textureHeight, minLinear);
+         Value * s1 = SampleMipmap(builder, texture, textureData, levels, next, texcoords[0],
+                                   texcoords[1], textureWidth, textureHeight, minLinear);
+         Value * sample = builder.CreateMul(builder.CreateSub(s1, s0),
+                                            intVec(builder, lerp, lerp, lerp, lerp));
+         sample = builder.CreateAShr(sample, constIntVec(builder, SHIFT, SHIFT, SHIFT, SHIFT));
+         builder.CreateStore(builder.CreateAdd(sample, s0), colorPtr);
+      }
+   }
+
+   condBranch.elseop(); // magnified
+   builder.CreateStore(SampleLevel(builder, texture, textureData, builder.getInt32(0),
+                                   texcoords[0], texcoords[1], textureWidth, textureHeight,
+                                   magLinear), colorPtr);
+   condBranch.endif();
+
+   return intColorVecToFloatColorVec(builder, builder.CreateLoad(colorPtr));
 }
 
 // only positive float; used in cube map since major axis is positive
@@ -501,8 +739,10 @@ Value * texCube(IRBuilder<> & builder, Value * in1, const unsigned sampler,
                             /*sType, */s, textureWidth, textureW, &xLerp);
    Value * y = texcoordWrap(builder, gglCtx->textureState.textures[sampler].wrapT,
                             /*tType, */t, textureHeight, textureH, &yLerp);
-   Value * indexOffset = builder.CreateMul(builder.CreateMul(textureHeight, textureWidth), face);
-   Value * index = builder.CreateAdd(builder.CreateMul(y, textureWidth), x);
+   const unsigned layout = gglCtx->textureState.textures[sampler].layout;
+   const GGLPixelFormat format = gglCtx->textureState.textures[sampler].format;
+   Value * indexOffset = builder.CreateMul(LevelTexels(builder, layout, format, textureWidth, textureHeight),
+                                           face);
 
    Value * textureData = module->getGlobalVariable(_PF2_TEXTURE_DATA_NAME_);
    if (!textureData)
@@ -513,19 +753,16 @@ Value * texCube(IRBuilder<> & builder, Value * in1, const unsigned sampler,
    textureData = builder.CreateConstInBoundsGEP1_32(textureData, sampler);
    textureData = builder.CreateLoad(textureData);
 
-   if (0 == gglCtx->textureState.textures[sampler].minFilter &&
-         0 == gglCtx->textureState.textures[sampler].magFilter) { // GL_NEAREST
-      textureData = pointSample(builder, textureData, builder.CreateAdd(indexOffset, index),
+   // level 0 with magFilter, like tex2D without derivatives
+   if (GGLTexture::GGL_NEAREST == gglCtx->textureState.textures[sampler].magFilter) {
+      Value * index = TexelIndex(builder, layout, format, x, y, textureWidth, indexOffset);
+      textureData = pointSample(builder, textureData, index,
                                 gglCtx->textureState.textures[sampler].format/*, dstDesc*/);
       return intColorVecToFloatColorVec(builder, textureData);
-
-   } else if (1 == gglCtx->textureState.textures[sampler].minFilter &&
-              1 == gglCtx->textureState.textures[sampler].magFilter) { // GL_LINEAR
+   } else {
       textureData = linearSample(builder, textureData, indexOffset, x, y, xLerp, yLerp,
-                                 textureW, textureH,  textureWidth, textureHeight,
+                                 textureW, textureH,  textureWidth, textureHeight, layout,
                                  gglCtx->textureState.textures[sampler].format/*, dstDesc*/);
       return intColorVecToFloatColorVec(builder, textureData);
-   } else
-      assert(!"unsupported texture filter");
-   return NULL;
+   }
 }
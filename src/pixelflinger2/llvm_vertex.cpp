@@ -0,0 +1,112 @@
+/**
+ **
+ ** Copyright 2011, The Android Open Source Project
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include "src/pixelflinger2/pixelflinger2.h"
+#include "src/pixelflinger2/llvm_helper.h"
+#include "src/mesa/main/mtypes.h"
+
+#include <llvm/Module.h>
+
+using namespace llvm;
+
+static FunctionType * VertexBatchFunctionType(IRBuilder<> & builder)
+{
+   std::vector<Type*> funcArgs;
+   PointerType * vectorPtr = PointerType::get(floatVecType(builder), 0);
+
+   funcArgs.push_back(vectorPtr); // inputs
+   funcArgs.push_back(vectorPtr); // outputs
+   funcArgs.push_back(vectorPtr); // constants
+   funcArgs.push_back(builder.getInt32Ty()); // count
+
+   FunctionType *functionType = FunctionType::get(/*Result=*/builder.getVoidTy(),
+                                                  llvm::ArrayRef<Type*>(funcArgs),
+                                                  /*isVarArg=*/false);
+
+   return functionType;
+}
+
+// generated vertex batch function parameters are VertexInput * inputs, VertexOutput * outputs,
+// const float (*constants)[4], unsigned count
+// the vertex shader is inlined GGL_VERTEX_BATCH_WIDTH times per iteration so that
+// independent vertices are scheduled together, then the remainder is done one at a time
+void GenerateVertexBatch(Module * mod, const char * shaderName, const char * batchName)
+{
+   IRBuilder<> builder(mod->getContext());
+
+   Type * intType = builder.getInt32Ty();
+   PointerType * vectorPtr = PointerType::get(floatVecType(builder), 0);
+
+   Function * func = mod->getFunction(batchName);
+   if (func)
+      return;
+
+   Function * vsFunction = mod->getFunction(shaderName);
+   assert(vsFunction);
+   vsFunction->addFnAttr(Attribute::AlwaysInline);
+
+   func = llvm::cast<Function>(mod->getOrInsertFunction(batchName,
+                               VertexBatchFunctionType(builder)));
+
+   BasicBlock *label_entry = BasicBlock::Create(builder.getContext(), "entry", func, 0);
+   builder.SetInsertPoint(label_entry);
+   CondBranch condBranch(builder);
+
+   Function::arg_iterator args = func->arg_begin();
+   Value * inputsPtr = builder.CreateAlloca(vectorPtr);
+   builder.CreateStore(args++, inputsPtr);
+   Value * outputsPtr = builder.CreateAlloca(vectorPtr);
+   builder.CreateStore(args++, outputsPtr);
+   Value * constants = args++;
+   constants->setName("constants");
+   Value * countPtr = builder.CreateAlloca(intType);
+   builder.CreateStore(args++, countPtr);
+
+   const unsigned inputStride = sizeof(VertexInput) / sizeof(Vector4);
+   const unsigned outputStride = sizeof(VertexOutput) / sizeof(Vector4);
+   const unsigned widths[] = {GGL_VERTEX_BATCH_WIDTH, 1};
+   for (unsigned w = 0; w < sizeof(widths) / sizeof(*widths); w++) {
+      const unsigned width = widths[w];
+      condBranch.beginLoop(); // while (count >= width)
+
+      Value * count = builder.CreateLoad(countPtr);
+      count->setName("count");
+      Value * cmp = builder.CreateICmpULT(count, builder.getInt32(width));
+      condBranch.ifCond(cmp, "if_break_loop"); // if (count < width)
+      condBranch.brk(); // break;
+      condBranch.endif();
+
+      Value * inputs = builder.CreateLoad(inputsPtr, "inputs");
+      Value * outputs = builder.CreateLoad(outputsPtr, "outputs");
+      for (unsigned i = 0; i < width; i++) {
+         CallInst *call = builder.CreateCall3(vsFunction,
+                                              builder.CreateConstInBoundsGEP1_32(inputs, i * inputStride),
+                                              builder.CreateConstInBoundsGEP1_32(outputs, i * outputStride),
+                                              constants);
+         call->setCallingConv(CallingConv::C);
+         call->setTailCall(false);
+      }
+
+      builder.CreateStore(builder.CreateConstInBoundsGEP1_32(inputs, width * inputStride), inputsPtr);
+      builder.CreateStore(builder.CreateConstInBoundsGEP1_32(outputs, width * outputStride), outputsPtr);
+      builder.CreateStore(builder.CreateSub(count, builder.getInt32(width)), countPtr);
+
+      condBranch.endLoop();
+   }
+
+   builder.CreateRetVoid();
+}
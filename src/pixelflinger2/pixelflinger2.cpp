@@ -48,10 +48,19 @@ static void Viewport(GGLInterface * iface, GLint x, GLint y, GLsizei width, GLsi
 static void CullFace(GGLInterface * iface, GLenum mode)
 {
    GGL_GET_CONTEXT(ctx, iface);
-   if (GL_FRONT > mode || GL_FRONT_AND_BACK < mode)
+   switch (mode) {
+   case GL_FRONT:
+      ctx->cullState.cullFace = 0;
+      break;
+   case GL_BACK:
+      ctx->cullState.cullFace = 1;
+      break;
+   case GL_FRONT_AND_BACK: // does not fit GLenum - GL_FRONT in 2 bits
+      ctx->cullState.cullFace = 2;
+      break;
+   default:
       gglError(GL_INVALID_ENUM);
-   else
-      ctx->cullState.cullFace = mode - GL_FRONT;
+   }
 }
 
 static void FrontFace(GGLInterface * iface, GLenum mode)
@@ -66,11 +75,15 @@ static void FrontFace(GGLInterface * iface, GLenum mode)
 static void BlendColor(GGLInterface * iface, GLclampf red, GLclampf green, GLclampf blue, GLclampf alpha)
 {
    GGL_GET_CONTEXT(ctx, iface);
-   ctx->state.blendState.color[0] = MIN2(MAX2(red * 255, 0.0f), 255.0f);
-   ctx->state.blendState.color[1] = MIN2(MAX2(green * 255, 0.0f), 255.0f);
-   ctx->state.blendState.color[2] = MIN2(MAX2(blue * 255, 0.0f), 255.0f);
-   ctx->state.blendState.color[3] = MIN2(MAX2(alpha * 255, 0.0f), 255.0f);
-   SetShaderVerifyFunctions(iface);
+   unsigned char color[4];
+   color[0] = MIN2(MAX2(red * 255, 0.0f), 255.0f);
+   color[1] = MIN2(MAX2(green * 255, 0.0f), 255.0f);
+   color[2] = MIN2(MAX2(blue * 255, 0.0f), 255.0f);
+   color[3] = MIN2(MAX2(alpha * 255, 0.0f), 255.0f);
+   if (!memcmp(ctx->state.blendState.color, color, sizeof(color)))
+      return;
+   memcpy(ctx->state.blendState.color, color, sizeof(color));
+   SetShaderDirty(iface, GGL_DIRTY_BLEND);
 }
 
 static void BlendEquationSeparate(GGLInterface * iface, GLenum modeRGB, GLenum modeAlpha)
@@ -82,9 +95,13 @@ static void BlendEquationSeparate(GGLInterface * iface, GLenum modeRGB, GLenum m
    if (GL_FUNC_ADD != modeRGB && (GL_FUNC_SUBTRACT > modeRGB ||
                                   GL_FUNC_REVERSE_SUBTRACT < modeRGB))
       return gglError(GL_INVALID_ENUM);
-   ctx->state.blendState.ce = (GGLBlendState::GGLBlendFunc)(modeRGB - GL_FUNC_ADD);
-   ctx->state.blendState.ae = (GGLBlendState::GGLBlendFunc)(modeAlpha - GL_FUNC_ADD);
-   SetShaderVerifyFunctions(iface);
+   const GGLBlendState::GGLBlendFunc ce = (GGLBlendState::GGLBlendFunc)(modeRGB - GL_FUNC_ADD);
+   const GGLBlendState::GGLBlendFunc ae = (GGLBlendState::GGLBlendFunc)(modeAlpha - GL_FUNC_ADD);
+   if (ctx->state.blendState.ce == ce && ctx->state.blendState.ae == ae)
+      return;
+   ctx->state.blendState.ce = ce;
+   ctx->state.blendState.ae = ae;
+   SetShaderDirty(iface, GGL_DIRTY_BLEND);
 }
 
 static inline GGLBlendState::GGLBlendFactor GLBlendFactor(const GLenum factor)
@@ -135,33 +152,39 @@ static void BlendFuncSeparate(GGLInterface * iface, GLenum srcRGB, GLenum dstRGB
       srcAlpha = GL_ONE;
    // in c++ it's templated function for color and alpha,
    // so it requires setting srcAlpha to GL_ONE to run template again only for alpha
-   ctx->state.blendState.scf = GLBlendFactor(srcRGB);
-   ctx->state.blendState.saf = GLBlendFactor(srcAlpha);
-   ctx->state.blendState.dcf = GLBlendFactor(dstRGB);
-   ctx->state.blendState.daf = GLBlendFactor(dstAlpha);
-   SetShaderVerifyFunctions(iface);
-
+   const GGLBlendState::GGLBlendFactor scf = GLBlendFactor(srcRGB), saf = GLBlendFactor(srcAlpha);
+   const GGLBlendState::GGLBlendFactor dcf = GLBlendFactor(dstRGB), daf = GLBlendFactor(dstAlpha);
+   if (ctx->state.blendState.scf == scf && ctx->state.blendState.saf == saf &&
+         ctx->state.blendState.dcf == dcf && ctx->state.blendState.daf == daf)
+      return;
+   ctx->state.blendState.scf = scf;
+   ctx->state.blendState.saf = saf;
+   ctx->state.blendState.dcf = dcf;
+   ctx->state.blendState.daf = daf;
+   SetShaderDirty(iface, GGL_DIRTY_BLEND);
 }
 
 static void EnableDisable(GGLInterface * iface, GLenum cap, GLboolean enable)
 {
    GGL_GET_CONTEXT(ctx, iface);
-   bool changed = false;
+   unsigned changed = 0; // GGLDirty bits
    switch (cap) {
    case GL_BLEND:
-      changed |= ctx->state.blendState.enable ^ enable;
+      if (ctx->state.blendState.enable != enable)
+         changed |= GGL_DIRTY_BLEND;
       ctx->state.blendState.enable = enable;
       break;
    case GL_CULL_FACE:
-      changed |= ctx->cullState.enable ^ enable;
       ctx->cullState.enable = enable;
       break;
    case GL_DEPTH_TEST:
-      changed |= ctx->state.bufferState.depthTest ^ enable;
+      if (ctx->state.bufferState.depthTest != enable)
+         changed |= GGL_DIRTY_BUFFER;
       ctx->state.bufferState.depthTest = enable;
       break;
    case GL_STENCIL_TEST:
-      changed |= ctx->state.bufferState.stencilTest ^ enable;
+      if (ctx->state.bufferState.stencilTest != enable)
+         changed |= GGL_DIRTY_BUFFER;
       ctx->state.bufferState.stencilTest = enable;
       break;
    case GL_DITHER:
@@ -180,13 +203,32 @@ static void EnableDisable(GGLInterface * iface, GLenum cap, GLboolean enable)
       break;
    }
    if (changed)
-      SetShaderVerifyFunctions(iface);
+      SetShaderDirty(iface, changed);
+}
+
+static void Hint(GGLInterface * iface, GLenum target, GLenum mode)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   if (GL_FASTEST != mode && GL_NICEST != mode && GL_DONT_CARE != mode)
+      return gglError(GL_INVALID_ENUM);
+   switch (target) {
+   case GL_PERSPECTIVE_CORRECTION_HINT:
+      if (ctx->state.bufferState.perspective != (GL_NICEST == mode)) {
+         ctx->state.bufferState.perspective = GL_NICEST == mode;
+         SetShaderDirty(iface, GGL_DIRTY_BUFFER);
+      }
+      break;
+   case GL_GENERATE_MIPMAP_HINT:
+      break;
+   default:
+      gglError(GL_INVALID_ENUM);
+   }
 }
 
 void InitializeGGLState(GGLInterface * iface)
 {
-#if USE_DUAL_THREAD
-   reinterpret_cast<GGLContext *>(iface)->worker = GGLContext::Worker();
+#if USE_TILE_THREADS
+   InitializeTileRaster(iface);
 #endif
    iface->DepthRangef = DepthRangef;
    iface->Viewport = Viewport;
@@ -196,6 +238,7 @@ void InitializeGGLState(GGLInterface * iface)
    iface->BlendEquationSeparate = BlendEquationSeparate;
    iface->BlendFuncSeparate = BlendFuncSeparate;
    iface->EnableDisable = EnableDisable;
+   iface->Hint = Hint;
 
    InitializeBufferFunctions(iface);
    InitializeRasterFunctions(iface);
@@ -216,6 +259,8 @@ void InitializeGGLState(GGLInterface * iface)
    iface->CullFace(iface, GL_BACK);
    iface->EnableDisable(iface, GL_CULL_FACE, false);
 
+   iface->Hint(iface, GL_PERSPECTIVE_CORRECTION_HINT, GL_DONT_CARE);
+
    iface->EnableDisable(iface, GL_BLEND, false);
    iface->BlendColor(iface, 0, 0, 0, 0);
    iface->BlendEquationSeparate(iface, GL_FUNC_ADD, GL_FUNC_ADD);
@@ -229,6 +274,8 @@ void InitializeGGLState(GGLInterface * iface)
    iface->SetBuffer(iface, GL_STENCIL_BUFFER_BIT, NULL);
 
    SetShaderVerifyFunctions(iface);
+
+   InitializeCommandBuffer(iface);
 }
 
 GGLInterface * CreateGGLInterface()
@@ -248,8 +295,9 @@ GGLInterface * CreateGGLInterface()
 
 void UninitializeGGLState(GGLInterface * iface)
 {
-#if USE_DUAL_THREAD
-   reinterpret_cast<GGLContext *>(iface)->worker.~Worker();
+   DestroyCommandBuffer(iface);
+#if USE_TILE_THREADS
+   DestroyTileRaster(iface);
 #endif
    DestroyShaderFunctions(iface);
 
@@ -262,8 +310,8 @@ void UninitializeGGLState(GGLInterface * iface)
 #if USE_LLVM_EXECUTIONENGINE
    puts("USE_LLVM_EXECUTIONENGINE");
 #endif
-#if USE_DUAL_THREAD
-   puts("USE_DUAL_THREAD");
+#if USE_TILE_THREADS
+   puts("USE_TILE_THREADS");
 #endif
    hieralloc_report_brief(NULL, stdout);
 }
@@ -23,7 +23,12 @@
 #ifndef USE_LLVM_EXECUTIONENGINE
 #define USE_LLVM_EXECUTIONENGINE 0 // 1 to use llvm::Execution, 0 to use libBCC, requires modifying makefile
 #endif
-#define USE_DUAL_THREAD 1
+#define USE_LLVM_VERTEX_BATCH 1 // also generate a vertex shader entry processing many vertices
+#define USE_TILE_THREADS 1 // bin triangles into screen tiles rastered by a pool of threads
+#define USE_HALF_SPACE_RASTER 1 // raster triangles by edge functions on blocks, else by trapezoids
+#define USE_ASYNC_JIT 1 // JIT new scanline states on a thread, drawing with GenericScanLine meanwhile
+#define USE_BLIT_FAST_PATH 1 // copy or fill screen aligned quads of trivial fragment shaders, see blit.cpp
+#define USE_RASTER_COUNTERS 0 // count vertices, scan lines, fragments and stage times in GGLCounters
 
 #define debug_printf printf
 
@@ -71,12 +76,31 @@ class LLVMContext;
 typedef int BlendComp_t;
 #endif
 
-#if USE_DUAL_THREAD
+#if USE_TILE_THREADS
 #include <pthread.h>
 #endif
 
+#define GGL_TILE_SIZE 64 // tile width and height in pixels, multiple of 8
+#define GGL_TILE_BATCH_TRIANGLES 512 // triangles binned before handing tiles to threads
+#define GGL_GUARD_BAND 64 // x and y are clipped at this many times the viewport, well within 2^20
+#define GGL_CLIP_MIN_W 1e-6f // vertices are clipped to w >= this, so dividing by w is finite
+#define GGL_RASTER_BLOCK_SIZE 8 // half-space raster block width and height in pixels, power of 2
+#define GGL_SUBPIXEL_BITS 4 // fractional bits of fixed point positions for half-space edges
+#define GGL_VERTEX_BATCH_WIDTH 4 // vertices per iteration of generated vertex batch function
+#define GGL_VERTEX_BATCH_MAX 1024 // DrawElements index range processed in one batch
+#define GGL_TEXTURE_TILE_BITS 2 // GGL_TEXTURE_TILED levels are stored in tiles of 4x4 texels
+
 typedef void (*ShaderFunction_t)(const void*,void*,const void*);
 
+// parts of GGLState changed since the last ShaderUse, see SetShaderDirty and GetShaderKey
+enum GGLDirty {
+   GGL_DIRTY_STENCIL = 1 << 0, // frontStencil or backStencil
+   GGL_DIRTY_BUFFER = 1 << 1,
+   GGL_DIRTY_BLEND = 1 << 2,
+   GGL_DIRTY_TEXTURE = 1 << 3, // shifted left by texture unit
+   GGL_DIRTY_ALL = ~0U
+};
+
 #define GGL_GET_CONTEXT(context, interface) GGLContext * context = (GGLContext *)interface;
 #define GGL_GET_CONST_CONTEXT(context, interface) const GGLContext * context = \
     (const GGLContext *)interface; (void)context;
@@ -99,53 +123,17 @@ struct GGLContext {
    gl_shader_program * CurrentProgram;
 
    mutable GGLActiveStencil activeStencil; // after primitive assembly, call StencilSelect
+   mutable GGLCounters counters; // incremented by triangle setup
 
    GGLState state; // states affecting jit
+   unsigned dirty; // GGLDirty bits of state changed since the last ShaderUse
 
-#if USE_DUAL_THREAD
-   mutable struct Worker {
-      const GGLInterface * iface;
-      unsigned startY, endY, varyingCount;
-      VertexOutput bV, cV, bDx, cDx;
-      int width, height;
-      bool assignedWork; // only used by main; worker uses assignCond & quit
-      bool quit;
-
-      pthread_cond_t assignCond;
-      pthread_mutex_t assignLock; // held by worker execpt for during cond_wait assign
-      pthread_cond_t finishCond;
-      pthread_mutex_t finishLock; // held by main except for during cond_wait finish
-      pthread_t thread;
-
-      Worker() : assignedWork(false), quit(false), thread(0)
-      {
-         pthread_cond_init(&assignCond, NULL);
-         pthread_cond_init(&finishCond, NULL);
-         pthread_mutex_init(&assignLock, NULL);
-         pthread_mutex_init(&finishLock, NULL);
-         pthread_mutex_lock(&finishLock);
-         // actual thread is created later in raster.cpp
-      }
-      ~Worker()
-      {
-         if (0 != thread)
-         {
-            pthread_mutex_lock(&assignLock);
-            quit = true;
-            pthread_cond_signal(&assignCond); // signal thread to quit
-            pthread_mutex_unlock(&assignLock);
-            pthread_join(thread, NULL);
-         }
-         pthread_mutex_unlock(&finishLock);
-
-         pthread_cond_destroy(&assignCond);
-         pthread_cond_destroy(&finishCond);
-         pthread_mutex_destroy(&assignLock);
-         pthread_mutex_destroy(&finishLock);
-      }
-   } worker;
+#if USE_TILE_THREADS
+   struct TileRaster * tileRaster; // binned triangles and raster threads, see tile.cpp
 #endif
 
+   struct CommandBuffer * commandBuffer; // recorded calls while deferred, see command.cpp
+
    // called by ShaderUse to set to proper rendering functions
    void (* PickScanLine)(GGLInterface * iface);
    void (* PickRaster)(GGLInterface * iface);
@@ -162,12 +150,42 @@ unsigned enable :
 unsigned frontFace :
       1; // GL_CW = 0, GL_CCW, actual value is GLenum - GL_CW
 unsigned cullFace :
-      2; // GL_FRONT = 0, GL_BACK, GL_FRONT_AND_BACK, value = GLenum - GL_FRONT
+      2; // GL_FRONT = 0, GL_BACK, GL_FRONT_AND_BACK = 2
    } cullState;
 };
 
+// scizor rectangle in pixels; right and bottom are exclusive
+struct RasterRect {
+   int left, top, right, bottom;
+};
+
+// everything needed to scan line a triangle, copied so that it remains valid
+// while raster threads work and the context state changes
+struct RasterTarget {
+   const gl_shader_program * program;
+   GGLPixelFormat colorFormat;
+   void * frame;
+   int * depth;
+   unsigned char * stencil;
+   unsigned width, height;
+   const float (*constants)[4];
+   void (* function)(); // fragment shader function, snapshot so ShaderJitPoll can switch it
+   const GGLState * generic; // if not NULL, function is the shader main and state is read from it
+   GGLCounters * counters; // USE_RASTER_COUNTERS adds to it if not NULL; one per raster thread
+};
+
+#if USE_RASTER_COUNTERS
+// int counters the generated scan line adds to in vertices[0].pointSize.i, see ScanLineSpan
+enum GGLScanLineCount {
+   GGL_COUNT_SHADED = 0, // passed stencil and depth tests
+   GGL_COUNT_BLENDED,
+   GGL_COUNT_STENCIL_REJECTS
+};
+#endif
+
 #define _PF2_TEXTURE_DATA_NAME_ "gl_PF2TEXTURE_DATA" /* sampler data pointers used by LLVM */
 #define _PF2_TEXTURE_DIMENSIONS_NAME_ "gl_PF2TEXTURE_DIMENSIONS" /* sampler dimensions used by LLVM */
+#define _PF2_TEXTURE_LEVELS_NAME_ "gl_PF2TEXTURE_LEVELS" /* sampler mipmap levels used by LLVM */
 
 void gglError(unsigned error); // not implmented, just an assert
 
@@ -180,9 +198,126 @@ void InitializeRasterFunctions(GGLInterface * iface);
 void InitializeScanLineFunctions(GGLInterface * iface);
 void InitializeTextureFunctions(GGLInterface * iface);
 
+// bytes per pixel of color buffer format, 0 if not supported as a color buffer
+unsigned ColorFormatSize(const GGLPixelFormat format);
+// color buffer pixel of format to and from [0,255] rgba, as the scanline JIT reads and writes it
+void ColorFormatToRGBA(const GGLPixelFormat format, const unsigned pixel, int rgba[4]);
+unsigned RGBAToColorFormat(const GGLPixelFormat format, const int rgba[4]);
+
+// sets target program, function and generic from the fragment shader of program,
+// first switching it to its compiled scanline if ready, see ShaderJitPoll; iface is the
+// context whose raster threads draw target, NULL if drawn on the calling thread
+void GetFragmentFunction(const GGLInterface * iface, gl_shader_program * program,
+                         RasterTarget * target);
+
+// whether fragment inputs are followed by their steps along x and y, see ScanLineSpan; needed
+// by dFdx and dFdy, and by textures whose filter or mipmap level depends on texcoord derivatives
+bool UsesInputSteps(const gl_shader_program * program, const GGLState * state);
+
+// GGLScanLine with the left edge step per row, used to compute dFdy; edgeStep may be NULL
+void ScanLineEdge(const RasterTarget * target, GGLActiveStencil * activeStencil,
+                  const VertexOutput * start, const VertexOutput * end,
+                  const VertexOutput * edgeStep);
+
+// scan lines count pixels from x, y; vertices are the fragment inputs at x, y followed by their
+// step along x, then along y for dFdy; vertices[0] is modified
+void ScanLineSpan(const RasterTarget * target, GGLActiveStencil * activeStencil,
+                  unsigned x, unsigned y, unsigned count, VertexOutput vertices[3]);
+
+// rasters a vertex processed triangle into the part of target inside rect
+void RasterTriangleRect(const RasterTarget * target, const RasterRect * rect,
+                        GGLActiveStencil * activeStencil, const VertexOutput * v1,
+                        const VertexOutput * v2, const VertexOutput * v3);
+
+#if USE_TILE_THREADS
+void InitializeTileRaster(GGLInterface * iface);
+void DestroyTileRaster(GGLInterface * iface); // waits for and stops raster threads
+void TileRasterTriangle(const GGLInterface * iface, const VertexOutput * v1,
+                        const VertexOutput * v2, const VertexOutput * v3); // bins triangle
+void TileRasterFinish(const GGLInterface * iface); // rasters all binned triangles and waits
+void TileRasterFlush(const GGLInterface * iface); // hands binned triangles to threads, no wait
+unsigned TileRasterFinishes(const GGLInterface * iface); // TileRasterFinish calls so far
+// adds the counters of raster threads to counters and resets them; threads must be idle
+void TileRasterCounters(const GGLInterface * iface, GGLCounters * counters);
+#endif
+
+#if USE_BLIT_FAST_PATH
+// trivial fragment shaders whose screen aligned quads DrawBlit writes without scanline
+enum GGLBlitKind {
+   GGL_BLIT_NONE = 0,
+   GGL_BLIT_FILL_CONSTANT, // gl_FragColor = vec4 constant, in BlitColor
+   GGL_BLIT_FILL_UNIFORM, // gl_FragColor = vec4 uniform at BlitSource
+   GGL_BLIT_TEXTURE // gl_FragColor = texture2D(sampler unit BlitSource, varying BlitCoord)
+};
+
+void ClassifyBlit(gl_shader * shader); // sets BlitKind and its sources from linked IR
+// whether state and the current program let DrawBlit write quads; checked before shading
+bool BlitEligible(const GGLInterface * iface);
+// writes the quad of 2 triangles of vertex indices directly to frameSurface if it is screen
+// aligned; shaded are their processed vertices, kept for drawing them as triangles otherwise;
+// BlitEligible must be true; returns false without drawing if the quad is not aligned
+bool DrawBlit(const GGLInterface * iface, const unsigned triangles[2][3],
+              const VertexOutput shaded[2][3]);
+#endif
+
+void InitializeCommandBuffer(GGLInterface * iface); // sets SetDeferred and Flush
+void DestroyCommandBuffer(GGLInterface * iface); // flushes and leaves deferred mode
+
 void InitializeShaderFunctions(GGLInterface * iface); // set function pointers and create needed objects
 void SetShaderVerifyFunctions(GGLInterface * iface); // called by state change functions
+// marks GGLDirty parts of state changed, then SetShaderVerifyFunctions; only called on change
+void SetShaderDirty(GGLInterface * iface, unsigned dirty);
+// switches fragment shader from the generic main to its scanline once compiled, see GGLShaderUse;
+// iface as for GetFragmentFunction
+void ShaderJitPoll(const GGLInterface * iface, gl_shader_program * program);
+// marks uniform values of program changed, so specializations with the old ones are not used
+void UniformChanged(gl_shader_program * program);
 void DestroyShaderFunctions(GGLInterface * iface); // destroy needed objects
 // actual gl_shader and gl_shader_program is created and destroyed by Shader(Program)Create/Delete,
 
+#define GGL_JIT_FIRST_LEVEL 1 // LLVM optimization level of new JIT instances, see OptimizeModule
+#define GGL_JIT_HOT_LEVEL 3 // of fragment shaders recompiled after GGL_JIT_HOT_DRAWS raster batches
+#define GGL_JIT_HOT_DRAWS 64
+#define GGL_JIT_UNIFORM_DRAWS 0 // raster batches with unchanged uniforms before folding them, 0 is off
+#define GGL_SHADER_CACHE_BUDGET (4 << 20) // default estimated bytes of JIT instances kept in memory
+// increment when generated code changes for the same ShaderKey
+#define GGL_SHADER_CACHE_VERSION (3 | USE_RASTER_COUNTERS << 16)
+#define GGL_SHADER_CACHE_HASH_SEED 0xcbf29ce484222325ULL // FNV-1a 64 offset basis
+
+// monotonic nanoseconds, the start of a phase for ShaderStatsPhase
+unsigned long long ShaderStatsTime();
+// adds counts of add to stats if not NULL, and to the process wide stats; thread safe
+void ShaderStatsAdd(GGLShaderStats_t * stats, const GGLShaderStats_t * add);
+// adds a run of phase that began at start, and its net hieralloc bytes, like ShaderStatsAdd
+void ShaderStatsPhase(GGLShaderStats_t * stats, const GGLShaderPhase phase,
+                      const unsigned long long start, const int bytes = 0);
+
+// adds its lifetime in nanoseconds to time, less what nested gained meanwhile
+struct StageTimer {
+   unsigned long long & time;
+   const unsigned long long * nested;
+   unsigned long long start, nestedStart;
+   StageTimer(unsigned long long & time, const unsigned long long * nested = NULL)
+         : time(time), nested(nested), start(ShaderStatsTime()), nestedStart(nested ? *nested : 0) {}
+   ~StageTimer() {
+      time += ShaderStatsTime() - start - (nested ? *nested - nestedStart : 0);
+   }
+};
+
+// on disk generated bitcode, see shader_cache.cpp
+struct ShaderCacheEntry {
+   unsigned long long hash; // of program link hash, shader type and ShaderKey; names the file
+   const char * bitcode; // inside map, NULL if not loaded
+   unsigned size;
+   void * map;
+   unsigned mapSize;
+};
+
+const char * ShaderCacheDir(); // NULL if disabled
+unsigned long long ShaderCacheHash(const void * data, unsigned size,
+                                   unsigned long long hash = GGL_SHADER_CACHE_HASH_SEED);
+bool ShaderCacheLoad(ShaderCacheEntry * entry); // mmaps and validates the file for entry->hash
+void ShaderCacheUnload(ShaderCacheEntry * entry);
+void ShaderCacheStore(const ShaderCacheEntry * entry, const char * bitcode, unsigned size);
+
 #endif // #ifndef _PIXELFLINGER2_H_
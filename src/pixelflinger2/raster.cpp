@@ -19,6 +19,7 @@
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
+#include <malloc.h>
 
 #include "pixelflinger2.h"
 #include "src/mesa/main/mtypes.h"
@@ -65,6 +66,10 @@ static void ProcessVertex(const GGLInterface * iface, const VertexInput * input,
                           VertexOutput * output)
 {
    GGL_GET_CONST_CONTEXT(ctx, iface);
+#if USE_RASTER_COUNTERS
+   ctx->counters.vertices++;
+   StageTimer timer(ctx->counters.vertexTime);
+#endif
 
 //#if !USE_LLVM_TEXTURE_SAMPLER
 //    extern const GGLContext * textureGGLContext;
@@ -86,137 +91,74 @@ static void ProcessVertex(const GGLInterface * iface, const VertexInput * input,
 //#endif
 }
 
-#if USE_DUAL_THREAD
-static void * RasterTrapezoidWorker(void * threadArgs)
-{
-   GGLContext::Worker * args = (GGLContext::Worker *)threadArgs;
-   VertexOutput clip0, clip1, * left, * right;
-
-   pthread_mutex_lock(&args->finishLock);
-   pthread_mutex_lock(&args->assignLock);
-   pthread_cond_signal(&args->finishCond);
-   pthread_mutex_unlock(&args->finishLock);
-
-   while (true) {
-      pthread_cond_wait(&args->assignCond, &args->assignLock);
-      if (args->quit)
-      {
-         pthread_mutex_unlock(&args->assignLock);
-         break;
-      }
-      else
-          assert(args->assignedWork);
-
-      for (unsigned y = args->startY; y <= args->endY; y += 2) {
-         do {
-            if (args->bV.position.x < 0) {
-               if (args->cV.position.x < 0)
-                  break;
-               InterpolateVertex(&args->bV, &args->cV, -args->bV.position.x /
-                                 (args->cV.position.x - args->bV.position.x),
-                                 &clip0, args->varyingCount);
-               left = &clip0;
-            } else
-               left = &args->bV;
-            if ((int)args->cV.position.x >= (int)args->width) {
-               if (args->bV.position.x >= (int)args->width)
-                  break;
-               InterpolateVertex(&args->bV, &args->cV, (args->width - 1 - args->bV.position.x) /
-                                 (args->cV.position.x - args->bV.position.x),
-                                 &clip1, args->varyingCount);
-               right = &clip1;
-            } else
-               right = &args->cV;
-            args->iface->ScanLine(args->iface, left, right);
-         } while (false);
-         for (unsigned i = 0; i < args->varyingCount; i++) {
-            args->bV.varyings[i] += args->bDx.varyings[i];
-            args->cV.varyings[i] += args->cDx.varyings[i];
-         }
-         args->bV.position += args->bDx.position;
-         args->cV.position += args->cDx.position;
-         args->bV.frontFacingPointCoord += args->bDx.frontFacingPointCoord;
-         args->cV.frontFacingPointCoord += args->cDx.frontFacingPointCoord;
-      }
+typedef void (*VertexBatchFunction_t)(const VertexInput *, VertexOutput *, const float (*)[4],
+                                      unsigned);
 
-      pthread_mutex_lock(&args->finishLock);
-      pthread_cond_signal(&args->finishCond);
-      pthread_mutex_unlock(&args->finishLock);
-   }
-   pthread_exit(NULL);
-   return NULL;
+void GGLProcessVertices(const gl_shader_program * program, const VertexInput * inputs,
+                        VertexOutput * outputs, const float (*constants)[4], unsigned count)
+{
+   const gl_shader * shader = program->_LinkedShaders[MESA_SHADER_VERTEX];
+   if (shader->batchFunction)
+      return ((VertexBatchFunction_t)shader->batchFunction)(inputs, outputs, constants, count);
+   for (unsigned i = 0; i < count; i++)
+      GGLProcessVertex(program, inputs + i, outputs + i, constants);
 }
-#endif
 
-static void RasterTrapezoid(const GGLInterface * iface, const VertexOutput * tl,
-                            const VertexOutput * tr, const VertexOutput * bl,
-                            const VertexOutput * br)
+static void ProcessVertices(const GGLInterface * iface, const VertexInput * inputs,
+                            VertexOutput * outputs, unsigned count)
 {
    GGL_GET_CONST_CONTEXT(ctx, iface);
+#if USE_RASTER_COUNTERS
+   ctx->counters.vertices += count;
+   StageTimer timer(ctx->counters.vertexTime);
+#endif
+   GGLProcessVertices(ctx->CurrentProgram, inputs, outputs, ctx->CurrentProgram->ValuesUniform, count);
+}
+
+// v += d * steps, for position, gl_PointCoord and varyings
+static inline void AdvanceVertex(VertexOutput * v, const VertexOutput * d, const VectorComp_t steps,
+                                 const unsigned varyingCount)
+{
+   Vector4 step;
+   for (unsigned i = 0; i < varyingCount; i++) {
+      step = d->varyings[i];
+      step *= steps;
+      v->varyings[i] += step;
+   }
+   step = d->position;
+   step *= steps;
+   v->position += step;
+   step = d->frontFacingPointCoord;
+   step *= steps;
+   v->frontFacingPointCoord += step;
+}
 
+static void RasterTrapezoidRect(const RasterTarget * target, const RasterRect * rect,
+                                GGLActiveStencil * activeStencil, const VertexOutput * tl,
+                                const VertexOutput * tr, const VertexOutput * bl,
+                                const VertexOutput * br)
+{
    assert(tl->position.x <= tr->position.x && bl->position.x <= br->position.x);
    assert(tl->position.y <= bl->position.y && tr->position.y <= br->position.y);
    assert(fabs(tl->position.y - tr->position.y) < 1 && fabs(bl->position.y - br->position.y) < 1);
 
-   const unsigned width = ctx->frameSurface.width, height = ctx->frameSurface.height;
-   const unsigned varyingCount = ctx->CurrentProgram->VaryingSlots;
-
+   const unsigned varyingCount = target->program->VaryingSlots;
 
    // tlv-trv and blv-brv are parallel and horizontal
-   VertexOutput tlv(*tl), trv(*tr), blv(*bl), brv(*br);
-   VertexOutput tmp;
-
-   // vertically clip
-
-   if ((int)tlv.position.y < 0) {
-      InterpolateVertex(&tlv, &blv, (0 - tlv.position.y) / (blv.position.y - tlv.position.y),
-                        &tmp, varyingCount);
-      tlv = tmp;
-   }
-   if ((int)trv.position.y < 0) {
-      InterpolateVertex(&trv, &brv, (0 - trv.position.y) / (brv.position.y - trv.position.y),
-                        &tmp, varyingCount);
-      trv = tmp;
-   }
-   if ((int)blv.position.y >= (int)height) {
-      InterpolateVertex(&tlv, &blv, (height - 1 - tlv.position.y) / (blv.position.y - tlv.position.y),
-                        &tmp, varyingCount);
-      blv = tmp;
-   }
-   if ((int)brv.position.y >= (int)height) {
-      InterpolateVertex(&trv, &brv, (height - 1 - trv.position.y) / (brv.position.y - trv.position.y),
-                        &tmp, varyingCount);
-      brv = tmp;
-   }
-
-//   // horizontally clip
-//   if ((int)tlv.position.x < 0) {
-//      InterpolateVertex(&tlv, &trv, (0 - tlv.position.x) / (trv.position.x - tlv.position.x),
-//                        &tmp, varyingCount);
-//      tlv = tmp;
-//   }
-//   if ((int)blv.position.x < 0) {
-//      InterpolateVertex(&blv, &brv, (0 - blv.position.x) / (brv.position.x - blv.position.x),
-//                        &tmp, varyingCount);
-//      blv = tmp;
-//   }
-//   if ((int)trv.position.x >= (int)width) {
-//      InterpolateVertex(&tlv, &trv, (width - 1 - tlv.position.x) / (trv.position.x - tlv.position.x),
-//                        &tmp, varyingCount);
-//      trv = tmp;
-//   }
-//   if ((int)brv.position.x >= (int)width) {
-//      InterpolateVertex(&blv, &brv, (width - 1 - blv.position.x) / (brv.position.x - blv.position.x),
-//                        &tmp, varyingCount);
-//      brv = tmp;
-//   }
+   const VertexOutput & tlv(*tl), & trv(*tr), & blv(*bl), & brv(*br);
 
-   const unsigned int startY = tlv.position.y;
-   const unsigned int endY = blv.position.y;
+   // edges are evaluated at the first row inside rect from the unclipped ones, then stepped;
+   // rects sharing a row have the same top, so the row gets the same edge values in each
+   const int startY = tlv.position.y;
+   const int endY = blv.position.y;
 
    if (endY < startY)
       return;
 
+   const int firstY = MAX2(startY, rect->top), lastY = MIN2(endY, rect->bottom - 1);
+   if (lastY < firstY)
+      return;
+
    const VectorComp_t yDistInv = VectorComp_t_CTR(1.0f / (endY - startY));
 
    // bV and cV are left and right vertices on a horizontal line in quad
@@ -246,73 +188,35 @@ static void RasterTrapezoid(const GGLInterface * iface, const VertexOutput * tl,
    cDx.frontFacingPointCoord *= yDistInv;
    cDx.frontFacingPointCoord.y = VectorComp_t_Zero; // gl_FrontFacing not interpolated
 
-#if USE_DUAL_THREAD
-   GGLContext::Worker & args = ctx->worker;
-   if (!ctx->worker.thread) {
-      pthread_attr_t attr;
-      pthread_attr_init(&attr);
-      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-      int rc = pthread_create(&ctx->worker.thread, &attr, RasterTrapezoidWorker, &args);
-      assert(!rc);
-      // wait for worker to start
-      pthread_cond_wait(&args.finishCond, &args.finishLock);
-   }
-   args.startY = startY + 1;
-   args.endY = endY;
-   if (args.startY <= args.endY) {
-      pthread_mutex_lock(&args.assignLock);
-
-      args.bV = bV;
-      args.cV = cV;
-      for (unsigned i = 0; i < varyingCount; i++) {
-         args.bV.varyings[i] += bDx.varyings[i];
-         bDx.varyings[i] += bDx.varyings[i];
-         args.cV.varyings[i] += cDx.varyings[i];
-         cDx.varyings[i] += cDx.varyings[i];
-      }
-      args.bV.position += bDx.position;
-      bDx.position += bDx.position;
-      args.cV.position += cDx.position;
-      cDx.position += cDx.position;
-      args.bV.frontFacingPointCoord += bDx.frontFacingPointCoord;
-      bDx.frontFacingPointCoord += bDx.frontFacingPointCoord;
-      args.cV.frontFacingPointCoord += cDx.frontFacingPointCoord;
-      cDx.frontFacingPointCoord += cDx.frontFacingPointCoord;
-      args.iface = iface;
-      args.bDx = bDx;
-      args.cDx = cDx;
-      args.varyingCount = varyingCount;
-      args.width = width;
-      args.height = height;
-      args.assignedWork = true;
-
-      pthread_cond_signal(&args.assignCond);
-      pthread_mutex_unlock(&args.assignLock);
+   // vertically clip by advancing to the first row inside rect in one step
+   if (firstY > startY) {
+      AdvanceVertex(&bV, &bDx, VectorComp_t_CTR(firstY - startY), varyingCount);
+      AdvanceVertex(&cV, &cDx, VectorComp_t_CTR(firstY - startY), varyingCount);
    }
-#endif
 
    VertexOutput * left, * right;
    VertexOutput clip0, clip1;
 
-   for (unsigned y = startY; y <= endY; y += 1 + USE_DUAL_THREAD) {
+   for (int y = firstY; y <= lastY; y++) {
+      bV.position.y = cV.position.y = y; // accumulated y drifts, and selects the row in GGLScanLine
       do {
-         if (bV.position.x < 0) {
-            if (cV.position.x < 0)
-               break;
-            InterpolateVertex(&bV, &cV, -bV.position.x / (cV.position.x - bV.position.x),
+         if (bV.position.x >= rect->right || cV.position.x < rect->left)
+            break; // also catches edges crossed by rounding just outside rect
+         if (bV.position.x < rect->left) {
+            InterpolateVertex(&bV, &cV, (rect->left - bV.position.x) / (cV.position.x - bV.position.x),
                               &clip0, varyingCount);
+            clip0.position.x = rect->left;
             left = &clip0;
          } else
             left = &bV;
-         if ((int)cV.position.x >= (int)width) {
-            if (bV.position.x >= (int)width)
-               break;
-            InterpolateVertex(&bV, &cV, (width - 1 - bV.position.x) / (cV.position.x - bV.position.x),
+         if ((int)cV.position.x >= rect->right) {
+            InterpolateVertex(&bV, &cV, (rect->right - 1 - bV.position.x) / (cV.position.x - bV.position.x),
                               &clip1, varyingCount);
+            clip1.position.x = rect->right - 1;
             right = &clip1;
          } else
             right = &cV;
-         iface->ScanLine(iface, left, right);
+         ScanLineEdge(target, activeStencil, left, right, &bDx);
       } while (false);
       for (unsigned i = 0; i < varyingCount; i++) {
          bV.varyings[i] += bDx.varyings[i];
@@ -323,22 +227,196 @@ static void RasterTrapezoid(const GGLInterface * iface, const VertexOutput * tl,
       bV.frontFacingPointCoord += bDx.frontFacingPointCoord;
       cV.frontFacingPointCoord += cDx.frontFacingPointCoord;
    }
+}
 
-#if USE_DUAL_THREAD
-   if (args.assignedWork)
-   {
-      pthread_cond_wait(&args.finishCond, &args.finishLock);
-      args.assignedWork = false;
+#if USE_HALF_SPACE_RASTER
+
+// dx and dy of the plane through a, b and c, which are at positions v1 + (0, 0),
+// v1 + (x21, y21) and v1 + (x31, y31); inv is the reciprocal of the cross product
+static inline void PlaneGradient(const Vector4 * a, const Vector4 * b, const Vector4 * c,
+                                 const VectorComp_t x21, const VectorComp_t y21,
+                                 const VectorComp_t x31, const VectorComp_t y31,
+                                 const VectorComp_t inv, Vector4 * dx, Vector4 * dy)
+{
+   Vector4 e21(*b), e31(*c), t;
+   e21 -= *a;
+   e31 -= *a;
+   //dx = (e21 * y31 - e31 * y21) * inv;
+   (*dx) = e21;
+   (*dx) *= y31;
+   t = e31;
+   t *= y21;
+   (*dx) -= t;
+   (*dx) *= inv;
+   //dy = (e31 * x21 - e21 * x31) * inv;
+   (*dy) = e31;
+   (*dy) *= x21;
+   t = e21;
+   t *= x31;
+   (*dy) -= t;
+   (*dy) *= inv;
+}
+
+static inline void PlaneVector4(const Vector4 * origin, const Vector4 * dx, const Vector4 * dy,
+                                const VectorComp_t x, const VectorComp_t y, Vector4 * d)
+{
+   //d = origin + dx * x + dy * y;
+   Vector4 t(*dy);
+   t *= y;
+   (*d) = (*dx);
+   (*d) *= x;
+   (*d) += t;
+   (*d) += (*origin);
+}
+
+// fragment inputs at x, y pixels from origin, evaluated directly from the plane equations
+static inline void PlaneVertex(const VertexOutput * origin, const VertexOutput * dx,
+                               const VertexOutput * dy, const VectorComp_t x, const VectorComp_t y,
+                               VertexOutput * v, const unsigned varyingCount)
+{
+   PlaneVector4(&origin->position, &dx->position, &dy->position, x, y, &v->position);
+   for (unsigned i = 0; i < varyingCount; i++)
+      PlaneVector4(origin->varyings + i, dx->varyings + i, dy->varyings + i, x, y, v->varyings + i);
+   PlaneVector4(&origin->frontFacingPointCoord, &dx->frontFacingPointCoord,
+                &dy->frontFacingPointCoord, x, y, &v->frontFacingPointCoord);
+}
+
+// e = a * x + b * y + c at subpixel position of a pixel center, covered when e >= 0;
+// c includes -1 for edges that are not top or left, so shared edges are rastered once
+struct HalfSpaceEdge {
+   long long a, b, c;
+};
+
+// vertices are interpolated from plane equations, and spans are found by edge functions
+// on GGL_RASTER_BLOCK_SIZE square blocks that are rejected or accepted as a whole when
+// possible; blocks are aligned to the screen, so they never straddle tiles, and pixels get
+// the same values regardless of which rect they are rastered in
+// returns false without rastering if positions are too large for fixed point edges
+static bool RasterTriangleHalfSpace(const RasterTarget * target, const RasterRect * rect,
+                                    GGLActiveStencil * activeStencil, const VertexOutput * v1,
+                                    const VertexOutput * v2, const VertexOutput * v3)
+{
+   const VertexOutput * v[3] = {v1, v2, v3};
+   const float subPixel = 1 << GGL_SUBPIXEL_BITS;
+   long long x[3], y[3];
+   for (unsigned i = 0; i < 3; i++) {
+      // also false for NaN
+      if (!(fabs(v[i]->position.x) < (1 << 20) && fabs(v[i]->position.y) < (1 << 20)))
+         return false;
+      x[i] = floor(v[i]->position.x * subPixel + 0.5f);
+      y[i] = floor(v[i]->position.y * subPixel + 0.5f);
    }
-#endif
+
+   const long long area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+   if (!area)
+      return true;
+   const long long sign = area > 0 ? 1 : -1;
+
+   HalfSpaceEdge edges[3];
+   for (unsigned i = 0; i < 3; i++) {
+      const unsigned j = (i + 1) % 3;
+      HalfSpaceEdge & edge(edges[i]);
+      edge.a = (y[i] - y[j]) * sign;
+      edge.b = (x[j] - x[i]) * sign;
+      edge.c = -edge.a * x[i] - edge.b * y[i];
+      if (!(edge.a > 0 || (edge.a == 0 && edge.b > 0))) // neither left nor top edge
+         edge.c -= 1;
+   }
+
+   // origin of plane evaluation must not depend on rect
+   const int originX = floor(MIN2(MIN2(v1->position.x, v2->position.x), v3->position.x));
+   const int originY = floor(MIN2(MIN2(v1->position.y, v2->position.y), v3->position.y));
+   const int minX = MAX2(rect->left, originX);
+   const int maxX = MIN2(rect->right - 1, (int)floor(MAX2(MAX2(v1->position.x, v2->position.x),
+                         v3->position.x)));
+   const int minY = MAX2(rect->top, originY);
+   const int maxY = MIN2(rect->bottom - 1, (int)floor(MAX2(MAX2(v1->position.y, v2->position.y),
+                         v3->position.y)));
+   if (maxX < minX || maxY < minY)
+      return true;
+
+   const unsigned varyingCount = target->program->VaryingSlots;
+
+   // fragment inputs at center of pixel originX, originY followed by their step along x and y
+   VertexOutput origin, vertices[3];
+   VertexOutput & dx(vertices[1]), & dy(vertices[2]);
+   const VectorComp_t x21 = v2->position.x - v1->position.x, y21 = v2->position.y - v1->position.y;
+   const VectorComp_t x31 = v3->position.x - v1->position.x, y31 = v3->position.y - v1->position.y;
+   const VectorComp_t inv = VectorComp_t_One / (x21 * y31 - x31 * y21);
+   PlaneGradient(&v1->position, &v2->position, &v3->position, x21, y21, x31, y31, inv,
+                 &dx.position, &dy.position);
+   for (unsigned i = 0; i < varyingCount; i++)
+      PlaneGradient(v1->varyings + i, v2->varyings + i, v3->varyings + i, x21, y21, x31, y31, inv,
+                    dx.varyings + i, dy.varyings + i);
+   PlaneGradient(&v1->frontFacingPointCoord, &v2->frontFacingPointCoord,
+                 &v3->frontFacingPointCoord, x21, y21, x31, y31, inv,
+                 &dx.frontFacingPointCoord, &dy.frontFacingPointCoord); // gl_PointCoord
+   dx.frontFacingPointCoord.y = dy.frontFacingPointCoord.y = 0; // gl_FrontFacing not interpolated
+   PlaneVertex(v1, &dx, &dy, originX + 0.5f - v1->position.x, originY + 0.5f - v1->position.y,
+               &origin, varyingCount);
+   origin.frontFacingPointCoord.y = v1->frontFacingPointCoord.y;
+
+   const int blockMask = GGL_RASTER_BLOCK_SIZE - 1;
+   const long long half = 1 << (GGL_SUBPIXEL_BITS - 1);
+   for (int by = minY & ~blockMask; by <= maxY; by += GGL_RASTER_BLOCK_SIZE)
+      for (int bx = minX & ~blockMask; bx <= maxX; bx += GGL_RASTER_BLOCK_SIZE) {
+         // edges at center of block's first pixel, and their step per pixel
+         long long e[3], ex[3], ey[3];
+         bool accept = true, reject = false;
+         for (unsigned i = 0; i < 3; i++) {
+            ex[i] = edges[i].a * (1 << GGL_SUBPIXEL_BITS);
+            ey[i] = edges[i].b * (1 << GGL_SUBPIXEL_BITS);
+            e[i] = edges[i].a * half + edges[i].b * half + edges[i].c + ex[i] * bx + ey[i] * by;
+            // edge is linear, so its extremes over the block are at corners
+            const long long cx = ex[i] * blockMask, cy = ey[i] * blockMask;
+            if (e[i] + MAX2(cx, 0LL) + MAX2(cy, 0LL) < 0)
+               reject = true;
+            if (e[i] + MIN2(cx, 0LL) + MIN2(cy, 0LL) < 0)
+               accept = false;
+         }
+         if (reject)
+            continue;
+
+         const int startX = MAX2(bx, minX), endX = MIN2(bx + blockMask, maxX);
+         const int startY = MAX2(by, minY), endY = MIN2(by + blockMask, maxY);
+         for (int py = startY; py <= endY; py++) {
+            int spanX = startX, spanEnd = endX;
+            if (!accept) {
+               long long r[3];
+               for (unsigned i = 0; i < 3; i++)
+                  r[i] = e[i] + ex[i] * (startX - bx) + ey[i] * (py - by);
+               // triangle is convex, so covered pixels in a row are contiguous
+               for (; spanX <= endX; spanX++) {
+                  if (r[0] >= 0 && r[1] >= 0 && r[2] >= 0)
+                     break;
+                  r[0] += ex[0], r[1] += ex[1], r[2] += ex[2];
+               }
+               for (spanEnd = spanX; spanEnd < endX; spanEnd++) {
+                  r[0] += ex[0], r[1] += ex[1], r[2] += ex[2];
+                  if (r[0] < 0 || r[1] < 0 || r[2] < 0)
+                     break;
+               }
+            }
+            if (spanX > endX)
+               continue;
+            PlaneVertex(&origin, &dx, &dy, spanX - originX, py - originY, vertices, varyingCount);
+            ScanLineSpan(target, activeStencil, spanX, py, spanEnd - spanX + 1, vertices);
+         }
+      }
+   return true;
 }
 
-static void RasterTriangle(const GGLInterface * iface, const VertexOutput * v1,
-                           const VertexOutput * v2, const VertexOutput * v3)
+#endif // #if USE_HALF_SPACE_RASTER
+
+void RasterTriangleRect(const RasterTarget * target, const RasterRect * rect,
+                        GGLActiveStencil * activeStencil, const VertexOutput * v1,
+                        const VertexOutput * v2, const VertexOutput * v3)
 {
-   GGL_GET_CONST_CONTEXT(ctx, iface);
-   const unsigned varyingCount = ctx->CurrentProgram->VaryingSlots;
-   const unsigned height = ctx->frameSurface.height;
+#if USE_HALF_SPACE_RASTER
+   if (RasterTriangleHalfSpace(target, rect, activeStencil, v1, v2, v3))
+      return;
+#endif
+   const unsigned varyingCount = target->program->VaryingSlots;
    const VertexOutput * a = v1, * b = v2, * d = v3;
    //abc is a triangle, bcd is another triangle, they share bc as horizontal edge
    //c is between a and d, xy is screen coord
@@ -373,14 +451,67 @@ static void RasterTriangle(const GGLInterface * iface, const VertexOutput * v1,
       b = tmp;
    }
 
-   if ((int)a->position.y < (int)height && (int)b->position.y >= 0)
-      RasterTrapezoid(iface, a, a, b, c);
+   if ((int)a->position.y < rect->bottom && (int)b->position.y >= rect->top)
+      RasterTrapezoidRect(target, rect, activeStencil, a, a, b, c);
    //b->position.y += VectorComp_t_One;
    //c->position.y += VectorComp_t_One;
-   if ((int)b->position.y < (int)height && (int)d->position.y >= 0)
-      RasterTrapezoid(iface, b, c, d, d);
+   if ((int)b->position.y < rect->bottom && (int)d->position.y >= rect->top)
+      RasterTrapezoidRect(target, rect, activeStencil, b, c, d, d);
+}
+
+static void GetRasterTarget(const GGLContext * ctx, RasterTarget * target, RasterRect * rect)
+{
+   GetFragmentFunction(&ctx->interface, ctx->CurrentProgram, target);
+   target->colorFormat = ctx->frameSurface.format;
+   target->frame = ctx->frameSurface.data;
+   target->depth = (int *)ctx->depthSurface.data;
+   target->stencil = (unsigned char *)ctx->stencilSurface.data;
+   target->width = ctx->frameSurface.width;
+   target->height = ctx->frameSurface.height;
+   target->constants = ctx->CurrentProgram->ValuesUniform;
+   target->counters = &ctx->counters;
+   rect->left = rect->top = 0;
+   rect->right = ctx->frameSurface.width;
+   rect->bottom = ctx->frameSurface.height;
+}
+
+static void RasterTrapezoid(const GGLInterface * iface, const VertexOutput * tl,
+                            const VertexOutput * tr, const VertexOutput * bl,
+                            const VertexOutput * br)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+#if USE_TILE_THREADS
+   TileRasterFinish(iface); // binned triangles must land first
+#endif
+#if USE_RASTER_COUNTERS
+   StageTimer timer(ctx->counters.rasterTime);
+#endif
+   RasterTarget target;
+   RasterRect rect;
+   GetRasterTarget(ctx, &target, &rect);
+   RasterTrapezoidRect(&target, &rect, &ctx->activeStencil, tl, tr, bl, br);
 }
 
+static void RasterTriangle(const GGLInterface * iface, const VertexOutput * v1,
+                           const VertexOutput * v2, const VertexOutput * v3)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+#if USE_TILE_THREADS
+   TileRasterTriangle(iface, v1, v2, v3);
+#else
+#if USE_RASTER_COUNTERS
+   StageTimer timer(ctx->counters.rasterTime);
+#endif
+   RasterTarget target;
+   RasterRect rect;
+   GetRasterTarget(ctx, &target, &rect);
+   RasterTriangleRect(&target, &rect, &ctx->activeStencil, v1, v2, v3);
+#endif
+}
+
+static void SetupTriangle(const GGLInterface * iface, VertexOutput * v1, VertexOutput * v2,
+                          VertexOutput * v3);
+
 static void DrawTriangle(const GGLInterface * iface, const VertexInput * vin1,
                          const VertexInput * vin2, const VertexInput * vin3)
 {
@@ -459,21 +590,147 @@ static void DrawTriangle(const GGLInterface * iface, const VertexInput * vin1,
 //   GGLProcessVertex(program, vin2, v2, (const float (*)[4])matrix);
 //   GGLProcessVertex(program, vin3, v3, (const float (*)[4])matrix);
 
+   SetupTriangle(iface, v1, v2, v3);
+}
+
+// xyz of clip space planes, position is inside when dot(plane, position) >= 0; w is 1 for
+// near, far and w, and the guard band for the others; clipping x and y to the guard band only
+// keeps positions in range of the rasterizer, which scissors to the viewport anyway
+static const float ClipPlanes[][3] = {
+   {0, 0, 1}, // near
+   {0, 0, -1}, // far
+   {0, 0, 0}, // w >= GGL_CLIP_MIN_W, since near and far both pass w == z == 0
+   {1, 0, 0}, // left
+   {-1, 0, 0}, // right
+   {0, 1, 0}, // bottom
+   {0, -1, 0}, // top
+};
+#define GGL_CLIP_PLANES (sizeof(ClipPlanes) / sizeof(*ClipPlanes))
+
+// guardBand of 1 gives the view frustum
+static inline VectorComp_t ClipDistance(const unsigned plane, const Vector4 & position,
+                                        const VectorComp_t guardBand)
+{
+   const float * p = ClipPlanes[plane];
+   const VectorComp_t w = plane < 3 ? VectorComp_t_One : guardBand;
+   const VectorComp_t distance = p[0] * position.x + p[1] * position.y + p[2] * position.z +
+                                 w * position.w;
+   return 2 == plane ? distance - GGL_CLIP_MIN_W : distance;
+}
+
+// bit i set if position is outside ClipPlanes[i]
+static inline unsigned ClipCode(const Vector4 & position, const VectorComp_t guardBand)
+{
+   unsigned code = 0;
+   for (unsigned i = 0; i < GGL_CLIP_PLANES; i++)
+      if (ClipDistance(i, position, guardBand) < 0)
+         code |= 1 << i;
+   return code;
+}
+
+static void CullAndRasterPolygon(const GGLInterface * iface, VertexOutput ** vertices,
+                                 const unsigned count);
+
+// divides by w and keeps 1/w in w, as in gl_FragCoord; for perspective correction, varyings
+// are also divided, so that they are linear in screen space, and the scanline divides them
+// by interpolated 1/w
+static inline void PerspectiveDivide(const GGLContext * ctx, VertexOutput * v)
+{
+   const VectorComp_t invW = VectorComp_t_One / v->position.w;
+   v->position *= invW;
+   v->position.w = invW;
+   if (ctx->state.bufferState.perspective)
+      for (unsigned i = 0; i < ctx->CurrentProgram->VaryingSlots; i++)
+         v->varyings[i] *= invW;
+}
+
+// clips, divides by w, viewport transforms, culls and rasters vertex processed triangle;
+// modifies position
+static void SetupTriangle(const GGLInterface * iface, VertexOutput * v1, VertexOutput * v2,
+                          VertexOutput * v3)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   ctx->counters.triangles++;
+#if USE_RASTER_COUNTERS
+   StageTimer timer(ctx->counters.setupTime, &ctx->counters.rasterTime);
+#endif
+
 //   LOGD("pf2: DrawTriangle processed %.02f %.02f %.2f %.2f \t %.02f %.02f %.2f %.2f \t %.02f %.02f %.2f %.2f",
 //        v1->position.x, v1->position.y, v1->position.z, v1->position.w,
 //        v2->position.x, v2->position.y, v2->position.z, v2->position.w,
 //        v3->position.x, v3->position.y, v3->position.z, v3->position.w);
 
-   v1->position /= v1->position.w;
-   v2->position /= v2->position.w;
-   v3->position /= v3->position.w;
+   // outside one plane of the view frustum
+   if (ClipCode(v1->position, 1) & ClipCode(v2->position, 1) & ClipCode(v3->position, 1)) {
+      ctx->counters.rejected++;
+      return;
+   }
+
+   const unsigned clipCode = ClipCode(v1->position, GGL_GUARD_BAND) |
+                             ClipCode(v2->position, GGL_GUARD_BAND) |
+                             ClipCode(v3->position, GGL_GUARD_BAND);
+   if (!clipCode) { // common case, inside guard band, so rasterizer scissors
+      VertexOutput * vs[3] = {v1, v2, v3};
+      for (unsigned i = 0; i < 3; i++) {
+         PerspectiveDivide(ctx, vs[i]);
+         iface->ViewportTransform(iface, &vs[i]->position);
+      }
+      CullAndRasterPolygon(iface, vs, 3);
+      return;
+   }
+   ctx->counters.clipped++;
+
+   // Sutherland-Hodgman, each plane adds at most one vertex to the convex polygon
+   const unsigned varyingCount = ctx->CurrentProgram->VaryingSlots;
+   VertexOutput clipped[GGL_CLIP_PLANES * 2];
+   unsigned clippedCount = 0;
+   VertexOutput * polygons[2][3 + GGL_CLIP_PLANES] = {{v1, v2, v3}};
+   VertexOutput ** in = polygons[0], ** out = polygons[1];
+   unsigned inCount = 3;
+   for (unsigned p = 0; p < GGL_CLIP_PLANES && inCount >= 3; p++) {
+      if (!(clipCode & (1 << p)))
+         continue;
+      unsigned outCount = 0;
+      for (unsigned i = 0; i < inCount; i++) {
+         VertexOutput * a = in[i], * b = in[(i + 1) % inCount];
+         const VectorComp_t da = ClipDistance(p, a->position, GGL_GUARD_BAND);
+         const VectorComp_t db = ClipDistance(p, b->position, GGL_GUARD_BAND);
+         if (da >= 0)
+            out[outCount++] = a;
+         if ((da >= 0) == (db >= 0))
+            continue;
+         // always interpolate from the inside vertex, so edges shared by triangles clip alike
+         VertexOutput * v = clipped + clippedCount++;
+         if (da >= 0)
+            InterpolateVertex(a, b, da / (da - db), v, varyingCount);
+         else
+            InterpolateVertex(b, a, db / (db - da), v, varyingCount);
+         out[outCount++] = v;
+      }
+      VertexOutput ** t = in;
+      in = out;
+      out = t;
+      inCount = outCount;
+   }
+   if (inCount < 3) {
+      ctx->counters.rejected++;
+      return;
+   }
 
-//   LOGD("pf2: DrawTriangle divided %.02f,%.02f \t %.02f,%.02f \t %.02f,%.02f", v1->position.x, v1->position.y,
-//      v2->position.x, v2->position.y, v3->position.x, v3->position.y);
+   for (unsigned i = 0; i < inCount; i++) {
+      PerspectiveDivide(ctx, in[i]);
+      iface->ViewportTransform(iface, &in[i]->position);
+   }
+   CullAndRasterPolygon(iface, in, inCount);
+}
 
-   iface->ViewportTransform(iface, &v1->position);
-   iface->ViewportTransform(iface, &v2->position);
-   iface->ViewportTransform(iface, &v3->position);
+// culls convex polygon after viewport transform, then rasters it as a triangle fan;
+// sets gl_FrontFacing
+static void CullAndRasterPolygon(const GGLInterface * iface, VertexOutput ** vertices,
+                                 const unsigned count)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   const Vector4 & p0 = vertices[0]->position;
 
 //   if (strstr(program->Shaders[MESA_SHADER_FRAGMENT]->Source,
 //              "gl_FragColor = color * texture2D(sampler, outTexCoords).a;")) {
@@ -495,72 +752,176 @@ static void DrawTriangle(const GGLInterface * iface, const VertexInput * vin1,
 //        v2->varyings[0].x, v2->varyings[0].y, v2->varyings[0].z, v2->varyings[0].w,
 //        v3->varyings[0].x, v3->varyings[0].y, v3->varyings[0].z, v3->varyings[0].w);
 
-   VectorComp_t area;
-   area = v1->position.x * v2->position.y - v2->position.x * v1->position.y;
-   area += v2->position.x * v3->position.y - v3->position.x * v2->position.y;
-   area += v3->position.x * v1->position.y - v1->position.x * v3->position.y;
+   // relative to first vertex, so that degenerate triangles come out exactly 0
+   VectorComp_t area = VectorComp_t_Zero;
+   for (unsigned i = 1; i + 1 < count; i++) {
+      const Vector4 & a = vertices[i]->position, & b = vertices[i + 1]->position;
+      area += (a.x - p0.x) * (b.y - p0.y) - (b.x - p0.x) * (a.y - p0.y);
+   }
    area *= 0.5f;
 
+   if (area == VectorComp_t_Zero || area != area) { // no pixels, or NaN
+      ctx->counters.rejected++;
+      return;
+   }
+
+   // window y is flipped, so counter clockwise is -ve
    if (GL_CCW == ctx->cullState.frontFace + GL_CW)
       (unsigned &)area ^= 0x80000000;
 
-   if (false && ctx->cullState.enable) { // TODO: turn off for now
-      switch (ctx->cullState.cullFace + GL_FRONT) {
+   if (ctx->cullState.enable) {
+      static const GLenum cullFaces[] = {GL_FRONT, GL_BACK, GL_FRONT_AND_BACK, GL_FRONT_AND_BACK};
+      bool cull = false;
+      switch (cullFaces[ctx->cullState.cullFace]) {
       case GL_FRONT:
-         if (!((unsigned &)area & 0x80000000)) // +ve, front facing
-            return;
+         cull = !((unsigned &)area & 0x80000000); // +ve, front facing
          break;
       case GL_BACK:
-         if ((unsigned &)area & 0x80000000) // -ve, back facing
-            return;
+         cull = (unsigned &)area & 0x80000000; // -ve, back facing
          break;
       case GL_FRONT_AND_BACK:
-         return;
+         cull = true;
+         break;
       default:
          assert(0);
       }
+      if (cull) {
+         ctx->counters.culled++;
+         return;
+      }
    }
 
-   v1->frontFacingPointCoord.y = v2->frontFacingPointCoord.y =
-                                    v3->frontFacingPointCoord.y = !((unsigned &)area & 0x80000000) ?
-                                                                  VectorComp_t_One : VectorComp_t_Zero;
+   const VectorComp_t frontFacing = !((unsigned &)area & 0x80000000) ?
+                                    VectorComp_t_One : VectorComp_t_Zero;
+   for (unsigned i = 0; i < count; i++)
+      vertices[i]->frontFacingPointCoord.y = frontFacing;
 
    iface->StencilSelect(iface, ((unsigned &)area & 0x80000000) ? GL_BACK : GL_FRONT);
 
-//    if (0)
-//    {
-//        GGLContext * ctx =(GGLContext *)iface;
-//        for (unsigned sampler = 0; sampler < GGL_MAXCOMBINEDTEXTUREIMAGEUNITS; sampler++)
-//        {
-//            if (!((1 << sampler) & ctx->glCtx->Shader.CurrentProgram->FragmentProgram->SamplersUsed))
-//                continue;
-//            const GGLTexture * texture = ctx->textureState.textures + sampler;
-//            int level = texture->width * texture->height / (area * 2) - 4;
-//            assert(texture->levels);
-//            ctx->textureState.textureData[sampler] = texture->levels[0];
-//            ctx->textureState.textureDimensions[sampler * 2] = texture->width;
-//            ctx->textureState.textureDimensions[sampler * 2 + 1] = texture->height;
-//            for (unsigned i = 1; i < texture->levelCount && i <= level; i++)
-//            {
-//                ctx->textureState.textureData[sampler] = texture->levels[i];
-//                ctx->textureState.textureDimensions[sampler * 2] += 1;
-//                ctx->textureState.textureDimensions[sampler * 2] /= 2;
-//                ctx->textureState.textureDimensions[sampler * 2 + 1] += 1;
-//                ctx->textureState.textureDimensions[sampler * 2 + 1] /= 2;
-//            }
-//        }
-//    }
-
-   // TODO DXL view frustum clipping
-   iface->RasterTriangle(iface, v1, v2, v3);
+   for (unsigned i = 1; i + 1 < count; i++)
+      iface->RasterTriangle(iface, vertices[0], vertices[i], vertices[i + 1]);
 
 //   LOGD("pf2: DrawTriangle end");
 
 }
 
+// post-transform vertex cache; FIFO replacement like hardware caches, so meshes
+// optimized for those (e.g. by tootle or Forsyth's algorithm) hit well
+#define GGL_VERTEX_CACHE_SIZE 32
+
+struct VertexCache {
+   VertexOutput outputs[GGL_VERTEX_CACHE_SIZE];
+   unsigned indices[GGL_VERTEX_CACHE_SIZE];
+   unsigned next; // entry to replace
+};
+
+// returns processed vertex, position is before w divide
+static const VertexOutput * CacheProcessVertex(const GGLInterface * iface, VertexCache * cache,
+                                               const VertexInput * vertices, const unsigned index)
+{
+   for (unsigned i = 0; i < GGL_VERTEX_CACHE_SIZE; i++)
+      if (cache->indices[i] == index)
+         return cache->outputs + i;
+   VertexOutput * output = cache->outputs + cache->next;
+   cache->indices[cache->next] = index;
+   cache->next = (cache->next + 1) % GGL_VERTEX_CACHE_SIZE;
+   memset(output, 0, sizeof(*output));
+   iface->ProcessVertex(iface, vertices + index, output);
+   return output;
+}
+
+static inline void TriangleIndices(const GLenum mode, const unsigned * indices, const unsigned i,
+                                   unsigned * i0, unsigned * i1, unsigned * i2)
+{
+   if (GL_TRIANGLES == mode) {
+      *i0 = indices[i * 3];
+      *i1 = indices[i * 3 + 1];
+      *i2 = indices[i * 3 + 2];
+   } else if (GL_TRIANGLE_STRIP == mode) { // odd triangles swap first 2 to keep winding
+      *i0 = indices[i + (i & 1)];
+      *i1 = indices[i + !(i & 1)];
+      *i2 = indices[i + 2];
+   } else {
+      *i0 = indices[0];
+      *i1 = indices[i + 1];
+      *i2 = indices[i + 2];
+   }
+}
+
+static void DrawElements(const GGLInterface * iface, GLenum mode, GLsizei count,
+                         const unsigned * indices, const VertexInput * vertices)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   if (GL_TRIANGLES != mode && GL_TRIANGLE_STRIP != mode && GL_TRIANGLE_FAN != mode)
+      return gglError(GL_INVALID_ENUM);
+   if (count < 0)
+      return gglError(GL_INVALID_VALUE);
+   if (!ctx->CurrentProgram || count < 3)
+      return;
+
+   unsigned minIndex = indices[0], maxIndex = indices[0];
+   for (GLsizei i = 1; i < count; i++) {
+      minIndex = MIN2(minIndex, indices[i]);
+      maxIndex = MAX2(maxIndex, indices[i]);
+   }
+   const unsigned range = maxIndex - minIndex + 1;
+
+   VertexOutput vouts[3]; // SetupTriangle modifies position, so processed vertices are copied
+   const unsigned triangleCount = GL_TRIANGLES == mode ? count / 3 : count - 2;
+   unsigned i0, i1, i2;
+
+   VertexCache cache;
+   memset(cache.indices, 0xff, sizeof(cache.indices));
+   cache.next = 0;
+
+#if USE_BLIT_FAST_PATH
+   // the corners are shaded once, for DrawBlit or else for drawing the triangles
+   if (2 == triangleCount && BlitEligible(iface)) {
+      unsigned triangles[2][3];
+      VertexOutput shaded[2][3];
+      for (unsigned i = 0; i < 2; i++) {
+         TriangleIndices(mode, indices, i, triangles[i] + 0, triangles[i] + 1, triangles[i] + 2);
+         for (unsigned j = 0; j < 3; j++)
+            shaded[i][j] = *CacheProcessVertex(iface, &cache, vertices, triangles[i][j]);
+      }
+      if (!DrawBlit(iface, triangles, shaded))
+         for (unsigned i = 0; i < 2; i++)
+            SetupTriangle(iface, shaded[i] + 0, shaded[i] + 1, shaded[i] + 2);
+      return;
+   }
+#endif
+
+   // when most vertices in range are used, process all of them with the batch function
+   if (range <= (unsigned)count && range <= GGL_VERTEX_BATCH_MAX) {
+      VertexOutput * outputs = (VertexOutput *)memalign(16, range * sizeof(*outputs));
+      if (!outputs)
+         return gglError(GL_OUT_OF_MEMORY);
+      memset(outputs, 0, range * sizeof(*outputs));
+      iface->ProcessVertices(iface, vertices + minIndex, outputs, range);
+      for (unsigned i = 0; i < triangleCount; i++) {
+         TriangleIndices(mode, indices, i, &i0, &i1, &i2);
+         vouts[0] = outputs[i0 - minIndex];
+         vouts[1] = outputs[i1 - minIndex];
+         vouts[2] = outputs[i2 - minIndex];
+         SetupTriangle(iface, vouts + 0, vouts + 1, vouts + 2);
+      }
+      free(outputs);
+      return;
+   }
+
+   for (unsigned i = 0; i < triangleCount; i++) {
+      TriangleIndices(mode, indices, i, &i0, &i1, &i2);
+      vouts[0] = *CacheProcessVertex(iface, &cache, vertices, i0);
+      vouts[1] = *CacheProcessVertex(iface, &cache, vertices, i1);
+      vouts[2] = *CacheProcessVertex(iface, &cache, vertices, i2);
+      SetupTriangle(iface, vouts + 0, vouts + 1, vouts + 2);
+   }
+}
+
 static void PickRaster(GGLInterface * iface)
 {
    iface->ProcessVertex = ProcessVertex;
+   iface->ProcessVertices = ProcessVertices;
    iface->DrawTriangle = DrawTriangle;
    iface->RasterTriangle = RasterTriangle;
    iface->RasterTrapezoid = RasterTrapezoid;
@@ -576,9 +937,23 @@ static void ViewportTransform(const GGLInterface * iface, Vector4 * v)
 }
 
 
+static void GetCounters(GGLInterface * iface, GGLCounters * counters, GLboolean reset)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+#if USE_RASTER_COUNTERS && USE_TILE_THREADS
+   TileRasterFinish(iface);
+   TileRasterCounters(iface, &ctx->counters);
+#endif
+   *counters = ctx->counters;
+   if (reset)
+      memset(&ctx->counters, 0, sizeof(ctx->counters));
+}
+
 void InitializeRasterFunctions(GGLInterface * iface)
 {
    GGL_GET_CONTEXT(ctx, iface);
    ctx->PickRaster = PickRaster;
    iface->ViewportTransform = ViewportTransform;
+   iface->DrawElements = DrawElements;
+   iface->GetCounters = GetCounters;
 }
@@ -183,10 +183,311 @@ typedef void (* ScanLineFunction_t)(VertexOutput * start, VertexOutput * step,
                                     GGLActiveStencil *, unsigned count);
 #endif
 
-void GGLScanLine(const gl_shader_program * program, const GGLPixelFormat colorFormat,
-                 void * frameBuffer, int * depthBuffer, unsigned char * stencilBuffer,
-                 unsigned bufferWidth, unsigned bufferHeight, GGLActiveStencil * activeStencil,
-                 const VertexOutput_t * start, const VertexOutput_t * end, const float (*constants)[4])
+static bool GenericCompare(const unsigned func, const int lhs, const int rhs)
+{
+   switch (0x200 | func) {
+   case GL_NEVER:
+      return false;
+   case GL_LESS:
+      return lhs < rhs;
+   case GL_EQUAL:
+      return lhs == rhs;
+   case GL_LEQUAL:
+      return lhs <= rhs;
+   case GL_GREATER:
+      return lhs > rhs;
+   case GL_NOTEQUAL:
+      return lhs != rhs;
+   case GL_GEQUAL:
+      return lhs >= rhs;
+   case GL_ALWAYS:
+      return true;
+   default:
+      assert(0);
+      return true;
+   }
+}
+
+static unsigned char GenericStencilOp(const unsigned op, const unsigned char s,
+                                      const unsigned char ref)
+{
+   switch (op) {
+   case 0: // GL_ZERO
+      return 0;
+   case 1: // GL_KEEP
+      return s;
+   case 2: // GL_REPLACE
+      return ref;
+   case 3: // GL_INCR
+      return s < 255 ? s + 1 : s;
+   case 4: // GL_DECR
+      return s > 0 ? s - 1 : s;
+   case 5: // GL_INVERT
+      return ~s;
+   case 6: // GL_INCR_WRAP
+      return s + 1;
+   case 7: // GL_DECR_WRAP
+      return s - 1;
+   default:
+      assert(0);
+      return s;
+   }
+}
+
+// factor for channel c of [0,255] colors, alpha is channel 3
+static int GenericBlendFactor(const unsigned mode, const unsigned c, const int * src,
+                              const int * dst, const unsigned char * constant)
+{
+   switch (mode) {
+   case GGLBlendState::GGL_ZERO:
+      return 0;
+   case GGLBlendState::GGL_ONE:
+      return 255;
+   case GGLBlendState::GGL_SRC_COLOR:
+      return src[c];
+   case GGLBlendState::GGL_ONE_MINUS_SRC_COLOR:
+      return 255 - src[c];
+   case GGLBlendState::GGL_DST_COLOR:
+      return dst[c];
+   case GGLBlendState::GGL_ONE_MINUS_DST_COLOR:
+      return 255 - dst[c];
+   case GGLBlendState::GGL_SRC_ALPHA:
+      return src[3];
+   case GGLBlendState::GGL_ONE_MINUS_SRC_ALPHA:
+      return 255 - src[3];
+   case GGLBlendState::GGL_DST_ALPHA:
+      return dst[3];
+   case GGLBlendState::GGL_ONE_MINUS_DST_ALPHA:
+      return 255 - dst[3];
+   case GGLBlendState::GGL_SRC_ALPHA_SATURATE:
+      return 3 == c ? 255 : MIN2(src[3], 255 - dst[3]);
+   case GGLBlendState::GGL_CONSTANT_COLOR:
+      return constant[c];
+   case GGLBlendState::GGL_ONE_MINUS_CONSTANT_COLOR:
+      return 255 - constant[c];
+   case GGLBlendState::GGL_CONSTANT_ALPHA:
+      return constant[3];
+   case GGLBlendState::GGL_ONE_MINUS_CONSTANT_ALPHA:
+      return 255 - constant[3];
+   default:
+      assert(0);
+      return 0;
+   }
+}
+
+// same arithmetic as GenerateFSBlend; dst is the frame buffer pixel, returns the new one
+static unsigned GenericBlend(const GGLBlendState & blend, const GGLPixelFormat format,
+                             const Vector4 & color, const unsigned dst)
+{
+   int s[4], d[4] = {0, 0, 0, 0}, r[4];
+   for (unsigned c = 0; c < 4; c++)
+      s[c] = color.f[c] * 255;
+   if (!blend.enable)
+      memcpy(r, s, sizeof(r));
+   else {
+      ColorFormatToRGBA(format, dst, d);
+      for (unsigned c = 0; c < 4; c++) {
+         int sf = GenericBlendFactor(3 == c ? blend.saf : blend.scf, c, s, d, blend.color);
+         int df = GenericBlendFactor(3 == c ? blend.daf : blend.dcf, c, s, d, blend.color);
+         sf += sf >> 7; // factor *= 256 / 255
+         df += df >> 7;
+         const int sc = s[c] * sf, dc = d[c] * df;
+         switch ((3 == c ? blend.ae : blend.ce) + GL_FUNC_ADD) {
+         case GL_FUNC_ADD:
+            r[c] = sc + dc;
+            break;
+         case GL_FUNC_SUBTRACT:
+            r[c] = sc - dc;
+            break;
+         case GL_FUNC_REVERSE_SUBTRACT:
+            r[c] = dc - sc;
+            break;
+         default:
+            assert(0);
+            r[c] = sc;
+            break;
+         }
+         r[c] >>= 8;
+      }
+   }
+   for (unsigned c = 0; c < 4; c++)
+      r[c] = MIN2(MAX2(r[c], 0), 255);
+   return RGBAToColorFormat(format, r);
+}
+
+// per pixel fallback while the scanline specialized for target->generic state is compiled,
+// see GGLShaderUse; target->function is the fragment shader main, and the stencil, depth and
+// blend state is read here instead of generated into code
+static void GenericScanLine(const RasterTarget * target, const GGLActiveStencil * activeStencil,
+                            void * frameBuffer, int * depth, unsigned char * stencil,
+                            VertexOutput vertices[3], unsigned count)
+{
+   const GGLState * state = target->generic;
+   const gl_shader_program * program = target->program;
+   const ShaderFunction_t function = (ShaderFunction_t)target->function;
+   const GGLStencilState & stencilState = activeStencil->face ? state->backStencil :
+                                          state->frontStencil;
+   const unsigned char sRef = activeStencil->ref, sMask = activeStencil->mask;
+   const bool perspective = state->bufferState.perspective;
+   const unsigned blocks = UsesInputSteps(program, state) ? 3 : 1;
+   VertexOutput & vertex(vertices[0]);
+   const VertexOutput & step(vertices[1]);
+   VertexOutput corrected[3];
+#if USE_RASTER_COUNTERS
+   GGLCounters * counters = target->counters;
+#endif
+
+   for (unsigned i = 0; i < count; i++) {
+      unsigned char s = 0;
+      bool sCmp = true;
+      if (state->bufferState.stencilTest) {
+         s = stencil[i] & sMask;
+         sCmp = GenericCompare(stencilState.func, sRef, s);
+      }
+      int z = vertex.position.i[2];
+      if (z < 0) // smaller -ve float means bigger -ve int
+         z ^= 0x7fffffff;
+      bool zCmp = true;
+      if (sCmp && state->bufferState.depthTest)
+         zCmp = GenericCompare(state->bufferState.depthFunc, z, depth[i]);
+
+      if (sCmp && zCmp) {
+         const VertexOutput * inputs = vertices;
+         if (perspective) { // as CorrectPerspective in llvm_scanline.cpp
+            float w[3];
+            for (unsigned b = 0; b < blocks; b++) {
+               corrected[b].position = vertices[b].position;
+               corrected[b].frontFacingPointCoord = vertices[b].frontFacingPointCoord;
+               w[b] = 1 / (b ? vertex.position.w + vertices[b].position.w : vertex.position.w);
+            }
+            for (unsigned j = 0; j < program->VaryingSlots; j++) {
+               corrected[0].varyings[j] = vertex.varyings[j];
+               corrected[0].varyings[j] *= w[0];
+               for (unsigned b = 1; b < blocks; b++) {
+                  corrected[b].varyings[j] = vertex.varyings[j];
+                  corrected[b].varyings[j] += vertices[b].varyings[j];
+                  corrected[b].varyings[j] *= w[b];
+                  corrected[b].varyings[j] -= corrected[0].varyings[j];
+               }
+            }
+            inputs = corrected;
+         }
+         function(inputs, &vertex, target->constants);
+
+         if (2 == ColorFormatSize(target->colorFormat)) {
+            unsigned short * frame = (unsigned short *)frameBuffer + i;
+            *frame = GenericBlend(state->blendState, target->colorFormat, vertex.fragColor[0], *frame);
+         } else {
+            unsigned * frame = (unsigned *)frameBuffer + i;
+            *frame = GenericBlend(state->blendState, target->colorFormat, vertex.fragColor[0], *frame);
+         }
+         if (state->bufferState.depthTest)
+            depth[i] = z;
+         if (state->bufferState.stencilTest)
+            stencil[i] = GenericStencilOp(stencilState.dPass, s, sRef);
+#if USE_RASTER_COUNTERS
+         if (counters) {
+            counters->shaded++;
+            counters->blended += state->blendState.enable;
+         }
+#endif
+      } else {
+         if (state->bufferState.stencilTest)
+            stencil[i] = GenericStencilOp(sCmp ? stencilState.dFail : stencilState.sFail, s, sRef);
+#if USE_RASTER_COUNTERS
+         if (counters && sCmp)
+            counters->depthRejects++;
+         else if (counters)
+            counters->stencilRejects++;
+#endif
+      }
+
+      // as StepInputs in llvm_scanline.cpp
+      if (program->UsesFragCoord || perspective)
+         vertex.position += step.position;
+      else
+         vertex.position.z += step.position.z;
+      if (program->UsesPointCoord)
+         vertex.frontFacingPointCoord += step.frontFacingPointCoord;
+      for (unsigned j = 0; j < program->VaryingSlots; j++)
+         vertex.varyings[j] += step.varyings[j];
+   }
+}
+
+void GetFragmentFunction(const GGLInterface * iface, gl_shader_program * program,
+                         RasterTarget * target)
+{
+#if USE_ASYNC_JIT
+   ShaderJitPoll(iface, program);
+#endif
+   const gl_shader * shader = program->_LinkedShaders[MESA_SHADER_FRAGMENT];
+   target->program = program;
+   target->function = shader->function;
+   target->generic = shader->GenericState;
+}
+
+bool UsesInputSteps(const gl_shader_program * program, const GGLState * state)
+{
+   if (program->UsesDerivatives)
+      return true;
+   if (!program->UsesTextureLod)
+      return false;
+   for (unsigned i = 0; i < GGL_MAXCOMBINEDTEXTUREIMAGEUNITS; i++)
+      if (tex2DLod(state, i))
+         return true;
+   return false;
+}
+
+void ScanLineSpan(const RasterTarget * target, GGLActiveStencil * activeStencil,
+                  unsigned x, unsigned y, unsigned count, VertexOutput_t vertices[3])
+{
+#if !USE_LLVM_SCANLINE
+   assert(!"only for USE_LLVM_SCANLINE");
+#endif
+
+   char * frame = (char *)target->frame;
+   assert(ColorFormatSize(target->colorFormat));
+   frame += (y * target->width + x) * ColorFormatSize(target->colorFormat);
+
+   int * depth = target->depth + y * target->width + x;
+   unsigned char * stencil = target->stencil + y * target->width + x;
+
+   if (!count)
+      return;
+#if USE_RASTER_COUNTERS
+   GGLCounters * counters = target->counters; // NULL from GGLScanLine
+   if (counters) {
+      counters->scanlines++;
+      counters->pixels += count;
+   }
+#endif
+   if (target->generic) {
+      GenericScanLine(target, activeStencil, frame, depth, stencil, vertices, count);
+      return;
+   }
+
+   // TODO DXL consider inverting gl_FragCoord.y
+   ScanLineFunction_t scanLineFunction = (ScanLineFunction_t)target->function;
+//   LOGD("pf2 GGLScanLine scanline=%p start=%p constants=%p", scanLineFunction, &vertex, constants);
+#if USE_RASTER_COUNTERS
+   int * counts = vertices[0].pointSize.i; // GGLScanLineCount, added to by the scan line
+   memset(counts, 0, sizeof(vertices[0].pointSize));
+#endif
+   scanLineFunction(vertices, vertices + 1, target->constants, frame, depth, stencil,
+                    activeStencil, count);
+#if USE_RASTER_COUNTERS
+   if (counters) {
+      counters->shaded += counts[GGL_COUNT_SHADED];
+      counters->blended += counts[GGL_COUNT_BLENDED];
+      counters->stencilRejects += counts[GGL_COUNT_STENCIL_REJECTS];
+      counters->depthRejects += count - counts[GGL_COUNT_SHADED] - counts[GGL_COUNT_STENCIL_REJECTS];
+   }
+#endif
+}
+
+void ScanLineEdge(const RasterTarget * target, GGLActiveStencil * activeStencil,
+                  const VertexOutput_t * start, const VertexOutput_t * end,
+                  const VertexOutput_t * edgeStep)
 {
 #if !USE_LLVM_SCANLINE
    assert(!"only for USE_LLVM_SCANLINE");
@@ -195,27 +496,24 @@ void GGLScanLine(const gl_shader_program * program, const GGLPixelFormat colorFo
 //   LOGD("pf2: GGLScanLine program=%p format=0x%.2X frameBuffer=%p depthBuffer=%p stencilBuffer=%p ",
 //      program, colorFormat, frameBuffer, depthBuffer, stencilBuffer);
 
+   const gl_shader_program * program = target->program;
    const unsigned int varyingCount = program->VaryingSlots;
    const unsigned y = start->position.y, startX = start->position.x,
                       endX = end->position.x;
 
-   assert(bufferWidth > startX && bufferWidth > endX);
-   assert(bufferHeight > y);
+   assert(target->width > startX && target->width > endX);
+   assert(target->height > y);
 
-   char * frame = (char *)frameBuffer;
-   if (GGL_PIXEL_FORMAT_RGBA_8888 == colorFormat)
-      frame += (y * bufferWidth + startX) * 4;
-   else if (GGL_PIXEL_FORMAT_RGB_565 == colorFormat)
-      frame += (y * bufferWidth + startX) * 2;
-   else 
-      assert(0);
    const VectorComp_t div = VectorComp_t_CTR(1 / (float)(endX - startX));
 
    //memcpy(ctx->glCtx->CurrentProgram->ValuesVertexOutput, start, sizeof(*start));
    // shader symbols are mapped to gl_shader_program_Values*
    //VertexOutput & vertex(*(VertexOutput*)ctx->glCtx->CurrentProgram->ValuesVertexOutput);
-   VertexOutput vertex(*start);
-   VertexOutput vertexDx(*end);
+   // fragment shader inputs are followed by their x step and y step, used for dFdx and dFdy
+   VertexOutput vertices[3];
+   VertexOutput & vertex(vertices[0]), & vertexDx(vertices[1]), & vertexDy(vertices[2]);
+   vertex = *start;
+   vertexDx = *end;
 
    vertexDx.position -= start->position;
    vertexDx.position *= div;
@@ -228,24 +526,65 @@ void GGLScanLine(const gl_shader_program * program, const GGLPixelFormat colorFo
    vertexDx.frontFacingPointCoord *= div; // gl_PointCoord, only zw
    vertexDx.frontFacingPointCoord.y = 0; // gl_FrontFacing not interpolated
 
-   int * depth = depthBuffer + y * bufferWidth + startX;
-   unsigned char * stencil = stencilBuffer + y * bufferWidth + startX;
+   if (program->UsesDerivatives || program->UsesTextureLod) { // cheaper than UsesInputSteps
+      // y step at fixed x is the edge step, less x step times the edge moving along x
+      VertexOutput vertical;
+      if (!edgeStep) { // no edge, assume vertical
+         memset(&vertical, 0, sizeof(vertical));
+         vertical.position.y = VectorComp_t_One;
+         edgeStep = &vertical;
+      }
+      const VectorComp_t edgeX = edgeStep->position.x;
+      Vector4 t;
+      vertexDy.position = edgeStep->position;
+      t = vertexDx.position;
+      t *= edgeX;
+      vertexDy.position -= t;
+      for (unsigned i = 0; i < varyingCount; i++) {
+         vertexDy.varyings[i] = edgeStep->varyings[i];
+         t = vertexDx.varyings[i];
+         t *= edgeX;
+         vertexDy.varyings[i] -= t;
+      }
+      vertexDy.frontFacingPointCoord = edgeStep->frontFacingPointCoord;
+      t = vertexDx.frontFacingPointCoord;
+      t *= edgeX;
+      vertexDy.frontFacingPointCoord -= t;
+      vertexDy.frontFacingPointCoord.y = 0; // gl_FrontFacing not interpolated
+   }
 
-   // TODO DXL consider inverting gl_FragCoord.y
-   ScanLineFunction_t scanLineFunction = (ScanLineFunction_t)
-                                         program->_LinkedShaders[MESA_SHADER_FRAGMENT]->function;
-//   LOGD("pf2 GGLScanLine scanline=%p start=%p constants=%p", scanLineFunction, &vertex, constants);
    if (endX >= startX)
-      scanLineFunction(&vertex, &vertexDx, constants, frame, depth, stencil, activeStencil, endX - startX + 1);
+      ScanLineSpan(target, activeStencil, startX, y, endX - startX + 1, vertices);
 
 //   LOGD("pf2: GGLScanLine end");
 
 }
 
+void GGLScanLine(const gl_shader_program * program, const GGLPixelFormat colorFormat,
+                 void * frameBuffer, int * depthBuffer, unsigned char * stencilBuffer,
+                 unsigned bufferWidth, unsigned bufferHeight, GGLActiveStencil * activeStencil,
+                 const VertexOutput_t * start, const VertexOutput_t * end, const float (*constants)[4])
+{
+   RasterTarget target;
+   GetFragmentFunction(NULL, const_cast<gl_shader_program *>(program), &target);
+   target.colorFormat = colorFormat;
+   target.frame = frameBuffer;
+   target.depth = depthBuffer;
+   target.stencil = stencilBuffer;
+   target.width = bufferWidth;
+   target.height = bufferHeight;
+   target.constants = constants;
+   target.counters = NULL;
+   ScanLineEdge(&target, activeStencil, start, end, NULL);
+}
+
 template <bool StencilTest, bool DepthTest, bool DepthWrite, bool BlendEnable>
 void ScanLine(const GGLInterface * iface, const VertexOutput * start, const VertexOutput * end)
 {
    GGL_GET_CONST_CONTEXT(ctx, iface);
+#if USE_TILE_THREADS
+   TileRasterFinish(iface);
+#endif
    GGLScanLine(ctx->CurrentProgram, ctx->frameSurface.format, ctx->frameSurface.data,
                (int *)ctx->depthSurface.data, (unsigned char *)ctx->stencilSurface.data,
                ctx->frameSurface.width, ctx->frameSurface.height, &ctx->activeStencil,
@@ -22,8 +22,21 @@
 
 #include <llvm/LLVMContext.h>
 #include <llvm/Module.h>
+#include <llvm/Function.h>
+#include <llvm/Constants.h>
+#include <llvm/DerivedTypes.h>
+#include <llvm/GlobalVariable.h>
+#include <llvm/PassManager.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Threading.h>
 #include <bcc/bcc.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
 
 
 #include "src/talloc/hieralloc.h"
@@ -100,29 +113,402 @@ struct ShaderKey {
       GGLBlendState blendState;
    } scanLineKey;
    GGLPixelFormat textureFormats[GGL_MAXCOMBINEDTEXTUREIMAGEUNITS];
-   unsigned char textureParameters[GGL_MAXCOMBINEDTEXTUREIMAGEUNITS]; // wrap and filter
+   unsigned short textureParameters[GGL_MAXCOMBINEDTEXTUREIMAGEUNITS]; // wrap, filter and layout
    bool operator <(const ShaderKey & rhs) const {
       return memcmp(this, &rhs, sizeof(*this)) < 0;
    }
 };
 
+struct Executable;
+
 struct Instance {
+   ShaderKey key;
+   unsigned hash; // of key, see GetShaderKey
+   Instance * hashNext; // in Executable::instances bucket
+   Instance * lruPrev, * lruNext; // in instanceCache, most recently used first
+   Executable * executable; // owner; NULL for generic instances
+   unsigned users; // shaders binding it as instance or pending, see BindInstance
+   unsigned size; // estimated bytes of code and LLVM data, see CodeGen
+   unsigned counted; // of size, in instanceCache.bytes; see InstanceCacheCount
+
    llvm::Module * module;
    struct BCCOpaqueScript * script;
    void (* function)();
+   void (* batchFunction)(); // vertex shader only, see GenerateVertexBatch
+   // module kept for JitThread: generic fragment main, or scanline to tier up; malloc
+   char * bitcode;
+   unsigned bitcodeSize;
+   GGLState state; // of asynchronously compiled instance, read by GenericScanLine meanwhile
+   volatile int ready; // function is set, last by JitThread
+   unsigned level; // LLVM optimization level compiled at, see OptimizeModule
+   unsigned uniformSerial; // gl_shader_program::UniformSerial of values folded, see JitSpecialize
+   unsigned draws; // raster batches while bound at a level below jitTiers.hotLevel
+   const GGLState * symbols; // texture symbols were resolved against, see SymbolLookup
+   // recompiling at jitTiers.hotLevel until ready, then holding the replaced code, since
+   // raster threads and shaders sharing the instance may still call it; see ShaderJitPoll;
+   // for a specialized instance, the one of the shader it replaced, until retired is stale
+   Instance * tier;
+   unsigned retired; // RasterFinishes of retiredBy when a specialized instance replaced tier
+   const GGLInterface * retiredBy; // context whose raster threads may still call tier
    ~Instance() {
       // TODO: check bccDisposeScript, which seems to dispose llvm::Module
       if (script)
          bccDisposeScript(script);
       else if (module)
          delete module;
+      free(bitcode);
+      if (tier) {
+         tier->~Instance();
+         hieralloc_free(tier);
+      }
    }
 };
 
+// shared by linked shaders of the same type from programs with the same LinkHash, since
+// those link to the same IR; see GetExecutable
 struct Executable { // codegen info
-   std::map<ShaderKey, Instance *> instances;
+   unsigned long long hash; // of LinkHash and shader type, key of executables
+   unsigned refCount; // linked shaders using it
+   Instance ** instances; // hash table of bucketCount chains, by Instance::hash
+   unsigned bucketCount, instanceCount;
+   // fragment main by context symbols and key without scanline state
+   std::map<std::pair<const GGLState *, ShaderKey>, Instance *> generics;
+   ShaderKey key; // last from keyState, only GGLDirty parts are updated, see GetShaderKey
+   const GGLState * keyState;
 };
 
+// instances of all shaders in least recently used order; they are freed from the least recent
+// when the estimated size of all exceeds budget; main thread only, like the glsl context
+static struct InstanceCache {
+   Instance * head, * tail; // most and least recently used
+   unsigned budget; // bytes, 0 for unlimited
+   unsigned bytes; // counted size of instances, compared with budget
+   GGLShaderCacheStats_t stats; // instances and bytes are counted when queried
+} instanceCache = {NULL, NULL, GGL_SHADER_CACHE_BUDGET};
+
+// instances are compiled at firstLevel, then fragment scanlines drawn hotDraws raster batches are
+// recompiled at hotLevel by JitThread; hotDraws 0 disables tiers; then those drawn uniformDraws
+// batches with the same uniform values are compiled with them folded, 0 to disable;
+// process wide, see ShaderJitPoll
+static struct JitTiers {
+   unsigned firstLevel, hotLevel, hotDraws;
+   unsigned uniformDraws;
+} jitTiers = {GGL_JIT_FIRST_LEVEL, GGL_JIT_HOT_LEVEL, GGL_JIT_HOT_DRAWS, GGL_JIT_UNIFORM_DRAWS};
+
+// phase statistics since the last reset, see GGLShaderGetStats; the lock also guards per
+// shader stats, which JitThread updates
+static struct ShaderStatsTotal {
+   pthread_mutex_t lock;
+   GGLShaderStats_t stats;
+} shaderStats = {PTHREAD_MUTEX_INITIALIZER};
+
+unsigned long long ShaderStatsTime()
+{
+   timespec time;
+   clock_gettime(CLOCK_MONOTONIC, &time);
+   return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static void AccumulateStats(GGLShaderStats_t * stats, const GGLShaderStats_t * add)
+{
+   for (unsigned i = 0; i < GGL_SHADER_PHASES; i++) {
+      stats->runs[i] += add->runs[i];
+      stats->nanoseconds[i] += add->nanoseconds[i];
+      stats->bytes[i] += add->bytes[i];
+   }
+   stats->irBefore += add->irBefore;
+   stats->irAfter += add->irAfter;
+   stats->optimizeLoops += add->optimizeLoops;
+   stats->llvmInstructions += add->llvmInstructions;
+   stats->codeBytes += add->codeBytes;
+}
+
+void ShaderStatsAdd(GGLShaderStats_t * stats, const GGLShaderStats_t * add)
+{
+   pthread_mutex_lock(&shaderStats.lock);
+   if (stats)
+      AccumulateStats(stats, add);
+   AccumulateStats(&shaderStats.stats, add);
+   pthread_mutex_unlock(&shaderStats.lock);
+}
+
+void ShaderStatsPhase(GGLShaderStats_t * stats, const GGLShaderPhase phase,
+                      const unsigned long long start, const int bytes)
+{
+   GGLShaderStats_t add = {0};
+   add.runs[phase] = 1;
+   add.nanoseconds[phase] = ShaderStatsTime() - start;
+   add.bytes[phase] = bytes;
+   ShaderStatsAdd(stats, &add);
+}
+
+// runs LLVM passes like -O level on module; ir_to_llvm makes an alloca for every variable
+static void OptimizeModule(llvm::Module * module, const unsigned level)
+{
+   if (!level)
+      return;
+   llvm::PassManager passes;
+   if (level >= 3)
+      passes.add(llvm::createFunctionInliningPass()); // main and its calls into the scanline
+   passes.add(llvm::createPromoteMemoryToRegisterPass());
+   passes.add(llvm::createInstructionCombiningPass());
+   passes.add(llvm::createCFGSimplificationPass());
+   if (level >= 2) {
+      passes.add(llvm::createScalarReplAggregatesPass());
+      passes.add(llvm::createReassociatePass());
+      passes.add(llvm::createGVNPass());
+      passes.add(llvm::createDeadStoreEliminationPass());
+      passes.add(llvm::createAggressiveDCEPass());
+   }
+   if (level >= 3) { // the scanline loop
+      passes.add(llvm::createLoopRotatePass());
+      passes.add(llvm::createLICMPass());
+      passes.add(llvm::createLoopUnrollPass());
+      passes.add(llvm::createInstructionCombiningPass());
+      passes.add(llvm::createGVNPass());
+      passes.add(llvm::createCFGSimplificationPass());
+   }
+   passes.run(*module);
+}
+
+// replaces the constants argument of the shader main with an internal constant copy of slots
+// uniform values, so that OptimizeModule folds them; values are copied bitwise, since int and
+// bool uniforms are stored in the float slots too
+static void SpecializeUniforms(llvm::Module * module, const char * mainName,
+                               const float (*values)[4], const unsigned slots)
+{
+   llvm::Function * function = module->getFunction(mainName);
+   assert(function && 3 == function->arg_size());
+   if (!function || !slots)
+      return;
+   llvm::Function::arg_iterator constants = function->arg_begin();
+   constants++; // inputs
+   constants++; // outputs
+
+   llvm::Type * intType = llvm::Type::getInt32Ty(module->getContext());
+   llvm::VectorType * vecType = llvm::VectorType::get(intType, 4);
+   std::vector<llvm::Constant *> vecs;
+   for (unsigned i = 0; i < slots; i++) {
+      std::vector<llvm::Constant *> elems;
+      for (unsigned j = 0; j < 4; j++) {
+         unsigned bits = 0;
+         memcpy(&bits, values[i] + j, sizeof(bits));
+         elems.push_back(llvm::ConstantInt::get(intType, bits));
+      }
+      vecs.push_back(llvm::ConstantVector::get(llvm::ArrayRef<llvm::Constant *>(elems)));
+   }
+   llvm::ArrayType * arrayType = llvm::ArrayType::get(vecType, slots);
+   llvm::GlobalVariable * uniforms = new llvm::GlobalVariable(*module, arrayType, true,
+         llvm::GlobalValue::InternalLinkage, llvm::ConstantArray::get(arrayType, vecs),
+         "gl_uniformValues");
+   constants->replaceAllUsesWith(llvm::ConstantExpr::getBitCast(uniforms, constants->getType()));
+}
+
+static void InstanceCacheUnlink(Instance * instance)
+{
+   if (instance->lruPrev)
+      instance->lruPrev->lruNext = instance->lruNext;
+   else
+      instanceCache.head = instance->lruNext;
+   if (instance->lruNext)
+      instance->lruNext->lruPrev = instance->lruPrev;
+   else
+      instanceCache.tail = instance->lruPrev;
+   instance->lruPrev = instance->lruNext = NULL;
+}
+
+// adds the change of instance size since it was last counted to instanceCache.bytes; size is
+// set by CodeGen, on JitThread for asynchronous instances, so it is only counted once ready
+static void InstanceCacheCount(Instance * instance)
+{
+   if (!instance->ready)
+      return;
+   __sync_synchronize(); // ready is read before size
+   instanceCache.bytes += instance->size - instance->counted;
+   instance->counted = instance->size;
+}
+
+static void InstanceCacheTouch(Instance * instance)
+{
+   InstanceCacheCount(instance);
+   if (instanceCache.head == instance)
+      return;
+   if (instance->lruPrev || instance->lruNext || instanceCache.tail == instance)
+      InstanceCacheUnlink(instance);
+   instance->lruNext = instanceCache.head;
+   if (instanceCache.head)
+      instanceCache.head->lruPrev = instance;
+   instanceCache.head = instance;
+   if (!instanceCache.tail)
+      instanceCache.tail = instance;
+}
+
+// executables are shared by contexts, but code has the texture symbol addresses of the context
+// it was compiled for, so only instances with symbols match
+static Instance * FindInstance(const Executable * executable, const ShaderKey * key,
+                               const unsigned hash, const GGLState * symbols)
+{
+   if (!executable->bucketCount)
+      return NULL;
+   Instance * instance = executable->instances[hash & (executable->bucketCount - 1)];
+   for (; instance; instance = instance->hashNext)
+      if (instance->hash == hash && instance->symbols == symbols &&
+            !memcmp(&instance->key, key, sizeof(*key)))
+         return instance;
+   return NULL;
+}
+
+// unlinks instance from its executable and instanceCache, and frees its script and module
+static void RemoveInstance(Instance * instance)
+{
+   Executable * executable = instance->executable;
+   Instance ** link = executable->instances + (instance->hash & (executable->bucketCount - 1));
+   while (*link != instance)
+      link = &(*link)->hashNext;
+   *link = instance->hashNext;
+   executable->instanceCount--;
+   InstanceCacheUnlink(instance);
+   instanceCache.bytes -= instance->counted;
+   instance->~Instance();
+   hieralloc_free(instance);
+}
+
+// frees least recently used instances until within budget; keep, instances bound by a shader,
+// and those still compiling are kept
+static void EvictInstances(const Instance * keep)
+{
+   if (!instanceCache.budget)
+      return;
+   Instance * instance = instanceCache.tail;
+   while (instanceCache.bytes > instanceCache.budget && instance) {
+      Instance * prev = instance->lruPrev;
+      if (instance != keep && instance->ready && !instance->users &&
+            (!instance->tier || instance->tier->ready)) {
+         RemoveInstance(instance);
+         instanceCache.stats.evictions++;
+      }
+      instance = prev;
+   }
+}
+
+// inserts instance with key and hash to shader's executable as most recently used, then evicts
+static void AddInstance(gl_shader * shader, Instance * instance, const ShaderKey * key,
+                        const unsigned hash)
+{
+   Executable * executable = shader->executable;
+   if (executable->instanceCount >= executable->bucketCount) { // double, keeping load <= 1
+      const unsigned bucketCount = executable->bucketCount ? executable->bucketCount * 2 : 8;
+      Instance ** instances = (Instance **)hieralloc_zero_size(executable,
+                                                              bucketCount * sizeof(Instance *));
+      for (unsigned i = 0; i < executable->bucketCount; i++)
+         while (Instance * moved = executable->instances[i]) {
+            executable->instances[i] = moved->hashNext;
+            moved->hashNext = instances[moved->hash & (bucketCount - 1)];
+            instances[moved->hash & (bucketCount - 1)] = moved;
+         }
+      if (executable->instances)
+         hieralloc_free(executable->instances);
+      executable->instances = instances;
+      executable->bucketCount = bucketCount;
+   }
+   instance->key = *key;
+   instance->hash = hash;
+   instance->executable = executable;
+   instance->hashNext = executable->instances[hash & (executable->bucketCount - 1)];
+   executable->instances[hash & (executable->bucketCount - 1)] = instance;
+   executable->instanceCount++;
+   InstanceCacheTouch(instance);
+   EvictInstances(instance);
+}
+
+#if USE_ASYNC_JIT
+static void JitWait();
+static bool JitQueued(const gl_shader * shader);
+#endif
+
+// releases the instances shader binds; they may be evicted once no shader binds them;
+// its specialized instance is freed, so raster threads must be done with it
+static void UnbindInstances(gl_shader * shader)
+{
+   if (shader->instance)
+      shader->instance->users--;
+   if (shader->pending)
+      shader->pending->users--;
+   if (shader->special) {
+#if USE_ASYNC_JIT
+      if (!shader->special->ready)
+         JitWait(); // parsing bitcode of shader->instance
+#endif
+      shader->special->~Instance();
+      hieralloc_free(shader->special);
+   }
+   shader->instance = NULL;
+   shader->pending = NULL;
+   shader->special = NULL;
+   shader->function = NULL;
+   shader->batchFunction = NULL;
+   shader->GenericState = NULL;
+}
+
+static void BindInstance(gl_shader * shader, Instance * instance)
+{
+   instance->users++;
+   shader->instance = instance;
+   shader->function = instance->function;
+   shader->batchFunction = instance->batchFunction;
+}
+
+// linked shaders by Executable::hash, so identical programs share instances; main thread only
+static std::map<unsigned long long, Executable *> executables;
+
+static Executable * GetExecutable(const gl_shader_program * program, const gl_shader * shader)
+{
+   unsigned long long hash = ShaderCacheHash(&program->LinkHash, sizeof(program->LinkHash));
+   hash = ShaderCacheHash(&shader->Type, sizeof(shader->Type), hash);
+   Executable * executable = executables[hash];
+   if (!executable) {
+      executable = hieralloc_zero(NULL, Executable);
+      executable->generics = std::map<std::pair<const GGLState *, ShaderKey>, Instance *>();
+      executable->hash = hash;
+      executables[hash] = executable;
+   }
+   executable->refCount++;
+   return executable;
+}
+
+static void ReleaseExecutable(Executable * executable)
+{
+   if (--executable->refCount)
+      return;
+#if USE_ASYNC_JIT
+   JitWait(); // jobs may be compiling instances of executable
+#endif
+   for (unsigned i = 0; i < executable->bucketCount; i++)
+      while (executable->instances[i])
+         RemoveInstance(executable->instances[i]);
+   for (std::map<std::pair<const GGLState *, ShaderKey>, Instance *>::iterator it =
+         executable->generics.begin();
+         it != executable->generics.end(); it++)
+      (*it).second->~Instance();
+   executable->generics.~map();
+   executables.erase(executable->hash);
+   hieralloc_free(executable);
+}
+
+// before a linked shader is deleted, by GGLShaderDelete or by relinking its program
+static void ReleaseShaderExecutable(gl_shader * shader)
+{
+   if (!shader || !shader->executable)
+      return;
+#if USE_ASYNC_JIT
+   if (shader->pending || shader->special || JitQueued(shader))
+      JitWait(); // jobs read shader and its program, whatever refCount of its executable
+#endif
+   UnbindInstances(shader);
+   ReleaseExecutable(shader->executable);
+   shader->executable = NULL;
+}
+
 bool do_mat_op_to_vec(exec_list *instructions);
 
 extern void link_shaders(const struct gl_context *ctx, struct gl_shader_program *prog);
@@ -165,6 +551,7 @@ GLboolean GGLShaderCompile(gl_shader * shader, const char * glsl, const char **
    if (glsl)
       shader->Source = glsl;
    assert(shader->Source);
+   shader->SourceHash = ShaderCacheHash(shader->Source, strlen(shader->Source));
    compile_shader(glContext.ctx, shader);
    if (glsl)
       shader->Source = NULL;
@@ -187,12 +574,7 @@ static GLboolean ShaderCompile(const GGLInterface * iface, gl_shader * shader,
 
 void GGLShaderDelete(gl_shader * shader)
 {
-   if (shader && shader->executable) {
-      for (std::map<ShaderKey, Instance *>::iterator it=shader->executable->instances.begin();
-            it != shader->executable->instances.end(); it++)
-         (*it).second->~Instance();
-      shader->executable->instances.~map();
-   }
+   ReleaseShaderExecutable(shader);
    _mesa_delete_shader(NULL, shader);
 }
 
@@ -256,11 +638,40 @@ static void ShaderAttach(const GGLInterface * iface, gl_shader_program * program
 
 GLboolean GGLShaderProgramLink(gl_shader_program * program, const char ** infoLog)
 {
+   for (unsigned i = 0; i < MESA_SHADER_TYPES; i++) // link_shaders deletes them
+      ReleaseShaderExecutable(program->_LinkedShaders[i]);
+   if (program->Stats)
+      memset(program->Stats, 0, sizeof(*program->Stats));
+   else
+      program->Stats = hieralloc_zero(program, GGLShaderStats_t);
+   const unsigned size = hieralloc_total_size(program);
+   const unsigned long long start = ShaderStatsTime();
    link_shaders(glContext.ctx, program);
+   ShaderStatsPhase(program->Stats, GGL_SHADER_LINK, start, hieralloc_total_size(program) - size);
    if (infoLog)
       *infoLog = program->InfoLog;
    if (!program->LinkStatus)
       return program->LinkStatus;
+   for (unsigned i = 0; i < MESA_SHADER_TYPES; i++) // for JIT phases, see CodeGen
+      if (program->_LinkedShaders[i])
+         program->_LinkedShaders[i]->Stats = hieralloc_zero(program->_LinkedShaders[i],
+                                                            GGLShaderStats_t);
+   // linked IR depends only on attached sources and attribute bindings, so they key the shader cache
+   unsigned long long hash = ShaderCacheHash(NULL, 0);
+   for (unsigned i = 0; i < program->NumShaders; i++)
+      hash = ShaderCacheHash(&program->Shaders[i]->SourceHash, sizeof(unsigned long long), hash);
+   for (unsigned i = 0; program->Attributes && i < program->Attributes->NumParameters; i++) {
+      const gl_program_parameter & attribute = program->Attributes->Parameters[i];
+      hash = ShaderCacheHash(attribute.Name, strlen(attribute.Name) + 1, hash);
+      hash = ShaderCacheHash(&attribute.BindLocation, sizeof(attribute.BindLocation), hash);
+   }
+   program->LinkHash = hash;
+   program->UniformSerial++; // values are reset; nonzero, since 0 marks unspecialized instances
+   program->UniformDraws = 0;
+#if USE_BLIT_FAST_PATH
+   if (program->_LinkedShaders[MESA_SHADER_FRAGMENT])
+      ClassifyBlit(program->_LinkedShaders[MESA_SHADER_FRAGMENT]);
+#endif
    LOGD("slots: attribute=%d varying=%d uniforms=%d \n", program->AttributeSlots, program->VaryingSlots, program->Uniforms->Slots);
 //   for (unsigned i = 0; i < program->Attributes->NumParameters; i++) {
 //      const gl_program_parameter & attribute = program->Attributes->Parameters[i];
@@ -277,25 +688,50 @@ GLboolean GGLShaderProgramLink(gl_shader_program * program, const char ** infoLo
    return program->LinkStatus;
 }
 
-static GLboolean ShaderProgramLink(gl_shader_program * program, const char ** infoLog)
+static GLboolean ShaderProgramLink(GGLInterface * iface, gl_shader_program * program,
+                                   const char ** infoLog)
 {
+   GGL_GET_CONTEXT(ctx, iface);
+#if USE_TILE_THREADS
+   TileRasterFinish(iface); // binned triangles call its scanlines and read its varyings
+#endif
+   if (ctx->CurrentProgram == program)
+      SetShaderVerifyFunctions(iface); // its functions are released, so bind again on draw
    return GGLShaderProgramLink(program, infoLog);
 }
 
-static void GetShaderKey(const GGLState * ctx, const gl_shader * shader, ShaderKey * key)
+// GGLDirty bits of the parts of GGLState in the key of shader
+static unsigned ShaderKeyDirty(const gl_shader * shader)
 {
-   memset(key, 0, sizeof(*key));
+   unsigned dirty = shader->SamplersUsed * GGL_DIRTY_TEXTURE;
+   if (GL_FRAGMENT_SHADER == shader->Type)
+      dirty |= GGL_DIRTY_STENCIL | GGL_DIRTY_BUFFER | GGL_DIRTY_BLEND;
+   return dirty;
+}
+
+// updates the GGLDirty parts of key from ctx, all of it for GGL_DIRTY_ALL;
+// returns hash of key, used to find instances
+static unsigned GetShaderKey(const GGLState * ctx, const gl_shader * shader, ShaderKey * key,
+                             const unsigned dirty)
+{
+   if (GGL_DIRTY_ALL == dirty)
+      memset(key, 0, sizeof(*key));
    if (GL_FRAGMENT_SHADER == shader->Type) {
-      key->scanLineKey.frontStencil = ctx->frontStencil;
-      key->scanLineKey.backStencil = ctx->backStencil;
-      key->scanLineKey.bufferState = ctx->bufferState;
-      key->scanLineKey.blendState = ctx->blendState;
+      if (dirty & GGL_DIRTY_STENCIL) {
+         key->scanLineKey.frontStencil = ctx->frontStencil;
+         key->scanLineKey.backStencil = ctx->backStencil;
+      }
+      if (dirty & GGL_DIRTY_BUFFER)
+         key->scanLineKey.bufferState = ctx->bufferState;
+      if (dirty & GGL_DIRTY_BLEND)
+         key->scanLineKey.blendState = ctx->blendState;
    }
 
    for (unsigned i = 0; i < GGL_MAXCOMBINEDTEXTUREIMAGEUNITS; i++)
-      if (shader->SamplersUsed & (1 << i)) {
+      if (shader->SamplersUsed & (1 << i) && dirty & (GGL_DIRTY_TEXTURE << i)) {
          const GGLTexture & texture = ctx->textureState.textures[i];
          key->textureFormats[i] = texture.format;
+         key->textureParameters[i] = 0;
          assert((1 << 2) > texture.wrapS);
          key->textureParameters[i] |= texture.wrapS;
          assert((1 << 2) > texture.wrapT);
@@ -304,7 +740,11 @@ static void GetShaderKey(const GGLState * ctx, const gl_shader * shader, ShaderK
          key->textureParameters[i] |= texture.minFilter << (2 + 2);
          assert((1 << 1) > texture.magFilter);
          key->textureParameters[i] |= texture.magFilter << (2 + 2 + 3);
+         assert((1 << 1) > texture.layout);
+         key->textureParameters[i] |= texture.layout << (2 + 2 + 3 + 1);
       }
+   const unsigned long long hash = ShaderCacheHash(key, sizeof(*key)); // key is zeroed first
+   return hash ^ (hash >> 32);
 }
 
 static inline char HexDigit(unsigned char d)
@@ -312,7 +752,7 @@ static inline char HexDigit(unsigned char d)
    return (d > 9 ? d + 'A' - 10 : d + '0');
 }
 
-static const unsigned SHADER_KEY_STRING_LEN = GGL_MAXCOMBINEDTEXTUREIMAGEUNITS * 4 + 2;
+static const unsigned SHADER_KEY_STRING_LEN = GGL_MAXCOMBINEDTEXTUREIMAGEUNITS * 6 + 2;
 
 static void GetShaderKeyString(const GLenum type, const ShaderKey * key,
                                char * buffer, const unsigned bufferSize)
@@ -330,8 +770,8 @@ static void GetShaderKeyString(const GLenum type, const ShaderKey * key,
    for (unsigned i = 0; i < GGL_MAXCOMBINEDTEXTUREIMAGEUNITS; i++) {
       *str++ = HexDigit(key->textureFormats[i] / 16);
       *str++ = HexDigit(key->textureFormats[i] % 16);
-      *str++ = HexDigit(key->textureParameters[i] / 16);
-      *str++ = HexDigit(key->textureParameters[i] % 16);
+      for (int shift = 12; shift >= 0; shift -= 4)
+         *str++ = HexDigit((key->textureParameters[i] >> shift) % 16);
    }
    *str++ = '\0';
 }
@@ -372,6 +812,8 @@ static void* SymbolLookup(void* pContext, const char* name)
          symbol = (void *)gglCtx->textureState.textureData;
       else if (!strcmp(_PF2_TEXTURE_DIMENSIONS_NAME_, name))
          symbol = (void *)gglCtx->textureState.textureDimensions;
+      else if (!strcmp(_PF2_TEXTURE_LEVELS_NAME_, name))
+         symbol = (void *)gglCtx->textureState.textureLevels;
       else // attributes, varyings and uniforms are mapped to locations in pointers
       {
          LOGD("pf2: SymbolLookup unknown symbol: '%s'", name);
@@ -383,21 +825,89 @@ static void* SymbolLookup(void* pContext, const char* name)
    return (void *)symbol;
 }
 
+// cache is NULL if shader cache is disabled; if cache->bitcode is loaded then instance->module is
+// NULL and the bitcode is compiled instead, else the module is stored to cache and compiled as bitcode;
+// the module is optimized at instance->level first
 static void CodeGen(Instance * instance, const char * mainName, gl_shader * shader,
-                    gl_shader_program * program, const GGLState * gglCtx)
+                    gl_shader_program * program, const GGLState * gglCtx,
+                    const ShaderCacheEntry * cache)
 {
    SymbolLookupContext ctx = {gglCtx, program, shader};
    int result = 0;
+   instance->symbols = gglCtx;
 
+   unsigned long long start = ShaderStatsTime();
+   if (instance->module) {
+      OptimizeModule(instance->module, instance->level);
+      ShaderStatsPhase(shader->Stats, GGL_SHADER_LLVM_OPTIMIZE, start);
+   }
 //   instance->module->dump();
 
+#if USE_ASYNC_JIT && USE_LLVM_SCANLINE
+   // scanlines that may get hot keep their bitcode, so JitThread can recompile them
+   if (!instance->bitcode && GL_FRAGMENT_SHADER == shader->Type && !instance->uniformSerial &&
+         ((jitTiers.hotDraws && instance->level < jitTiers.hotLevel) || jitTiers.uniformDraws)) {
+      std::string bitcode;
+      if (instance->module) {
+         llvm::raw_string_ostream stream(bitcode);
+         llvm::WriteBitcodeToFile(instance->module, stream);
+         stream.flush();
+      } else if (cache && cache->bitcode)
+         bitcode.assign(cache->bitcode, cache->size);
+      if (bitcode.size()) {
+         instance->bitcode = (char *)malloc(bitcode.size());
+         memcpy(instance->bitcode, bitcode.data(), bitcode.size());
+         instance->bitcodeSize = bitcode.size();
+      }
+   }
+#endif
+
+   // machine code and libbcc data are assumed proportional to LLVM instructions or bitcode
+   GGLShaderStats_t codeStats = {0};
+   if (instance->module) {
+      unsigned instructions = 0;
+      for (llvm::Module::const_iterator f = instance->module->begin(); f != instance->module->end(); ++f)
+         for (llvm::Function::const_iterator b = f->begin(); b != f->end(); ++b)
+            instructions += b->size();
+      instance->size = instructions * 16;
+      codeStats.llvmInstructions = instructions;
+   } else if (cache && cache->bitcode)
+      instance->size = cache->size * 4;
+   instance->size += instance->bitcodeSize;
+   codeStats.codeBytes = instance->size;
+   ShaderStatsAdd(shader->Stats, &codeStats);
+
+   start = ShaderStatsTime();
+
    BCCScriptRef & script = instance->script;
    script = bccCreateScript();
-   result = bccReadModule(script, "glsl", (LLVMModuleRef)instance->module, 0);
-   assert(0 == result);
-   result = bccRegisterSymbolCallback(script, SymbolLookup, &ctx);
-   assert(0 == result);
-   result = bccPrepareExecutable(script, NULL, NULL, 0);
+   if (cache) {
+      std::string bitcode;
+      if (cache->bitcode)
+         bitcode.assign(cache->bitcode, cache->size);
+      else {
+         llvm::raw_string_ostream stream(bitcode);
+         llvm::WriteBitcodeToFile(instance->module, stream);
+         stream.flush();
+         ShaderCacheStore(cache, bitcode.data(), bitcode.size());
+         delete instance->module; // script owns module parsed from bitcode
+         instance->module = NULL;
+      }
+      result = bccReadBC(script, "glsl", bitcode.data(), bitcode.size(), 0);
+      assert(0 == result);
+      result = bccRegisterSymbolCallback(script, SymbolLookup, &ctx);
+      assert(0 == result);
+      // not cached by libbcc, since machine code has texture symbol addresses of gglCtx
+      result = bccPrepareExecutable(script, NULL, NULL, 0);
+   } else {
+      result = bccReadModule(script, "glsl", (LLVMModuleRef)instance->module, 0);
+      assert(0 == result);
+      result = bccRegisterSymbolCallback(script, SymbolLookup, &ctx);
+      assert(0 == result);
+      result = bccPrepareExecutable(script, NULL, NULL, 0);
+   }
+
+   ShaderStatsPhase(shader->Stats, GGL_SHADER_CODEGEN, start);
 
    result = bccGetError(script);
    if (result != 0) {
@@ -420,26 +930,412 @@ static void CodeGen(Instance * instance, const char * mainName, gl_shader * shad
 void GenerateScanLine(const GGLState * gglCtx, const gl_shader_program * program, llvm::Module * mod,
                       const char * shaderName, const char * scanlineName);
 
-void GGLShaderUse(void * llvmCtx, const GGLState * gglState, gl_shader_program * program)
+void GenerateVertexBatch(llvm::Module * mod, const char * shaderName, const char * batchName);
+
+static unsigned long long ShaderCacheKey(const gl_shader_program * program, const gl_shader * shader,
+                                         const ShaderKey * shaderKey, const unsigned level)
+{
+   unsigned long long hash = ShaderCacheHash(&program->LinkHash, sizeof(program->LinkHash));
+   hash = ShaderCacheHash(&shader->Type, sizeof(shader->Type), hash);
+   hash = ShaderCacheHash(&level, sizeof(level), hash); // bitcode is stored optimized
+   return ShaderCacheHash(shaderKey, sizeof(*shaderKey), hash); // zeroed padding
+}
+
+#if USE_ASYNC_JIT
+
+// Fragment shaders are JIT in two steps when state changes to a new ShaderKey: the shader main
+// for the texture part of the key is JIT at once (see GetGenericInstance), and drawn with
+// GenericScanLine, which reads stencil, depth and blend state at runtime; the scanline
+// specialized to the state is generated from the main's bitcode and JIT by JitThread,
+// and switched to by ShaderJitPoll when ready. One thread compiles, with its own LLVMContext.
+
+struct JitJob {
+   Instance * instance; // specialized or tier, ready is set when compiled
+   const Instance * source; // its bitcode is parsed: generic main, or scanline to tier up
+   bool generate; // GenerateScanLine from the main in bitcode, else bitcode is the scanline
+   float (*uniforms)[4]; // values folded into main, see SpecializeUniforms; malloc
+   unsigned uniformSlots;
+   gl_shader * shader;
+   gl_shader_program * program;
+   const GGLState * gglState; // of context, only for texture symbol addresses
+   char mainName [SHADER_KEY_STRING_LEN + 6];
+   char scanlineName [SCANLINE_KEY_STRING_LEN];
+   JitJob * next;
+   ~JitJob() {
+      free(uniforms);
+   }
+};
+
+static struct JitQueue {
+   pthread_mutex_t lock;
+   pthread_cond_t queueCond; // signaled when a job is queued, or to stop
+   pthread_cond_t idleCond; // signaled when no job is queued or compiling
+   JitJob * head, * tail;
+   const JitJob * current; // compiling, or NULL
+   bool started, stop;
+   pthread_t thread;
+   llvm::LLVMContext * llvmCtx; // for JitThread only; kept for modules of compiled instances
+} jitQueue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void JitCompile(JitJob * job)
+{
+   Instance * instance = job->instance;
+   llvm::MemoryBuffer * buffer = llvm::MemoryBuffer::getMemBuffer(
+                                    llvm::StringRef(job->source->bitcode, job->source->bitcodeSize),
+                                    "glsl", false);
+   std::string error;
+   llvm::Module * module = llvm::ParseBitcodeFile(buffer, *jitQueue.llvmCtx, &error);
+   delete buffer;
+   if (!module) {
+      LOGD("pf2: JitCompile could not parse '%s': %s \n", job->scanlineName, error.c_str());
+      assert(0);
+   } else {
+      if (job->generate) {
+         const unsigned long long start = ShaderStatsTime();
+         GenerateScanLine(&instance->state, job->program, module, job->mainName, job->scanlineName);
+         ShaderStatsPhase(job->shader->Stats, GGL_SHADER_GENERATE, start);
+      }
+      if (job->uniforms)
+         SpecializeUniforms(module, job->mainName, job->uniforms, job->uniformSlots);
+      instance->module = module;
+      CodeGen(instance, job->scanlineName, job->shader, job->program, job->gglState, NULL);
+   }
+   __sync_synchronize(); // function is visible before ready
+   instance->ready = 1;
+}
+
+static void * JitThread(void *)
+{
+   pthread_mutex_lock(&jitQueue.lock);
+   while (true) {
+      while (!jitQueue.head && !jitQueue.stop)
+         pthread_cond_wait(&jitQueue.queueCond, &jitQueue.lock);
+      JitJob * job = jitQueue.head;
+      if (!job) // stopping, and queued jobs are done
+         break;
+      jitQueue.head = job->next;
+      if (!jitQueue.head)
+         jitQueue.tail = NULL;
+      jitQueue.current = job;
+      pthread_mutex_unlock(&jitQueue.lock);
+
+      JitCompile(job);
+
+      pthread_mutex_lock(&jitQueue.lock);
+      delete job;
+      jitQueue.current = NULL;
+      if (!jitQueue.head)
+         pthread_cond_broadcast(&jitQueue.idleCond);
+   }
+   pthread_mutex_unlock(&jitQueue.lock);
+   return NULL;
+}
+
+static void JitEnqueue(JitJob * job)
+{
+   pthread_mutex_lock(&jitQueue.lock);
+   if (!jitQueue.started) {
+      llvm::llvm_start_multithreaded(); // LLVM is also used by the calling thread
+      if (!jitQueue.llvmCtx)
+         jitQueue.llvmCtx = new llvm::LLVMContext();
+      jitQueue.stop = false;
+      jitQueue.started = !pthread_create(&jitQueue.thread, NULL, JitThread, NULL);
+      assert(jitQueue.started);
+   }
+   job->next = NULL;
+   if (jitQueue.tail)
+      jitQueue.tail->next = job;
+   else
+      jitQueue.head = job;
+   jitQueue.tail = job;
+   pthread_cond_signal(&jitQueue.queueCond);
+   pthread_mutex_unlock(&jitQueue.lock);
+}
+
+// waits until all queued jobs are compiled
+static void JitWait()
+{
+   pthread_mutex_lock(&jitQueue.lock);
+   while (jitQueue.started && (jitQueue.head || jitQueue.current))
+      pthread_cond_wait(&jitQueue.idleCond, &jitQueue.lock);
+   pthread_mutex_unlock(&jitQueue.lock);
+}
+
+// whether a queued or compiling job is for shader
+static bool JitQueued(const gl_shader * shader)
+{
+   pthread_mutex_lock(&jitQueue.lock);
+   bool queued = jitQueue.current && jitQueue.current->shader == shader;
+   for (const JitJob * job = jitQueue.head; job && !queued; job = job->next)
+      queued = job->shader == shader;
+   pthread_mutex_unlock(&jitQueue.lock);
+   return queued;
+}
+
+// compiles queued jobs, then stops JitThread
+static void JitStop()
+{
+   pthread_mutex_lock(&jitQueue.lock);
+   if (!jitQueue.started) {
+      pthread_mutex_unlock(&jitQueue.lock);
+      return;
+   }
+   jitQueue.stop = true;
+   pthread_cond_signal(&jitQueue.queueCond);
+   pthread_mutex_unlock(&jitQueue.lock);
+   pthread_join(jitQueue.thread, NULL);
+   jitQueue.started = false;
+}
+
+// fragment shader main JIT for the texture part of shaderKey, with its bitcode kept for JitJob
+static Instance * GetGenericInstance(void * llvmCtx, const GGLState * gglState,
+                                     gl_shader_program * program, gl_shader * shader,
+                                     const ShaderKey * shaderKey)
+{
+   ShaderKey genericKey = *shaderKey;
+   memset(&genericKey.scanLineKey, 0, sizeof(genericKey.scanLineKey));
+   Instance * generic = shader->executable->generics[std::make_pair(gglState, genericKey)];
+   if (generic)
+      return generic;
+
+   generic = hieralloc_zero(shader->executable, Instance);
+   generic->level = jitTiers.firstLevel;
+   char shaderName [SHADER_KEY_STRING_LEN] = {0};
+   GetShaderKeyString(shader->Type, &genericKey, shaderName, sizeof shaderName / sizeof *shaderName);
+   char mainName [SHADER_KEY_STRING_LEN + 6] = {"main"};
+   strcat(mainName, shaderName);
+
+   generic->module = new llvm::Module("glsl", *(llvm::LLVMContext *)llvmCtx);
+   do_mat_op_to_vec(shader->ir); // TODO: move these passes to link?
+   const unsigned long long start = ShaderStatsTime();
+   if (!glsl_ir_to_llvm_module(shader->ir, generic->module, gglState, shaderName))
+      assert(0);
+   ShaderStatsPhase(shader->Stats, GGL_SHADER_IR_TO_LLVM, start);
+
+   std::string bitcode;
+   llvm::raw_string_ostream stream(bitcode);
+   llvm::WriteBitcodeToFile(generic->module, stream);
+   stream.flush();
+   generic->bitcode = (char *)malloc(bitcode.size());
+   memcpy(generic->bitcode, bitcode.data(), bitcode.size());
+   generic->bitcodeSize = bitcode.size();
+
+   CodeGen(generic, mainName, shader, program, gglState, NULL);
+   generic->ready = 1;
+   shader->executable->generics[std::make_pair(gglState, genericKey)] = generic;
+   return generic;
+}
+
+// queues the fragment shader instance for shaderKey to JitThread, unless the shader cache has it;
+// returns NULL if it should be JIT at once
+static Instance * JitAsync(void * llvmCtx, const GGLState * gglState,
+                           gl_shader_program * program, gl_shader * shader,
+                           const ShaderKey * shaderKey)
+{
+   if (ShaderCacheDir()) { // loading from cache is quick
+      ShaderCacheEntry cache = {0};
+      cache.hash = ShaderCacheKey(program, shader, shaderKey, jitTiers.firstLevel);
+      const bool cached = ShaderCacheLoad(&cache);
+      ShaderCacheUnload(&cache);
+      if (cached)
+         return NULL;
+   }
+
+   JitJob * job = new JitJob();
+   job->source = GetGenericInstance(llvmCtx, gglState, program, shader, shaderKey);
+   job->generate = true;
+   job->instance = hieralloc_zero(shader->executable, Instance);
+   job->instance->state = *gglState;
+   job->instance->level = jitTiers.firstLevel;
+   job->shader = shader;
+   job->program = program;
+   job->gglState = gglState;
+   char shaderName [SHADER_KEY_STRING_LEN] = {0};
+   GetShaderKeyString(shader->Type, shaderKey, shaderName, sizeof shaderName / sizeof *shaderName);
+   strcpy(job->mainName, "main");
+   strcat(job->mainName, shaderName);
+   GetScanlineKeyString(shaderKey, job->scanlineName, sizeof job->scanlineName);
+   Instance * instance = job->instance;
+   JitEnqueue(job);
+   return instance;
+}
+
+// queues instance's kept scanline bitcode to JitThread for recompiling at jitTiers.hotLevel
+static void JitTierUp(gl_shader_program * program, gl_shader * shader, Instance * instance)
+{
+   JitJob * job = new JitJob();
+   job->source = instance;
+   job->generate = false;
+   job->instance = hieralloc_zero(instance->executable, Instance);
+   job->instance->level = jitTiers.hotLevel;
+   job->shader = shader;
+   job->program = program;
+   job->gglState = instance->symbols;
+   GetScanlineKeyString(&instance->key, job->scanlineName, sizeof job->scanlineName);
+   instance->tier = job->instance;
+   JitEnqueue(job);
+}
+
+// switches to the recompiled tier of instance once ready; the replaced code is kept in tier
+static void TierPoll(Instance * instance)
+{
+   Instance * tier = instance->tier;
+   if (!tier->ready || tier->level <= instance->level)
+      return;
+   __sync_synchronize(); // ready is read before function
+   if (!tier->function) { // JIT failed, keep the code of instance
+      instance->level = tier->level;
+      return;
+   }
+   struct BCCOpaqueScript * script = instance->script;
+   llvm::Module * module = instance->module;
+   void (* function)() = instance->function;
+   const unsigned level = instance->level;
+   instance->script = tier->script;
+   instance->module = tier->module;
+   instance->function = tier->function;
+   instance->level = tier->level;
+   instance->size += tier->size;
+   InstanceCacheCount(instance);
+   tier->script = script;
+   tier->module = module;
+   tier->function = function;
+   tier->level = level;
+}
+
+// TileRasterFinish calls of iface so far; once it changes, its raster threads are done with
+// code replaced before
+static unsigned RasterFinishes(const GGLInterface * iface)
+{
+#if USE_TILE_THREADS
+   if (iface)
+      return TileRasterFinishes(iface);
+#endif
+   static unsigned calls;
+   return ++calls; // rastering on the calling thread
+}
+
+// queues instance's kept scanline bitcode to JitThread for compiling at jitTiers.hotLevel with
+// the current uniform values of program folded; the previous specialized instance is kept with
+// it until the next TileRasterFinish, since raster threads may still call it
+static void JitSpecialize(const GGLInterface * iface, gl_shader_program * program,
+                          gl_shader * shader, Instance * instance)
+{
+   JitJob * job = new JitJob();
+   job->source = instance;
+   job->generate = false;
+   job->uniformSlots = program->Uniforms ? program->Uniforms->Slots : 0;
+   job->uniforms = (float (*)[4])malloc(job->uniformSlots * sizeof(*job->uniforms));
+   memcpy(job->uniforms, program->ValuesUniform, job->uniformSlots * sizeof(*job->uniforms));
+   job->instance = hieralloc_zero(instance->executable, Instance);
+   job->instance->level = MAX2(jitTiers.hotLevel, 1); // else nothing is folded
+   job->instance->uniformSerial = program->UniformSerial;
+   job->instance->tier = shader->special;
+   job->instance->retired = RasterFinishes(iface);
+   job->instance->retiredBy = iface;
+   job->shader = shader;
+   job->program = program;
+   job->gglState = instance->symbols;
+   char shaderName [SHADER_KEY_STRING_LEN] = {0};
+   GetShaderKeyString(shader->Type, &instance->key, shaderName, sizeof shaderName / sizeof *shaderName);
+   strcpy(job->mainName, "main");
+   strcat(job->mainName, shaderName);
+   GetScanlineKeyString(&instance->key, job->scanlineName, sizeof job->scanlineName);
+   shader->special = job->instance;
+   JitEnqueue(job);
+}
+
+void ShaderJitPoll(const GGLInterface * iface, gl_shader_program * program)
+{
+   gl_shader * shader = program->_LinkedShaders[MESA_SHADER_FRAGMENT];
+   if (!shader)
+      return;
+   if (shader->pending && shader->pending->ready) {
+      __sync_synchronize(); // ready is read before function
+      InstanceCacheCount(shader->pending);
+      if (shader->pending->function) { // else JIT failed, keep drawing with GenericScanLine
+         shader->instance = shader->pending; // users is unchanged
+         shader->function = shader->pending->function;
+         shader->GenericState = NULL;
+      } else
+         shader->pending->users--;
+      shader->pending = NULL;
+   }
+
+   Instance * instance = shader->instance;
+   if (!instance)
+      return;
+   if (instance->tier)
+      TierPoll(instance);
+   else if (instance->bitcode && instance->level < jitTiers.hotLevel && jitTiers.hotDraws &&
+            ++instance->draws >= jitTiers.hotDraws)
+      JitTierUp(program, shader, instance);
+   shader->function = instance->function; // may be a tier from another shader sharing instance
+
+   // uniforms stable for uniformDraws batches are folded; any change falls back to instance
+   if (!jitTiers.uniformDraws || !instance->bitcode)
+      return;
+   program->UniformDraws++;
+   Instance * special = shader->special;
+   if (special && special->tier && special->retiredBy == iface &&
+         special->retired != RasterFinishes(iface)) {
+      special->tier->~Instance();
+      hieralloc_free(special->tier);
+      special->tier = NULL;
+   }
+   if (special && special->uniformSerial == program->UniformSerial) {
+      if (special->ready) {
+         __sync_synchronize(); // ready is read before function
+         if (special->function) // else JIT failed
+            shader->function = special->function;
+      }
+   } else if ((!special || (special->ready && !special->tier)) &&
+              program->UniformDraws >= jitTiers.uniformDraws) // at most one is kept replaced
+      JitSpecialize(iface, program, shader, instance);
+}
+
+#endif // #if USE_ASYNC_JIT
+
+// async is only used by ShaderUse, since GenericScanLine needs ShaderJitPoll; GGLShaderUse waits;
+// dirty is the GGLDirty parts of gglState changed since the last UseProgram with it and program
+static void UseProgram(void * llvmCtx, const GGLState * gglState, gl_shader_program * program,
+                       const bool async, const unsigned dirty)
 {
 //   LOGD("%s", program->Shaders[MESA_SHADER_FRAGMENT]->Source);
    for (unsigned i = 0; i < MESA_SHADER_TYPES; i++) {
       if (!program->_LinkedShaders[i])
          continue;
       gl_shader * shader = program->_LinkedShaders[i];
-      shader->function = NULL;
-      if (!shader->executable) {
-         shader->executable = hieralloc_zero(shader, Executable);
-         shader->executable->instances = std::map<ShaderKey, Instance *>();
+      unsigned keyDirty = GGL_DIRTY_ALL;
+      if (shader->executable && shader->executable->keyState == gglState && GGL_DIRTY_ALL != dirty) {
+         keyDirty = dirty & ShaderKeyDirty(shader);
+         if (!keyDirty && shader->function)
+            continue; // key is unchanged, keep the bound instance
       }
-
-      ShaderKey shaderKey;
-      GetShaderKey(gglState, shader, &shaderKey);
-      Instance * instance = shader->executable->instances[shaderKey];
+      UnbindInstances(shader);
+      if (!shader->executable)
+         shader->executable = GetExecutable(program, shader);
+
+      ShaderKey & shaderKey = shader->executable->key;
+      const unsigned keyHash = GetShaderKey(gglState, shader, &shaderKey, keyDirty);
+      shader->executable->keyState = gglState;
+      Instance * instance = FindInstance(shader->executable, &shaderKey, keyHash, gglState);
+      if (instance) {
+         instanceCache.stats.hits++;
+         InstanceCacheTouch(instance);
+      } else
+         instanceCache.stats.misses++;
+#if USE_ASYNC_JIT
+      if (!instance && async && GL_FRAGMENT_SHADER == shader->Type) {
+         instance = JitAsync(llvmCtx, gglState, program, shader, &shaderKey);
+         if (instance)
+            AddInstance(shader, instance, &shaderKey, keyHash);
+      }
+#endif
       if (!instance) {
 //         puts("begin jit new shader");
          instance = hieralloc_zero(shader->executable, Instance);
-         instance->module = new llvm::Module("glsl", *(llvm::LLVMContext *)llvmCtx);
+         instance->level = jitTiers.firstLevel;
 
          char shaderName [SHADER_KEY_STRING_LEN] = {0};
          GetShaderKeyString(shader->Type, &shaderKey, shaderName, sizeof shaderName / sizeof *shaderName);
@@ -447,7 +1343,19 @@ void GGLShaderUse(void * llvmCtx, const GGLState * gglState, gl_shader_program *
          char mainName [SHADER_KEY_STRING_LEN + 6] = {"main"};
          strcat(mainName, shaderName);
 
-         do_mat_op_to_vec(shader->ir); // TODO: move these passes to link?
+         ShaderCacheEntry cacheEntry = {0}, * cache = NULL;
+         if (ShaderCacheDir()) {
+            cache = &cacheEntry;
+            cache->hash = ShaderCacheKey(program, shader, &shaderKey, jitTiers.firstLevel);
+            ShaderCacheLoad(cache);
+         }
+         const bool generate = !cache || !cache->bitcode; // else skip IR to LLVM and scanline
+
+         llvm::Module * module = NULL;
+         if (generate) {
+            instance->module = new llvm::Module("glsl", *(llvm::LLVMContext *)llvmCtx);
+            do_mat_op_to_vec(shader->ir); // TODO: move these passes to link?
+         }
 //#ifdef __arm__
 //         static const char fileName[] = "/data/pf2.txt";
 //         FILE * file = freopen(fileName, "w", stdout);
@@ -468,9 +1376,13 @@ void GGLShaderUse(void * llvmCtx, const GGLState * gglState, gl_shader_program *
 //         }
 //         fclose(file);
 //#endif
-         llvm::Module * module = glsl_ir_to_llvm_module(shader->ir, instance->module, gglState, shaderName);
-         if (!module)
-            assert(0);
+         if (generate) {
+            const unsigned long long start = ShaderStatsTime();
+            module = glsl_ir_to_llvm_module(shader->ir, instance->module, gglState, shaderName);
+            if (!module)
+               assert(0);
+            ShaderStatsPhase(shader->Stats, GGL_SHADER_IR_TO_LLVM, start);
+         }
 //#ifdef __arm__
 //         static const char fileName[] = "/data/pf2.txt";
 //         FILE * file = freopen(fileName, "w", stderr);
@@ -518,28 +1430,181 @@ void GGLShaderUse(void * llvmCtx, const GGLState * gglState, gl_shader_program *
          if (GL_FRAGMENT_SHADER == shader->Type) {
             char scanlineName [SCANLINE_KEY_STRING_LEN] = {0};
             GetScanlineKeyString(&shaderKey, scanlineName, sizeof scanlineName / sizeof *scanlineName);
-            GenerateScanLine(gglState, program, module, mainName, scanlineName);
-            CodeGen(instance, scanlineName, shader, program, gglState);
+            if (generate) {
+               const unsigned long long start = ShaderStatsTime();
+               GenerateScanLine(gglState, program, module, mainName, scanlineName);
+               ShaderStatsPhase(shader->Stats, GGL_SHADER_GENERATE, start);
+            }
+            CodeGen(instance, scanlineName, shader, program, gglState, cache);
+         } else
+#endif
+#if USE_LLVM_VERTEX_BATCH
+         if (GL_VERTEX_SHADER == shader->Type) {
+            char batchName [SHADER_KEY_STRING_LEN + 6] = {"batch"};
+            strcat(batchName, shaderName);
+            if (generate) {
+               const unsigned long long start = ShaderStatsTime();
+               GenerateVertexBatch(module, mainName, batchName);
+               ShaderStatsPhase(shader->Stats, GGL_SHADER_GENERATE, start);
+            }
+            CodeGen(instance, mainName, shader, program, gglState, cache);
+            instance->batchFunction = (void (*)())bccGetFuncAddr(instance->script, batchName);
+            assert(instance->batchFunction);
          } else
 #endif
-            CodeGen(instance, mainName, shader, program, gglState);
+            CodeGen(instance, mainName, shader, program, gglState, cache);
 
-         shader->executable->instances[shaderKey] = instance;
+         if (cache)
+            ShaderCacheUnload(cache);
+         instance->ready = 1;
+         AddInstance(shader, instance, &shaderKey, keyHash);
 //         debug_printf("jit new shader '%s'(%p) \n", mainName, instance->function);
       } else
 //         debug_printf("use cached shader %p \n", instance->function);
          ;
 
-      shader->function  = instance->function;
+#if USE_ASYNC_JIT
+      if (!instance->ready && !async)
+         JitWait();
+      if (!instance->ready) { // draw with the shader main until JitThread is done
+         ShaderKey genericKey = shaderKey;
+         memset(&genericKey.scanLineKey, 0, sizeof(genericKey.scanLineKey));
+         shader->function =
+            shader->executable->generics[std::make_pair(gglState, genericKey)]->function;
+         shader->pending = instance;
+         instance->users++;
+         shader->GenericState = &instance->state;
+         continue;
+      }
+#endif
+
+      BindInstance(shader, instance);
    }
 //   puts("pf2: GGLShaderUse end");
 
 //   assert(0);
 }
 
+void GGLShaderUse(void * llvmCtx, const GGLState * gglState, gl_shader_program * program)
+{
+   UseProgram(llvmCtx, gglState, program, false, GGL_DIRTY_ALL);
+}
+
+static void ShaderCacheDir(const GGLInterface * iface, const char * dir)
+{
+   GGLShaderCacheDir(dir);
+}
+
+void GGLShaderCacheBudget(unsigned bytes)
+{
+   instanceCache.budget = bytes;
+   EvictInstances(NULL);
+}
+
+static void ShaderCacheBudget(const GGLInterface * iface, unsigned bytes)
+{
+   GGLShaderCacheBudget(bytes);
+}
+
+void GGLShaderCacheStats(GGLShaderCacheStats_t * stats, GLboolean reset)
+{
+   instanceCache.stats.instances = 0;
+   instanceCache.stats.bytes = 0;
+   for (const Instance * instance = instanceCache.head; instance; instance = instance->lruNext) {
+      instanceCache.stats.instances++;
+      instanceCache.stats.bytes += instance->size;
+   }
+   *stats = instanceCache.stats;
+   if (reset) {
+      instanceCache.stats.hits = 0;
+      instanceCache.stats.misses = 0;
+      instanceCache.stats.evictions = 0;
+   }
+}
+
+static void ShaderCacheStats(const GGLInterface * iface, GGLShaderCacheStats_t * stats,
+                             GLboolean reset)
+{
+   GGLShaderCacheStats(stats, reset);
+}
+
+void GGLShaderOptimization(unsigned firstLevel, unsigned hotLevel, unsigned hotDraws)
+{
+   jitTiers.firstLevel = MIN2(firstLevel, 3);
+   jitTiers.hotLevel = MIN2(hotLevel, 3);
+   jitTiers.hotDraws = hotDraws;
+}
+
+static void ShaderOptimization(const GGLInterface * iface, unsigned firstLevel,
+                               unsigned hotLevel, unsigned hotDraws)
+{
+   GGLShaderOptimization(firstLevel, hotLevel, hotDraws);
+}
+
+void GGLShaderSpecializeUniforms(unsigned uniformDraws)
+{
+   jitTiers.uniformDraws = uniformDraws;
+}
+
+static void ShaderSpecializeUniforms(const GGLInterface * iface, unsigned uniformDraws)
+{
+   GGLShaderSpecializeUniforms(uniformDraws);
+}
+
+void GGLShaderGetStats(gl_shader * shader, GGLShaderStats_t * stats, GLboolean reset)
+{
+   pthread_mutex_lock(&shaderStats.lock);
+   GGLShaderStats_t * source = shader ? shader->Stats : &shaderStats.stats;
+   memset(stats, 0, sizeof(*stats));
+   if (source) {
+      *stats = *source;
+      if (reset)
+         memset(source, 0, sizeof(*source));
+   }
+   pthread_mutex_unlock(&shaderStats.lock);
+}
+
+static void ShaderGetStats(const GGLInterface * iface, gl_shader * shader,
+                           GGLShaderStats_t * stats, GLboolean reset)
+{
+   GGLShaderGetStats(shader, stats, reset);
+}
+
+void GGLShaderProgramGetStats(const gl_shader_program * program, GGLShaderStats_t * stats)
+{
+   memset(stats, 0, sizeof(*stats));
+   pthread_mutex_lock(&shaderStats.lock);
+   if (program->Stats)
+      AccumulateStats(stats, program->Stats);
+   for (unsigned i = 0; i < program->NumShaders; i++)
+      if (program->Shaders[i]->Stats)
+         AccumulateStats(stats, program->Shaders[i]->Stats);
+   for (unsigned i = 0; i < MESA_SHADER_TYPES; i++)
+      if (program->_LinkedShaders[i] && program->_LinkedShaders[i]->Stats)
+         AccumulateStats(stats, program->_LinkedShaders[i]->Stats);
+   pthread_mutex_unlock(&shaderStats.lock);
+}
+
+static void ShaderProgramGetStats(const GGLInterface * iface, const gl_shader_program * program,
+                                  GGLShaderStats_t * stats)
+{
+   GGLShaderProgramGetStats(program, stats);
+}
+
+// whether ShaderUse bound the drawing functions since the last SetShaderVerifyFunctions
+static bool ShaderFunctionsBound(const GGLInterface * iface);
+
 static void ShaderUse(GGLInterface * iface, gl_shader_program * program)
 {
    GGL_GET_CONTEXT(ctx, iface);
+   if (program && program == ctx->CurrentProgram && !ctx->dirty && ShaderFunctionsBound(iface)) {
+      bool linked = true; // relinked shaders have no function yet
+      for (unsigned i = 0; i < MESA_SHADER_TYPES; i++)
+         if (program->_LinkedShaders[i] && !program->_LinkedShaders[i]->function)
+            linked = false;
+      if (linked)
+         return; // rebinding the bound program keeps binned triangles in flight
+   }
    // so drawing calls will do nothing until ShaderUse with a program
    SetShaderVerifyFunctions(iface);
    if (!program) {
@@ -547,7 +1612,10 @@ static void ShaderUse(GGLInterface * iface, gl_shader_program * program)
       return;
    }
 
-   GGLShaderUse(ctx->llvmCtx, &ctx->state, program);
+   // only the parts of the keys changed since the last ShaderUse of program are computed
+   UseProgram(ctx->llvmCtx, &ctx->state, program, USE_ASYNC_JIT,
+              program == ctx->CurrentProgram ? ctx->dirty : GGL_DIRTY_ALL);
+   ctx->dirty = 0;
    for (unsigned i = 0; i < MESA_SHADER_TYPES; i++) {
       if (!program->_LinkedShaders[i])
          continue;
@@ -603,6 +1671,9 @@ void GGLShaderProgramDelete(gl_shader_program * program)
 static void ShaderProgramDelete(GGLInterface * iface, gl_shader_program * program)
 {
    GGL_GET_CONTEXT(ctx, iface);
+#if USE_TILE_THREADS
+   TileRasterFinish(iface); // binned triangles may use program, current or not
+#endif
    if (ctx->CurrentProgram == program) {
       ctx->CurrentProgram = NULL;
       SetShaderVerifyFunctions(iface);
@@ -769,6 +1840,13 @@ void GGLShaderUniformGetSamplers(const gl_shader_program_t * program,
    }
 }
 
+// specialized instances with the old values are no longer used, see ShaderJitPoll
+void UniformChanged(gl_shader_program * program)
+{
+   program->UniformSerial++;
+   program->UniformDraws = 0;
+}
+
 GLint GGLShaderUniform(gl_shader_program * program, GLint location, GLsizei count,
                        const GLvoid *values, GLenum type)
 {
@@ -829,7 +1907,10 @@ GLint GGLShaderUniform(gl_shader_program * program, GLint location, GLsizei coun
    if (start + slots > program->Uniforms->Slots)
       assert(0);
    for (int i = 0; i < slots; i++)
-      memcpy(program->ValuesUniform + start + i, values, elems * sizeof(float));
+      if (memcmp(program->ValuesUniform + start + i, values, elems * sizeof(float))) {
+         memcpy(program->ValuesUniform + start + i, values, elems * sizeof(float));
+         UniformChanged(program);
+      }
 //   LOGD("pf2: GGLShaderUniform copied");
    return -2;
 }
@@ -849,7 +1930,10 @@ void GGLShaderUniformMatrix(gl_shader_program * program, GLint cols, GLint rows,
    for (unsigned i = 0; i < slots; i++) {
       float * column = program->ValuesUniform[start + i];
       for (unsigned j = 0; j < rows; j++)
-         column[j] = values[i * 4 + j];
+         if (column[j] != values[i * 4 + j]) {
+            column[j] = values[i * 4 + j];
+            UniformChanged(program);
+         }
    }
 
 //   if (!strstr(program->Shaders[MESA_SHADER_FRAGMENT]->Source,
@@ -864,6 +1948,19 @@ void GGLShaderUniformMatrix(gl_shader_program * program, GLint cols, GLint rows,
 
 }
 
+static GLint ShaderUniform(GGLInterface * iface, gl_shader_program * program, GLint location,
+                           GLsizei count, const GLvoid *values, GLenum type)
+{
+   return GGLShaderUniform(program, location, count, values, type);
+}
+
+static void ShaderUniformMatrix(GGLInterface * iface, gl_shader_program * program, GLint cols,
+                                GLint rows, GLint location, GLsizei count, GLboolean transpose,
+                                const GLfloat *values)
+{
+   GGLShaderUniformMatrix(program, cols, rows, location, count, transpose, values);
+}
+
 static void ShaderVerifyProcessVertex(const GGLInterface * iface, const VertexInput * input,
                                       VertexOutput * output)
 {
@@ -875,6 +1972,17 @@ static void ShaderVerifyProcessVertex(const GGLInterface * iface, const VertexIn
    }
 }
 
+static void ShaderVerifyProcessVertices(const GGLInterface * iface, const VertexInput * inputs,
+                                        VertexOutput * outputs, unsigned count)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   if (ctx->CurrentProgram) {
+      ShaderUse(const_cast<GGLInterface *>(iface), ctx->CurrentProgram);
+      if (ShaderVerifyProcessVertices != iface->ProcessVertices)
+         iface->ProcessVertices(iface, inputs, outputs, count);
+   }
+}
+
 static void ShaderVerifyDrawTriangle(const GGLInterface * iface, const VertexInput * v0,
                                      const VertexInput * v1, const VertexInput * v2)
 {
@@ -920,10 +2028,38 @@ static void ShaderVerifyScanLine(const GGLInterface * iface, const VertexOutput
    }
 }
 
+static bool ShaderFunctionsBound(const GGLInterface * iface)
+{
+   return ShaderVerifyProcessVertex != iface->ProcessVertex &&
+          ShaderVerifyProcessVertices != iface->ProcessVertices &&
+          ShaderVerifyDrawTriangle != iface->DrawTriangle &&
+          ShaderVerifyRasterTriangle != iface->RasterTriangle &&
+          ShaderVerifyRasterTrapezoid != iface->RasterTrapezoid &&
+          ShaderVerifyScanLine != iface->ScanLine;
+}
+
+void SetShaderDirty(struct GGLInterface * iface, const unsigned dirty)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   ctx->dirty |= dirty;
+   SetShaderVerifyFunctions(iface);
+}
+
 // called after state changes so that drawing calls will trigger JIT
 void SetShaderVerifyFunctions(struct GGLInterface * iface)
 {
+   if (ShaderVerifyProcessVertex == iface->ProcessVertex &&
+         ShaderVerifyProcessVertices == iface->ProcessVertices &&
+         ShaderVerifyDrawTriangle == iface->DrawTriangle &&
+         ShaderVerifyRasterTriangle == iface->RasterTriangle &&
+         ShaderVerifyRasterTrapezoid == iface->RasterTrapezoid &&
+         ShaderVerifyScanLine == iface->ScanLine)
+      return; // already set and finished, nothing was binned since
+#if USE_TILE_THREADS
+   TileRasterFinish(iface); // binned triangles use the old state
+#endif
    iface->ProcessVertex = ShaderVerifyProcessVertex;
+   iface->ProcessVertices = ShaderVerifyProcessVertices;
    iface->DrawTriangle = ShaderVerifyDrawTriangle;
    iface->RasterTriangle = ShaderVerifyRasterTriangle;
    iface->RasterTrapezoid = ShaderVerifyRasterTrapezoid;
@@ -944,6 +2080,13 @@ void InitializeShaderFunctions(struct GGLInterface * iface)
    iface->ShaderDetach = ShaderDetach;
    iface->ShaderProgramLink = ShaderProgramLink;
    iface->ShaderUse = ShaderUse;
+   iface->ShaderCacheDir = ShaderCacheDir;
+   iface->ShaderCacheBudget = ShaderCacheBudget;
+   iface->ShaderCacheStats = ShaderCacheStats;
+   iface->ShaderOptimization = ShaderOptimization;
+   iface->ShaderSpecializeUniforms = ShaderSpecializeUniforms;
+   iface->ShaderGetStats = ShaderGetStats;
+   iface->ShaderProgramGetStats = ShaderProgramGetStats;
    iface->ShaderProgramDelete = ShaderProgramDelete;
    iface->ShaderGetiv = GGLShaderGetiv;
    iface->ShaderGetInfoLog = GGLShaderGetInfoLog;
@@ -956,13 +2099,16 @@ void InitializeShaderFunctions(struct GGLInterface * iface)
    iface->ShaderUniformGetfv = GGLShaderUniformGetfv;
    iface->ShaderUniformGetiv = GGLShaderUniformGetiv;
    iface->ShaderUniformGetSamplers = GGLShaderUniformGetSamplers;
-   iface->ShaderUniform = GGLShaderUniform;
-   iface->ShaderUniformMatrix = GGLShaderUniformMatrix;
+   iface->ShaderUniform = ShaderUniform;
+   iface->ShaderUniformMatrix = ShaderUniformMatrix;
 }
 
 void DestroyShaderFunctions(GGLInterface * iface)
 {
    GGL_GET_CONTEXT(ctx, iface);
+#if USE_ASYNC_JIT
+   JitStop();
+#endif
    _mesa_glsl_release_types();
    _mesa_glsl_release_functions();
    delete ctx->llvmCtx;
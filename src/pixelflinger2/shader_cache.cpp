@@ -0,0 +1,175 @@
+/**
+ **
+ ** Copyright 2011, The Android Open Source Project
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "src/pixelflinger2/pixelflinger2.h"
+
+// Generated shader bitcode is kept on disk, one file per program, shader type and ShaderKey,
+// so that a warm start skips IR to LLVM and scanline generation. Only bitcode is kept, since
+// the machine code has texture symbol addresses of the context it was compiled for.
+// Files are named by the entry hash, and start with a header that is checked before use;
+// anything that does not match is ignored and overwritten by the next store.
+
+#define GGL_SHADER_CACHE_MAGIC 0x32465067 // "gPF2"
+
+struct ShaderCacheHeader {
+   unsigned magic, version; // GGL_SHADER_CACHE_MAGIC and GGL_SHADER_CACHE_VERSION
+   unsigned long long hash; // entry hash, guards against renamed or colliding files
+   unsigned long long checksum; // of bitcode
+   unsigned size; // of bitcode following header
+   unsigned padding;
+};
+
+static char cacheDir[256]; // empty when disabled; shared by all contexts like the glsl context
+
+void GGLShaderCacheDir(const char * dir)
+{
+   if (!dir) {
+      cacheDir[0] = 0;
+      return;
+   }
+   if (strlen(dir) + 32 >= sizeof(cacheDir)) { // room for '/' and file name
+      LOGD("pf2: shader cache dir too long '%s' \n", dir);
+      cacheDir[0] = 0;
+      return;
+   }
+   strcpy(cacheDir, dir);
+}
+
+const char * ShaderCacheDir()
+{
+   return cacheDir[0] ? cacheDir : NULL;
+}
+
+unsigned long long ShaderCacheHash(const void * data, unsigned size, unsigned long long hash)
+{
+   const unsigned char * bytes = (const unsigned char *)data;
+   for (unsigned i = 0; i < size; i++) {
+      hash ^= bytes[i];
+      hash *= 0x100000001b3ULL; // FNV-1a 64 prime
+   }
+   return hash;
+}
+
+static void ShaderCacheName(unsigned long long hash, char * name, unsigned size)
+{
+   snprintf(name, size, "pf2_%016llx", hash);
+}
+
+static void ShaderCachePath(unsigned long long hash, char * path, unsigned size)
+{
+   char name[32];
+   ShaderCacheName(hash, name, sizeof(name));
+   snprintf(path, size, "%s/%s.bc", cacheDir, name);
+}
+
+bool ShaderCacheLoad(ShaderCacheEntry * entry)
+{
+   entry->map = NULL;
+   entry->mapSize = 0;
+   entry->bitcode = NULL;
+   entry->size = 0;
+   if (!ShaderCacheDir())
+      return false;
+
+   char path[sizeof(cacheDir) + 32];
+   ShaderCachePath(entry->hash, path, sizeof(path));
+   int fd = open(path, O_RDONLY);
+   if (fd < 0)
+      return false;
+   struct stat st;
+   if (fstat(fd, &st) || st.st_size <= (off_t)sizeof(ShaderCacheHeader)) {
+      close(fd);
+      return false;
+   }
+   void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (MAP_FAILED == map)
+      return false;
+
+   const ShaderCacheHeader * header = (const ShaderCacheHeader *)map;
+   const char * bitcode = (const char *)(header + 1);
+   if (GGL_SHADER_CACHE_MAGIC != header->magic || GGL_SHADER_CACHE_VERSION != header->version ||
+         entry->hash != header->hash ||
+         st.st_size != (off_t)(sizeof(*header) + header->size) ||
+         ShaderCacheHash(bitcode, header->size) != header->checksum) {
+      LOGD("pf2: ignoring stale shader cache file '%s' \n", path);
+      munmap(map, st.st_size);
+      return false;
+   }
+
+   entry->map = map;
+   entry->mapSize = st.st_size;
+   entry->bitcode = bitcode;
+   entry->size = header->size;
+   return true;
+}
+
+void ShaderCacheUnload(ShaderCacheEntry * entry)
+{
+   if (entry->map)
+      munmap(entry->map, entry->mapSize);
+   entry->map = NULL;
+   entry->mapSize = 0;
+   entry->bitcode = NULL;
+   entry->size = 0;
+}
+
+void ShaderCacheStore(const ShaderCacheEntry * entry, const char * bitcode, unsigned size)
+{
+   if (!ShaderCacheDir())
+      return;
+
+   char path[sizeof(cacheDir) + 32], temp[sizeof(cacheDir) + 48];
+   ShaderCachePath(entry->hash, path, sizeof(path));
+   // written to a unique name then renamed, so readers never see a partial file; unique
+   // across threads too, since JitThread and the main thread may store the same entry
+   snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+
+   ShaderCacheHeader header;
+   memset(&header, 0, sizeof(header));
+   header.magic = GGL_SHADER_CACHE_MAGIC;
+   header.version = GGL_SHADER_CACHE_VERSION;
+   header.hash = entry->hash;
+   header.checksum = ShaderCacheHash(bitcode, size);
+   header.size = size;
+
+   const int fd = mkstemp(temp);
+   FILE * file = fd < 0 ? NULL : fdopen(fd, "wb");
+   if (!file) {
+      LOGD("pf2: could not create shader cache file '%s' \n", temp);
+      if (fd >= 0) {
+         close(fd);
+         unlink(temp);
+      }
+      return;
+   }
+   bool written = 1 == fwrite(&header, sizeof(header), 1, file) &&
+                  1 == fwrite(bitcode, size, 1, file);
+   written = 0 == fclose(file) && written;
+   if (!written || rename(temp, path)) {
+      LOGD("pf2: could not write shader cache file '%s' \n", path);
+      unlink(temp);
+   }
+}
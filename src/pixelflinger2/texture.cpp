@@ -386,22 +386,104 @@ void AddTextureFunctionMappings(llvm::Module * mod, llvm::ExecutionEngine * ee)
 }
 #endif // #if USE_LLVM_EXECUTIONENGINE && !USE_LLVM_TEXTURE_SAMPLER
 
+static unsigned TexelSize(const GGLPixelFormat format)
+{
+    switch (format)
+    {
+    case GGL_PIXEL_FORMAT_A_8:
+    case GGL_PIXEL_FORMAT_L_8:
+        return 1;
+    case GGL_PIXEL_FORMAT_RGB_565:
+    case GGL_PIXEL_FORMAT_LA_88:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+// texels of a level, including the padding of tiled and ETC1 levels to whole tiles
+static unsigned LevelTexels(const unsigned layout, const GGLPixelFormat format, unsigned width,
+                            unsigned height)
+{
+    width = width ? width : 1;
+    height = height ? height : 1;
+    if (GGLTexture::GGL_TEXTURE_TILED == layout || GGL_PIXEL_FORMAT_ETC1 == format)
+    {
+        const unsigned mask = (1 << GGL_TEXTURE_TILE_BITS) - 1;
+        width = (width + mask) & ~mask;
+        height = (height + mask) & ~mask;
+    }
+    return width * height;
+}
+
+// texel index of x, y in a level width texels wide; as TexelIndex in llvm_texture.cpp
+static unsigned TexelIndex(const unsigned layout, const unsigned x, const unsigned y,
+                           const unsigned width)
+{
+    if (GGLTexture::GGL_TEXTURE_TILED != layout)
+        return y * width + x;
+    const unsigned bits = GGL_TEXTURE_TILE_BITS, mask = (1 << bits) - 1;
+    const unsigned tile = (y >> bits) * ((width + mask) >> bits) + (x >> bits);
+    return (tile << (bits * 2)) | ((y & mask) << bits) | (x & mask);
+}
+
+unsigned GGLTextureLayoutSize(const GGLTexture * texture, unsigned layout)
+{
+    const unsigned faces = GL_TEXTURE_CUBE_MAP == texture->type ? 6 : 1;
+    const unsigned levelCount = texture->levelCount ? texture->levelCount : 1;
+    unsigned texels = 0;
+    for (unsigned i = 0; i < levelCount; i++)
+        texels += faces * LevelTexels(layout, texture->format, texture->width >> i,
+                                      texture->height >> i);
+    if (GGL_PIXEL_FORMAT_ETC1 == texture->format)
+        return texels / 2; // 64 bits per 4x4 block
+    return texels * TexelSize(texture->format);
+}
+
+void GGLTextureSetLayout(GGLTexture * texture, unsigned layout, void * levels)
+{
+    const unsigned faces = GL_TEXTURE_CUBE_MAP == texture->type ? 6 : 1;
+    const unsigned levelCount = texture->levelCount ? texture->levelCount : 1;
+    const unsigned size = TexelSize(texture->format);
+    const char * src = (const char *)texture->levels;
+    char * dst = (char *)levels;
+    if (GGL_PIXEL_FORMAT_ETC1 == texture->format) // always in blocks, whatever the layout
+        memcpy(dst, src, GGLTextureLayoutSize(texture, layout));
+    else
+        for (unsigned i = 0; i < levelCount; i++)
+        {
+            const unsigned width = texture->width >> i ? texture->width >> i : 1;
+            const unsigned height = texture->height >> i ? texture->height >> i : 1;
+            for (unsigned face = 0; face < faces; face++)
+            {
+                for (unsigned y = 0; y < height; y++)
+                    for (unsigned x = 0; x < width; x++)
+                        memcpy(dst + TexelIndex(layout, x, y, width) * size,
+                               src + TexelIndex(texture->layout, x, y, width) * size, size);
+                src += LevelTexels(texture->layout, texture->format, width, height) * size;
+                dst += LevelTexels(layout, texture->format, width, height) * size;
+            }
+        }
+    texture->levels = levels;
+    texture->layout = (GGLTexture::GGLTextureLayout)layout;
+}
+
 static void SetSampler(GGLInterface * iface, const unsigned sampler, GGLTexture * texture)
 {
     assert(GGL_MAXCOMBINEDTEXTUREIMAGEUNITS > sampler);
     GGL_GET_CONTEXT(ctx, iface);
-    if (!texture)
-        SetShaderVerifyFunctions(iface);
-    else if (ctx->state.textureState.textures[sampler].format != texture->format)
-        SetShaderVerifyFunctions(iface);
-    else if (ctx->state.textureState.textures[sampler].wrapS != texture->wrapS)
-        SetShaderVerifyFunctions(iface);
-    else if (ctx->state.textureState.textures[sampler].wrapT != texture->wrapT)
-        SetShaderVerifyFunctions(iface);
-    else if (ctx->state.textureState.textures[sampler].minFilter != texture->minFilter)
-        SetShaderVerifyFunctions(iface);
-    else if (ctx->state.textureState.textures[sampler].magFilter != texture->magFilter)
-        SetShaderVerifyFunctions(iface);
+#if USE_TILE_THREADS
+    TileRasterFinish(iface); // binned triangles sample the old texture
+#endif
+    // only format, wrap, filter and layout are part of the JIT key; NULL is the zeroed texture
+    const GGLTexture & current = ctx->state.textureState.textures[sampler];
+    GGLTexture none;
+    memset(&none, 0, sizeof(none));
+    const GGLTexture & next = texture ? *texture : none;
+    if (current.format != next.format || current.wrapS != next.wrapS ||
+            current.wrapT != next.wrapT || current.minFilter != next.minFilter ||
+            current.magFilter != next.magFilter || current.layout != next.layout)
+        SetShaderDirty(iface, GGL_DIRTY_TEXTURE << sampler);
              
     if (texture)
     {
@@ -410,6 +492,19 @@ static void SetSampler(GGLInterface * iface, const unsigned sampler, GGLTexture
         ctx->state.textureState.textureData[sampler] = texture->levels;
         ctx->state.textureState.textureDimensions[sampler * 2] = texture->width;
         ctx->state.textureState.textureDimensions[sampler * 2 + 1] = texture->height;
+
+        // levels of all faces follow the previous level of all faces, see GGLTextureLayoutSize
+        assert(GGL_MAXTEXTURELEVELS >= texture->levelCount);
+        assert(texture->levelCount <= 1 || (!(texture->width & (texture->width - 1)) &&
+                                            !(texture->height & (texture->height - 1))));
+        unsigned * levels = ctx->state.textureState.textureLevels + sampler * (GGL_MAXTEXTURELEVELS + 1);
+        const unsigned faces = GL_TEXTURE_CUBE_MAP == texture->type ? 6 : 1;
+        levels[0] = texture->levelCount ? texture->levelCount - 1 : 0;
+        levels[1] = 0;
+        for (unsigned i = 1; i <= levels[0]; i++)
+            levels[1 + i] = levels[i] + faces * LevelTexels(texture->layout, texture->format,
+                                                            texture->width >> (i - 1),
+                                                            texture->height >> (i - 1));
     }
     else
     {
@@ -417,6 +512,8 @@ static void SetSampler(GGLInterface * iface, const unsigned sampler, GGLTexture
         ctx->state.textureState.textureData[sampler] = NULL;
         ctx->state.textureState.textureDimensions[sampler * 2] = 0;
         ctx->state.textureState.textureDimensions[sampler * 2 + 1] = 0;
+        memset(ctx->state.textureState.textureLevels + sampler * (GGL_MAXTEXTURELEVELS + 1), 0,
+               (GGL_MAXTEXTURELEVELS + 1) * sizeof(*ctx->state.textureState.textureLevels));
     }
 }
 
@@ -40,4 +40,7 @@ void tex2d_int32(unsigned sample[4], const float tex_coord[4], const unsigned sa
 
 void InitializeTextureFunctions(struct GGLInterface * iface);
 
+// whether LLVM tex2D of sampler needs texcoord derivatives to pick filter or mipmap level
+bool tex2DLod(const struct GGLState * gglCtx, const unsigned sampler);
+
 #endif // #ifndef _TEXTURE_H_
\ No newline at end of file
@@ -0,0 +1,438 @@
+/**
+ **
+ ** Copyright 2011, The Android Open Source Project
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "pixelflinger2.h"
+#include "src/mesa/main/mtypes.h"
+#include "src/mesa/program/prog_uniform.h"
+
+#if USE_TILE_THREADS
+
+// Triangles are binned into GGL_TILE_SIZE square screen tiles. A full batch (or one
+// that must end because the program or its uniforms changed) is handed to the raster
+// threads with a single handshake; thread i rasters every tile with index % count == i,
+// so each tile's color, depth and stencil memory stays with one thread.
+// Two batches alternate so binning continues while the threads raster the previous one.
+
+struct BinnedTriangle {
+   VertexOutput v[3];
+   GGLActiveStencil activeStencil; // selected by facing during DrawTriangle
+};
+
+struct TileBatch {
+   BinnedTriangle * triangles; // GGL_TILE_BATCH_TRIANGLES
+   unsigned triangleCount;
+   unsigned short * bins; // tileCount * GGL_TILE_BATCH_TRIANGLES triangle indices
+   unsigned * binCounts; // tileCount
+   RasterTarget target;
+   float (*uniforms)[4]; // copy of program uniforms, target.constants points here
+   unsigned uniformSlots, uniformCapacity;
+};
+
+struct TileRaster {
+   unsigned threadCount; // raster threads, 1 means raster on calling thread
+   unsigned tilesX, tilesY; // for current batch surface size, 0 before first bin
+   TileBatch batches[2];
+   unsigned current; // batch being binned
+
+   pthread_t * threads;
+   unsigned startedThreads;
+   pthread_mutex_t lock;
+   pthread_cond_t kickCond; // signaled by main when assigned batch is set
+   pthread_cond_t doneCond; // signaled by last thread finishing assigned batch
+   const TileBatch * assigned; // batch being rastered by threads
+   unsigned generation; // incremented for each assigned batch
+   unsigned pending; // threads still working on assigned batch
+   bool quit;
+   unsigned finishes; // TileRasterFinish calls, see TileRasterFinishes
+
+#if USE_RASTER_COUNTERS
+   GGLCounters * threadCounters; // one per started thread, added up by TileRasterCounters
+   unsigned long long waitTime; // of calling thread in WaitTileThreads
+#endif
+};
+
+struct TileThreadArgs {
+   TileRaster * tiles;
+   unsigned index;
+   unsigned generation; // at creation, so a batch kicked before the thread runs is not missed
+};
+
+static void RasterTiles(const TileRaster * tiles, const TileBatch * batch,
+                        const unsigned first, const unsigned stride)
+{
+#if USE_RASTER_COUNTERS
+   RasterTarget target = batch->target; // counting into this thread's counters
+   if (tiles->threadCounters)
+      target.counters = tiles->threadCounters + first;
+   StageTimer timer(target.counters->rasterTime);
+#else
+   const RasterTarget & target = batch->target;
+#endif
+   const unsigned tileCount = tiles->tilesX * tiles->tilesY;
+   for (unsigned tile = first; tile < tileCount; tile += stride) {
+      const unsigned count = batch->binCounts[tile];
+      if (!count)
+         continue;
+      RasterRect rect;
+      rect.left = (tile % tiles->tilesX) * GGL_TILE_SIZE;
+      rect.top = (tile / tiles->tilesX) * GGL_TILE_SIZE;
+      rect.right = MIN2(rect.left + GGL_TILE_SIZE, (int)batch->target.width);
+      rect.bottom = MIN2(rect.top + GGL_TILE_SIZE, (int)batch->target.height);
+      const unsigned short * bin = batch->bins + tile * GGL_TILE_BATCH_TRIANGLES;
+      for (unsigned i = 0; i < count; i++) {
+         BinnedTriangle * triangle = batch->triangles + bin[i];
+         RasterTriangleRect(&target, &rect, &triangle->activeStencil,
+                            triangle->v + 0, triangle->v + 1, triangle->v + 2);
+      }
+   }
+}
+
+static void * TileThread(void * threadArgs)
+{
+   TileThreadArgs * args = (TileThreadArgs *)threadArgs;
+   TileRaster * tiles = args->tiles;
+   const unsigned index = args->index;
+   unsigned generation = args->generation;
+   free(args);
+
+   pthread_mutex_lock(&tiles->lock);
+   while (true) {
+      while (generation == tiles->generation && !tiles->quit)
+         pthread_cond_wait(&tiles->kickCond, &tiles->lock);
+      if (tiles->quit)
+         break;
+      generation = tiles->generation;
+      const TileBatch * batch = tiles->assigned;
+      pthread_mutex_unlock(&tiles->lock);
+
+      RasterTiles(tiles, batch, index, tiles->threadCount);
+
+      pthread_mutex_lock(&tiles->lock);
+      if (0 == --tiles->pending)
+         pthread_cond_signal(&tiles->doneCond);
+   }
+   pthread_mutex_unlock(&tiles->lock);
+   return NULL;
+}
+
+static void WaitTileThreads(TileRaster * tiles)
+{
+   if (!tiles->startedThreads)
+      return;
+#if USE_RASTER_COUNTERS
+   StageTimer timer(tiles->waitTime);
+#endif
+   pthread_mutex_lock(&tiles->lock); // also orders the threads' surface writes before ours
+   while (tiles->pending)
+      pthread_cond_wait(&tiles->doneCond, &tiles->lock);
+   pthread_mutex_unlock(&tiles->lock);
+}
+
+static void StartTileThreads(TileRaster * tiles)
+{
+   tiles->threads = (pthread_t *)calloc(tiles->threadCount, sizeof(*tiles->threads));
+#if USE_RASTER_COUNTERS
+   tiles->threadCounters = (GGLCounters *)calloc(tiles->threadCount, sizeof(*tiles->threadCounters));
+#endif
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+   for (unsigned i = 0; i < tiles->threadCount; i++) {
+      TileThreadArgs * args = (TileThreadArgs *)malloc(sizeof(*args));
+      args->tiles = tiles;
+      args->index = i;
+      args->generation = tiles->generation;
+      int rc = pthread_create(tiles->threads + i, &attr, TileThread, args);
+      assert(!rc);
+      tiles->startedThreads++;
+   }
+   pthread_attr_destroy(&attr);
+}
+
+static void StopTileThreads(TileRaster * tiles)
+{
+   WaitTileThreads(tiles);
+   if (!tiles->startedThreads)
+      return;
+   pthread_mutex_lock(&tiles->lock);
+   tiles->quit = true;
+   pthread_cond_broadcast(&tiles->kickCond);
+   pthread_mutex_unlock(&tiles->lock);
+   for (unsigned i = 0; i < tiles->startedThreads; i++)
+      pthread_join(tiles->threads[i], NULL);
+   free(tiles->threads);
+   tiles->threads = NULL;
+#if USE_RASTER_COUNTERS
+   free(tiles->threadCounters);
+   tiles->threadCounters = NULL;
+#endif
+   tiles->startedThreads = 0;
+   tiles->quit = false;
+}
+
+static void ResetBatch(const TileRaster * tiles, TileBatch * batch)
+{
+   if (batch->triangleCount)
+      memset(batch->binCounts, 0, tiles->tilesX * tiles->tilesY * sizeof(*batch->binCounts));
+   batch->triangleCount = 0;
+   batch->target.program = NULL;
+}
+
+// hands the current batch to raster threads and starts binning into the other batch
+static void KickBatch(TileRaster * tiles)
+{
+   TileBatch * batch = tiles->batches + tiles->current;
+   if (!batch->triangleCount)
+      return;
+   if (tiles->threadCount <= 1) {
+      RasterTiles(tiles, batch, 0, 1);
+      ResetBatch(tiles, batch);
+      return;
+   }
+   if (!tiles->startedThreads)
+      StartTileThreads(tiles);
+   WaitTileThreads(tiles);
+
+   pthread_mutex_lock(&tiles->lock);
+   tiles->assigned = batch;
+   tiles->pending = tiles->threadCount;
+   tiles->generation++;
+   pthread_cond_broadcast(&tiles->kickCond);
+   pthread_mutex_unlock(&tiles->lock);
+
+   tiles->current ^= 1;
+   ResetBatch(tiles, tiles->batches + tiles->current);
+}
+
+static void FreeBins(TileRaster * tiles)
+{
+   for (unsigned i = 0; i < 2; i++) {
+      free(tiles->batches[i].bins);
+      free(tiles->batches[i].binCounts);
+      tiles->batches[i].bins = NULL;
+      tiles->batches[i].binCounts = NULL;
+   }
+   tiles->tilesX = tiles->tilesY = 0;
+}
+
+// (re)allocate bins when surface size changes; batches must be empty
+static void ResizeBins(TileRaster * tiles, const unsigned width, const unsigned height)
+{
+   const unsigned tilesX = (width + GGL_TILE_SIZE - 1) / GGL_TILE_SIZE;
+   const unsigned tilesY = (height + GGL_TILE_SIZE - 1) / GGL_TILE_SIZE;
+   if (tilesX == tiles->tilesX && tilesY == tiles->tilesY)
+      return;
+   FreeBins(tiles);
+   for (unsigned i = 0; i < 2; i++) {
+      TileBatch & batch = tiles->batches[i];
+      batch.bins = (unsigned short *)malloc(tilesX * tilesY * GGL_TILE_BATCH_TRIANGLES *
+                                            sizeof(*batch.bins));
+      batch.binCounts = (unsigned *)calloc(tilesX * tilesY, sizeof(*batch.binCounts));
+   }
+   tiles->tilesX = tilesX;
+   tiles->tilesY = tilesY;
+}
+
+// snapshots the state the batch is rastered with
+static void BeginBatch(const GGLContext * ctx, TileBatch * batch)
+{
+   RasterTarget & target = batch->target;
+   GetFragmentFunction(&ctx->interface, ctx->CurrentProgram, &target);
+   target.colorFormat = ctx->frameSurface.format;
+   target.frame = ctx->frameSurface.data;
+   target.depth = (int *)ctx->depthSurface.data;
+   target.stencil = (unsigned char *)ctx->stencilSurface.data;
+   target.width = ctx->frameSurface.width;
+   target.height = ctx->frameSurface.height;
+   target.counters = &ctx->counters; // of the calling thread if it rasters, see RasterTiles
+
+   batch->uniformSlots = ctx->CurrentProgram->Uniforms ? ctx->CurrentProgram->Uniforms->Slots : 0;
+   if (batch->uniformSlots > batch->uniformCapacity) {
+      free(batch->uniforms);
+      batch->uniforms = (float (*)[4])memalign(16, batch->uniformSlots * sizeof(*batch->uniforms));
+      batch->uniformCapacity = batch->uniformSlots;
+   }
+   if (batch->uniformSlots)
+      memcpy(batch->uniforms, ctx->CurrentProgram->ValuesUniform,
+             batch->uniformSlots * sizeof(*batch->uniforms));
+   target.constants = batch->uniforms;
+}
+
+// batch can take more triangles if they are rastered with the same program and uniforms
+static bool BatchCompatible(const GGLContext * ctx, const TileBatch * batch)
+{
+   if (batch->target.program != ctx->CurrentProgram || batch->target.frame != ctx->frameSurface.data)
+      return false;
+   if (batch->uniformSlots && memcmp(batch->uniforms, ctx->CurrentProgram->ValuesUniform,
+                                     batch->uniformSlots * sizeof(*batch->uniforms)))
+      return false;
+   return true;
+}
+
+void TileRasterTriangle(const GGLInterface * iface, const VertexOutput * v1,
+                        const VertexOutput * v2, const VertexOutput * v3)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   TileRaster * tiles = ctx->tileRaster;
+   const int width = ctx->frameSurface.width, height = ctx->frameSurface.height;
+
+   // bounding box in pixels, grown by a pixel since RasterTrapezoid accumulates edges
+   const VectorComp_t minX = MIN2(MIN2(v1->position.x, v2->position.x), v3->position.x);
+   const VectorComp_t maxX = MAX2(MAX2(v1->position.x, v2->position.x), v3->position.x);
+   const VectorComp_t minY = MIN2(MIN2(v1->position.y, v2->position.y), v3->position.y);
+   const VectorComp_t maxY = MAX2(MAX2(v1->position.y, v2->position.y), v3->position.y);
+   if (!(maxX + 1 >= 0 && maxY + 1 >= 0 && minX - 1 < width && minY - 1 < height))
+      return; // outside or NaN
+   const int left = MAX2((int)minX - 1, 0), right = MIN2((int)maxX + 1, width - 1);
+   const int top = MAX2((int)minY - 1, 0), bottom = MIN2((int)maxY + 1, height - 1);
+
+   TileBatch * batch = tiles->batches + tiles->current;
+   if (batch->triangleCount && (GGL_TILE_BATCH_TRIANGLES == batch->triangleCount ||
+                                !BatchCompatible(ctx, batch))) {
+      KickBatch(tiles);
+      batch = tiles->batches + tiles->current;
+   }
+   if (!batch->triangleCount) {
+      if (tiles->tilesX != (unsigned)(width + GGL_TILE_SIZE - 1) / GGL_TILE_SIZE ||
+            tiles->tilesY != (unsigned)(height + GGL_TILE_SIZE - 1) / GGL_TILE_SIZE) {
+         WaitTileThreads(tiles);
+         ResizeBins(tiles, width, height);
+      }
+      BeginBatch(ctx, batch);
+   }
+
+   const unsigned short index = batch->triangleCount++;
+   BinnedTriangle * triangle = batch->triangles + index;
+   triangle->v[0] = *v1;
+   triangle->v[1] = *v2;
+   triangle->v[2] = *v3;
+   triangle->activeStencil = ctx->activeStencil;
+
+   for (int ty = top / GGL_TILE_SIZE; ty <= bottom / GGL_TILE_SIZE; ty++)
+      for (int tx = left / GGL_TILE_SIZE; tx <= right / GGL_TILE_SIZE; tx++) {
+         const unsigned tile = ty * tiles->tilesX + tx;
+         batch->bins[tile * GGL_TILE_BATCH_TRIANGLES + batch->binCounts[tile]++] = index;
+      }
+}
+
+void TileRasterFinish(const GGLInterface * iface)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   TileRaster * tiles = ctx->tileRaster;
+   if (!tiles)
+      return; // during InitializeGGLState
+   KickBatch(tiles);
+   WaitTileThreads(tiles);
+   tiles->finishes++;
+}
+
+unsigned TileRasterFinishes(const GGLInterface * iface)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   return ctx->tileRaster ? ctx->tileRaster->finishes : 0;
+}
+
+void TileRasterFlush(const GGLInterface * iface)
+{
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   if (ctx->tileRaster)
+      KickBatch(ctx->tileRaster);
+}
+
+void TileRasterCounters(const GGLInterface * iface, GGLCounters * counters)
+{
+#if USE_RASTER_COUNTERS
+   GGL_GET_CONST_CONTEXT(ctx, iface);
+   TileRaster * tiles = ctx->tileRaster;
+   counters->waitTime += tiles->waitTime;
+   tiles->waitTime = 0;
+   for (unsigned i = 0; tiles->threadCounters && i < tiles->startedThreads; i++) {
+      GGLCounters & thread = tiles->threadCounters[i];
+      counters->scanlines += thread.scanlines;
+      counters->pixels += thread.pixels;
+      counters->stencilRejects += thread.stencilRejects;
+      counters->depthRejects += thread.depthRejects;
+      counters->shaded += thread.shaded;
+      counters->blended += thread.blended;
+      counters->rasterTime += thread.rasterTime;
+      memset(&thread, 0, sizeof(thread));
+   }
+#endif
+}
+
+static void Finish(const GGLInterface * iface)
+{
+   TileRasterFinish(iface);
+}
+
+static void SetThreadCount(GGLInterface * iface, unsigned count)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   TileRaster * tiles = ctx->tileRaster;
+   TileRasterFinish(iface);
+   TileRasterCounters(iface, &ctx->counters); // before their threads go
+   StopTileThreads(tiles);
+   if (!count) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      count = cpus > 0 ? cpus : 1;
+   }
+   tiles->threadCount = count;
+}
+
+void InitializeTileRaster(GGLInterface * iface)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   TileRaster * tiles = (TileRaster *)calloc(1, sizeof(TileRaster));
+   for (unsigned i = 0; i < 2; i++)
+      tiles->batches[i].triangles = (BinnedTriangle *)memalign(16, GGL_TILE_BATCH_TRIANGLES *
+                                    sizeof(BinnedTriangle));
+   pthread_mutex_init(&tiles->lock, NULL);
+   pthread_cond_init(&tiles->kickCond, NULL);
+   pthread_cond_init(&tiles->doneCond, NULL);
+   ctx->tileRaster = tiles;
+
+   iface->Finish = Finish;
+   iface->SetThreadCount = SetThreadCount;
+   SetThreadCount(iface, 0); // threads are started lazily
+}
+
+void DestroyTileRaster(GGLInterface * iface)
+{
+   GGL_GET_CONTEXT(ctx, iface);
+   TileRaster * tiles = ctx->tileRaster;
+   if (!tiles)
+      return;
+   TileRasterFinish(iface);
+   StopTileThreads(tiles);
+   FreeBins(tiles);
+   for (unsigned i = 0; i < 2; i++) {
+      free(tiles->batches[i].triangles);
+      free(tiles->batches[i].uniforms);
+   }
+   pthread_cond_destroy(&tiles->kickCond);
+   pthread_cond_destroy(&tiles->doneCond);
+   pthread_mutex_destroy(&tiles->lock);
+   free(tiles);
+   ctx->tileRaster = NULL;
+}
+
+#endif // #if USE_TILE_THREADS
@@ -519,6 +519,26 @@ void hieralloc_report_brief(const void * ptr, FILE * file)
 		ptr, data[0], data[1], data[2], data[3]);
 }
 
+static unsigned _hieralloc_total_size(const hieralloc_header_t * header)
+{
+	check_header(header);
+	unsigned size = header->size;
+	const hieralloc_header_t * child = header->child;
+	while (child)
+	{
+		size += _hieralloc_total_size(child);
+		child = child->nextSibling;
+	}
+	return size;
+}
+
+unsigned hieralloc_total_size(const void * ptr)
+{
+	if (NULL == ptr)
+		ptr = &hieralloc_global_header + 1;
+	return _hieralloc_total_size(get_header(ptr));
+}
+
 void hieralloc_report_lineage(const void * ptr, FILE * file, int tab)
 {
    const hieralloc_header_t * header = get_header(ptr);
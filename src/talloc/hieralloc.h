@@ -91,6 +91,9 @@ void hieralloc_report(const void * ptr, FILE * file);
 
 void hieralloc_report_brief(const void * ptr, FILE * file);
 
+// bytes allocated for self and all descendants
+unsigned hieralloc_total_size(const void * ptr);
+
 void hieralloc_report_lineage(const void * ptr, FILE * file, int tab);
 
 int hieralloc_find(const void * top, const void * ptr, FILE * file, int tab);
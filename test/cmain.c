@@ -202,7 +202,7 @@ int cmain(int argc, char **argv)
    ggl->ShaderAttributeBind(program0, 2, "aTexCoord");
    ggl->ShaderAttributeBind(program0, 3, "aPosition");
 
-   GLboolean linkStatus = ggl->ShaderProgramLink(program0, &infoLog);
+   GLboolean linkStatus = ggl->ShaderProgramLink(ggl, program0, &infoLog);
    if (!linkStatus)
       fprintf(stderr, "failed to link program 0, infoLog: \n %s \n", infoLog);
    assert(linkStatus);
@@ -225,7 +225,7 @@ int cmain(int argc, char **argv)
 
    Vector4 uVec4 = {1.125f, 1.5f, 1.75f, 1.75f};
    int uVec4Loc = ggl->ShaderUniformLocation(program0, "uVec4");
-   ggl->ShaderUniform(program0, uVec4Loc, 1, &uVec4, GL_FLOAT_VEC4);
+   ggl->ShaderUniform(ggl, program0, uVec4Loc, 1, &uVec4, GL_FLOAT_VEC4);
 
    VertexInput_t v0 = {0};
    v0.attributes[2] = VECTOR4_CTR(0,0,1,1); // aTexCoord
@@ -78,7 +78,7 @@ gl_shader_program * init_shader()
    ggl->ShaderAttach(ggl, program, vertShader);
    ggl->ShaderAttach(ggl, program, fragShader);
    const char * infoLog = NULL;
-   GLboolean linkStatus = ggl->ShaderProgramLink(program, &infoLog);
+   GLboolean linkStatus = ggl->ShaderProgramLink(ggl, program, &infoLog);
 
    printf("finished linking, LinkStatus=%d \n %s \n", linkStatus, infoLog);
 
@@ -90,7 +90,8 @@ gl_shader_program * init_shader()
    return program;
 }
 
-void test_scan()
+// drawElements draws the cube with one DrawElements, else with DrawTriangle per triangle
+void test_scan(const bool drawElements)
 {
    srand(1337);
    ggl = CreateGGLInterface();
@@ -146,7 +147,8 @@ void test_scan()
    texture.type = GL_TEXTURE_2D;
    texture.levelCount = 1;
    texture.wrapS = texture.wrapT = GGLTexture::GGL_REPEAT; // repeat = 0 fastest, clamp = 1, mirrored = 2
-   texture.minFilter = texture.magFilter = GGLTexture::GGL_NEAREST; // nearest = 0, linear = 1
+   texture.minFilter = GGLTexture::GGL_NEAREST; // nearest = 0, linear = 1
+   texture.magFilter = GGLTexture::GGL_NEAREST;
    //texture.levelCount = GenerateMipmaps(texture.levels, texture.width, texture.height);
 
    //    static unsigned texels [6] = {0xff0000ff, 0xff00ff00, 0xffff0000,
@@ -202,7 +204,7 @@ void test_scan()
    void * levels [1] = {cubeTextureSurface};
    cubeTexture.levels = levels;
    if (program) {
-      ggl->ShaderUniformMatrix(program, 4, 4, uMatrixLoc, 1, GL_FALSE, m0.m);
+      ggl->ShaderUniformMatrix(ggl, program, 4, 4, uMatrixLoc, 1, GL_FALSE, m0.m);
       int sampler2dLoc = ggl->ShaderUniformLocation(program, "sampler2d");
       int samplercubeLoc = ggl->ShaderUniformLocation(program, "samplercube");
       int samplerUnit = -1;
@@ -314,9 +316,9 @@ void test_scan()
 
       float t = i * 0.6f;
       if (program) {
-         ggl->ShaderUniformMatrix(program, 4, 4, uMatrixLoc, 1, GL_FALSE, m4.m);
-         ggl->ShaderUniformMatrix(program, 4, 4, uRotMLoc, 1, GL_FALSE, m2.m);
-         ggl->ShaderUniform(program, uTLoc, 1, &t, GL_FLOAT);
+         ggl->ShaderUniformMatrix(ggl, program, 4, 4, uMatrixLoc, 1, GL_FALSE, m4.m);
+         ggl->ShaderUniformMatrix(ggl, program, 4, 4, uRotMLoc, 1, GL_FALSE, m2.m);
+         ggl->ShaderUniform(ggl, program, uTLoc, 1, &t, GL_FLOAT);
       }
 
       //ggl->EnableDisable(ggl, GL_BLEND, true);
@@ -325,8 +327,12 @@ void test_scan()
       //ggl->EnableDisable(ggl, GL_STENCIL_TEST, i / 2 % 2);
       //ggl->BlendColor(ggl,(float)i / 10, (float) i / 15, (float)i < 20, 1);
 
-      for (unsigned j = 0; j < sizeof(indices) / sizeof(*indices); j += 3)
-         ggl->DrawTriangle(ggl, vertices + indices[j], vertices + indices[j+1], vertices + indices[j+2]);
+      if (drawElements)
+         ggl->DrawElements(ggl, GL_TRIANGLES, sizeof(indices) / sizeof(*indices), indices, vertices);
+      else
+         for (unsigned j = 0; j < sizeof(indices) / sizeof(*indices); j += 3)
+            ggl->DrawTriangle(ggl, vertices + indices[j], vertices + indices[j+1], vertices + indices[j+2]);
+      ggl->Finish(ggl); // wait for raster threads before reading frameSurface
 
       // including clear, depth, and other ops, direct ScanLine calls are 4% faster than DrawTriangle
       // X86 memcpy is 0.60ms vs 4.90ms for 480*800 fs texturing
@@ -416,15 +422,18 @@ void test_scan()
    //*/
 
    float elapsed = (float)(clock() - c0) / CLOCKS_PER_SEC;
-   printf ("\n *** test_scan elapsed CPU time: %fs \n *** fps=%.2f, tpf=%.2fms \n",
-           elapsed, frames / elapsed, elapsed / frames * 1000);
+   printf ("\n *** test_scan %s elapsed CPU time: %fs \n *** fps=%.2f, tpf=%.2fms \n",
+           drawElements ? "DrawElements" : "DrawTriangle", elapsed, frames / elapsed,
+           elapsed / frames * 1000);
 #if USE_16BPP_TEXTURE
    puts("USE_16BPP_TEXTURE");
 #endif
 #ifdef __arm__
-   SaveBMP("/sdcard/mesa.bmp", (unsigned *)frameSurface.data, frameSurface.width, frameSurface.height);
+   SaveBMP(drawElements ? "/sdcard/mesa_elements.bmp" : "/sdcard/mesa.bmp",
+           (unsigned *)frameSurface.data, frameSurface.width, frameSurface.height);
 #else
-   SaveBMP("mesa.bmp", (unsigned *)frameSurface.data, frameSurface.width, frameSurface.height);
+   SaveBMP(drawElements ? "mesa_elements.bmp" : "mesa.bmp",
+           (unsigned *)frameSurface.data, frameSurface.width, frameSurface.height);
 #endif
 
    ggl->SetBuffer(ggl, GL_COLOR_BUFFER_BIT, NULL);
@@ -466,7 +475,8 @@ int main (int argc, char * const argv[])
    
 //   contextless_test();
    
-   test_scan();
+   test_scan(false);
+   test_scan(true);
    
 //   hieralloc_report(NULL, stdout);
    hieralloc_report_brief(NULL, stdout);